@@ -5,11 +5,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "config.h"
 #include "dataset.h"
+#include "half.h"
+#include "hogwild.h"
 #include "linalg.h"
+#include "metrics.h"
+#include "model.h"
+#include "numa.h"
 #include "optim.h"
+#include "perf.h"
+#include "plan.h"
+#include "sweep.h"
 #include "tensor.h"
+#include "thread_team.h"
+#include "topk.h"
+#include "trace.h"
 #include "utils.h"
 
 void test_bcast() {
@@ -28,6 +41,40 @@ void test_bcast() {
     assert(fabs(x_data[1] - 20.0) < 1e-5);
 }
 
+void test_tensor_gather() {
+    Tensor* src = tensor_alloc(shapeN(3, 4, 1, 3), DTYPE_FLOAT32);
+    float* src_data = (float*)src->data;
+    for (size_t i = 0; i < src->size; ++i) src_data[i] = (float)i;
+    Tensor* dest = tensor_alloc(shapeN(3, 3, 1, 3), DTYPE_FLOAT32);
+    size_t rows[] = {3, 0, 3};
+    int ret = tensor_gather(src, dest, rows, 3);
+    assert(ret == 0);
+    float want[] = {9, 10, 11, 0, 1, 2, 9, 10, 11};
+    float* dest_data = (float*)dest->data;
+    for (size_t i = 0; i < 9; ++i) assert(dest_data[i] == want[i]);
+
+    Tensor* labels = tensor_alloc(shapeN(1, 4), DTYPE_UINT8);
+    uint8_t label_values[] = {7, 8, 9, 6};
+    memcpy(labels->data, label_values, sizeof(label_values));
+    Tensor* picked = tensor_alloc(shapeN(1, 3), DTYPE_UINT8);
+    ret = tensor_gather(labels, picked, rows, 3);
+    assert(ret == 0);
+    uint8_t* picked_data = (uint8_t*)picked->data;
+    assert(picked_data[0] == 6 && picked_data[1] == 7 && picked_data[2] == 6);
+
+    size_t past_end[] = {1, 4, 2};
+    assert(tensor_gather(src, dest, past_end, 3) == 5);
+    assert(tensor_gather(src, dest, rows, 2) == 3);
+    assert(tensor_gather(src, picked, rows, 3) == 2);
+    Tensor* wide = tensor_alloc(shapeN(3, 3, 1, 4), DTYPE_FLOAT32);
+    assert(tensor_gather(src, wide, rows, 3) == 4);
+    tensor_free(src);
+    tensor_free(dest);
+    tensor_free(labels);
+    tensor_free(picked);
+    tensor_free(wide);
+}
+
 void test_bmm() {
     Tensor* x = tensor_alloc(shapeN(3, 1, 2, 2), DTYPE_FLOAT32);
     Tensor* y = tensor_alloc(shapeN(3, 1, 2, 2), DTYPE_FLOAT32);
@@ -175,6 +222,55 @@ void test_bmm_transpose_AB() {
     assert(passing);
 }
 
+// A layer of 3 inputs and 5 outputs on a batch of 4: the transposed
+// operands of both gradients are larger than the gradient they produce.
+void test_bmm_backward_wide() {
+    Tensor* x = tensor_alloc(shapeN(3, 1, 4, 3), DTYPE_FLOAT32);
+    Tensor* w = tensor_alloc(shapeN(3, 1, 3, 5), DTYPE_FLOAT32);
+    Tensor* y_grad = tensor_alloc(shapeN(3, 1, 4, 5), DTYPE_FLOAT32);
+    Tensor* x_grad = tensor_alloc(shapeN(3, 1, 4, 3), DTYPE_FLOAT32);
+    Tensor* w_grad = tensor_alloc(shapeN(3, 1, 3, 5), DTYPE_FLOAT32);
+    RNG rng;
+    rng.state = 9;
+    tensor_fill_rand_normal(x, &rng);
+    tensor_fill_rand_normal(w, &rng);
+    tensor_fill_rand_normal(y_grad, &rng);
+    // bmm adds into its output.
+    tensor_fill_float(x_grad, 0.0f);
+    tensor_fill_float(w_grad, 0.0f);
+
+    int ret = bmm_backward(x, w, y_grad, x_grad, w_grad);
+    assert(ret == 0);
+    const float* xd = (const float*)x->data;
+    const float* wd = (const float*)w->data;
+    const float* gd = (const float*)y_grad->data;
+    const float* x_got = (const float*)x_grad->data;
+    const float* w_got = (const float*)w_grad->data;
+    for (size_t b = 0; b < 4; ++b) {
+        for (size_t i = 0; i < 3; ++i) {
+            float want = 0.0f;
+            for (size_t o = 0; o < 5; ++o) {
+                want += gd[b * 5 + o] * wd[i * 5 + o];
+            }
+            assert(fabs(x_got[b * 3 + i] - want) < 1e-5);
+        }
+    }
+    for (size_t i = 0; i < 3; ++i) {
+        for (size_t o = 0; o < 5; ++o) {
+            float want = 0.0f;
+            for (size_t b = 0; b < 4; ++b) {
+                want += xd[b * 3 + i] * gd[b * 5 + o];
+            }
+            assert(fabs(w_got[i * 5 + o] - want) < 1e-5);
+        }
+    }
+    tensor_free(x);
+    tensor_free(w);
+    tensor_free(y_grad);
+    tensor_free(x_grad);
+    tensor_free(w_grad);
+}
+
 void test_bmm_transpose_A_fuzz() {
     Tensor* x = tensor_alloc(shapeN(3, 1, 64, 64), DTYPE_FLOAT32);
     Tensor* x_perm = tensor_alloc(shapeN(3, 1, 64, 64), DTYPE_FLOAT32);
@@ -229,21 +325,714 @@ void test_bmm_transpose_B_fuzz() {
     }
 }
 
+void test_mlp_checkpoint() {
+    size_t sizes[] = {6, 5, 4, 4, 3};
+    RNG rng;
+    rng.state = 42;
+    Mlp m;
+    int ret = mlp_init(&m, sizes, 5, &rng);
+    assert(ret == 0);
+    Tensor* x = tensor_alloc(shapeN(3, 3, 1, 6), DTYPE_FLOAT32);
+    Tensor* y = tensor_alloc(shapeN(1, 3), DTYPE_UINT8);
+    tensor_fill_rand_normal(x, &rng);
+    uint8_t y_values[] = {0, 2, 1};
+    memcpy(y->data, y_values, sizeof(y_values));
+
+    Tensor* reference[MLP_MAX_PARAMS];
+    for (size_t i = 0; i < m.n_params; ++i) {
+        reference[i] = tensor_alloc(m.params[i]->shape, DTYPE_FLOAT32);
+    }
+    MlpWork w;
+    ret = mlp_work_init(&w, &m, 3, 0);
+    assert(ret == 0);
+    ret = mlp_forward(&m, &w, x);
+    assert(ret == 0);
+    ret = mlp_backward(&m, &w, x, y, reference);
+    assert(ret == 0);
+    mlp_work_free(&w);
+
+    size_t checkpoints[] = {1, 2, 3, 4};
+    for (size_t c = 0; c < 4; ++c) {
+        ret = mlp_work_init(&w, &m, 3, checkpoints[c]);
+        assert(ret == 0);
+        ret = mlp_forward(&m, &w, x);
+        assert(ret == 0);
+        ret = mlp_backward(&m, &w, x, y, m.grads);
+        assert(ret == 0);
+        for (size_t i = 0; i < m.n_params; ++i) {
+            float* got = (float*)m.grads[i]->data;
+            float* want = (float*)reference[i]->data;
+            for (size_t j = 0; j < m.grads[i]->size; ++j) {
+                assert(fabs(got[j] - want[j]) < 1e-6);
+            }
+        }
+        mlp_work_free(&w);
+    }
+    mlp_free(&m);
+}
+
+void test_mlp_eval_work() {
+    size_t sizes[] = {6, 5, 4, 4, 3};
+    RNG rng;
+    rng.state = 5;
+    Mlp m;
+    int ret = mlp_init(&m, sizes, 5, &rng);
+    assert(ret == 0);
+    Tensor* x = tensor_alloc(shapeN(3, 3, 1, 6), DTYPE_FLOAT32);
+    Tensor* y = tensor_alloc(shapeN(1, 3), DTYPE_UINT8);
+    tensor_fill_rand_normal(x, &rng);
+    uint8_t y_values[] = {2, 0, 1};
+    memcpy(y->data, y_values, sizeof(y_values));
+
+    MlpWork w;
+    ret = mlp_work_init(&w, &m, 3, 0);
+    assert(ret == 0);
+    float want_loss, want_acc;
+    ret = mlp_forward(&m, &w, x);
+    assert(ret == 0);
+    ret = mlp_metrics(&w, y, &want_loss, &want_acc);
+    assert(ret == 0);
+
+    // Bigger than needed, as for a test set tail.
+    MlpWork e;
+    ret = mlp_eval_work_init(&e, &m, 8);
+    assert(ret == 0);
+    float loss, acc;
+    ret = mlp_forward(&m, &e, x);
+    assert(ret == 0);
+    ret = mlp_metrics(&e, y, &loss, &acc);
+    assert(ret == 0);
+    assert(loss == want_loss && acc == want_acc);
+    ret = mlp_backward(&m, &e, x, y, m.grads);
+    assert(ret != 0);
+
+    mlp_work_free(&w);
+    mlp_work_free(&e);
+    tensor_free(x);
+    tensor_free(y);
+    free(x);
+    free(y);
+    mlp_free(&m);
+}
+
+void test_mlp_stages() {
+    size_t sizes[] = {6, 5, 4, 4, 3};
+    RNG rng;
+    rng.state = 7;
+    Mlp m;
+    int ret = mlp_init(&m, sizes, 5, &rng);
+    assert(ret == 0);
+    Tensor* x = tensor_alloc(shapeN(3, 3, 1, 6), DTYPE_FLOAT32);
+    Tensor* y = tensor_alloc(shapeN(1, 3), DTYPE_UINT8);
+    tensor_fill_rand_normal(x, &rng);
+    uint8_t y_values[] = {2, 0, 1};
+    memcpy(y->data, y_values, sizeof(y_values));
+    MlpWork w;
+    ret = mlp_work_init(&w, &m, 3, 0);
+    assert(ret == 0);
+    ret = mlp_forward(&m, &w, x);
+    assert(ret == 0);
+    ret = mlp_backward(&m, &w, x, y, m.grads);
+    assert(ret == 0);
+
+    // Layers 0-1 and 2-3 as two stages, the first one ending in tanh.
+    Mlp head;
+    Mlp tail;
+    ret = mlp_alloc(&head, sizes, 3);
+    assert(ret == 0);
+    ret = mlp_alloc(&tail, sizes + 2, 3);
+    assert(ret == 0);
+    head.activate_last = true;
+    for (size_t i = 0; i < 4; ++i) {
+        tensor_copy(head.params[i], m.params[i]);
+        tensor_copy(tail.params[i], m.params[4 + i]);
+    }
+    MlpWork head_w;
+    MlpWork tail_w;
+    ret = mlp_work_init(&head_w, &head, 3, 0);
+    assert(ret == 0);
+    ret = mlp_work_init(&tail_w, &tail, 3, 0);
+    assert(ret == 0);
+    Tensor* mid = &head_w.act[1];
+    Tensor* mid_grad = tensor_alloc(shapeN(3, 3, 1, 4), DTYPE_FLOAT32);
+    ret = mlp_forward(&head, &head_w, x);
+    assert(ret == 0);
+    ret = mlp_forward(&tail, &tail_w, mid);
+    assert(ret == 0);
+    float* got_logits = (float*)mlp_logits(&tail_w)->data;
+    float* want_logits = (float*)mlp_logits(&w)->data;
+    for (size_t j = 0; j < 9; ++j) assert(got_logits[j] == want_logits[j]);
+
+    Tensor* loss_grad = tensor_alloc(shapeN(3, 3, 1, 3), DTYPE_FLOAT32);
+    Tensor logits_2d;
+    Tensor loss_grad_2d;
+    tensor_view(&logits_2d, got_logits, shapeN(2, 3, 3), DTYPE_FLOAT32);
+    tensor_view(&loss_grad_2d, loss_grad->data, shapeN(2, 3, 3),
+                DTYPE_FLOAT32);
+    ret = cross_entropy_backward(&logits_2d, y, &loss_grad_2d);
+    assert(ret == 0);
+    ret = mlp_backward_from(&tail, &tail_w, mid, loss_grad, mid_grad,
+                            tail.grads);
+    assert(ret == 0);
+    ret = mlp_backward_from(&head, &head_w, x, mid_grad, NULL, head.grads);
+    assert(ret == 0);
+    for (size_t i = 0; i < 8; ++i) {
+        Tensor* got = i < 4 ? head.grads[i] : tail.grads[i - 4];
+        float* got_data = (float*)got->data;
+        float* want = (float*)m.grads[i]->data;
+        for (size_t j = 0; j < got->size; ++j) assert(got_data[j] == want[j]);
+    }
+    mlp_work_free(&w);
+    mlp_work_free(&head_w);
+    mlp_work_free(&tail_w);
+    mlp_free(&m);
+    mlp_free(&head);
+    mlp_free(&tail);
+}
+
+void test_plan() {
+    size_t sizes[] = {6, 5, 4, 3};
+    RNG rng;
+    rng.state = 7;
+    Mlp m;
+    int ret = mlp_init(&m, sizes, 4, &rng);
+    assert(ret == 0);
+    Tensor* x = tensor_alloc(shapeN(3, 4, 1, 6), DTYPE_FLOAT32);
+    Tensor* y = tensor_alloc(shapeN(1, 4), DTYPE_UINT8);
+    tensor_fill_rand_normal(x, &rng);
+    uint8_t y_values[] = {0, 2, 1, 2};
+    memcpy(y->data, y_values, sizeof(y_values));
+
+    Tensor* reference[MLP_MAX_PARAMS];
+    for (size_t i = 0; i < m.n_params; ++i) {
+        reference[i] = tensor_alloc(m.params[i]->shape, DTYPE_FLOAT32);
+    }
+    MlpWork w;
+    float loss = 0.0f;
+    ret = mlp_work_init(&w, &m, 4, 0);
+    assert(ret == 0);
+    ret = mlp_forward(&m, &w, x);
+    assert(ret == 0);
+    ret = mlp_metrics(&w, y, &loss, NULL);
+    assert(ret == 0);
+    ret = mlp_backward(&m, &w, x, y, reference);
+    assert(ret == 0);
+    mlp_work_free(&w);
+
+    Plan p;
+    ret = plan_build(&p, &m, x, y, true, 0.001f, 0.9f, 0.999f, 1e-08f);
+    assert(ret == 0);
+    assert(p.arena_bytes < p.naive_bytes);
+    ret = plan_run_step(&p);
+    assert(ret == 0);
+    assert(fabs(p.loss - loss) < 1e-6);
+    for (size_t i = 0; i < m.n_params; ++i) {
+        float* got = (float*)m.grads[i]->data;
+        float* want = (float*)reference[i]->data;
+        for (size_t j = 0; j < m.grads[i]->size; ++j) {
+            assert(fabs(got[j] - want[j]) < 1e-6);
+        }
+    }
+
+    float sequential_loss = p.loss;
+    for (size_t i = 0; i < m.n_params; ++i) {
+        tensor_copy(reference[i], m.grads[i]);
+        tensor_fill_float(m.grads[i], 0.0f);
+    }
+    Pool pool;
+    ret = pool_init(&pool, 3);
+    assert(ret == 0);
+    ret = plan_attach_pool(&p, &pool);
+    assert(ret == 0);
+    for (size_t run = 0; run < 4; ++run) {
+        ret = plan_run_step(&p);
+        assert(ret == 0);
+        assert(p.loss == sequential_loss);
+        for (size_t i = 0; i < m.n_params; ++i) {
+            float* got = (float*)m.grads[i]->data;
+            float* want = (float*)reference[i]->data;
+            for (size_t j = 0; j < m.grads[i]->size; ++j) {
+                assert(got[j] == want[j]);
+            }
+        }
+    }
+    plan_free(&p);
+    pool_free(&pool);
+    mlp_free(&m);
+}
+
+void test_thread_team() {
+    size_t sizes[] = {6, 5, 3};
+    RNG rng;
+    rng.state = 11;
+    Mlp m;
+    int ret = mlp_init(&m, sizes, 3, &rng);
+    assert(ret == 0);
+    Tensor* x = tensor_alloc(shapeN(3, 7, 1, 6), DTYPE_FLOAT32);
+    Tensor* y = tensor_alloc(shapeN(1, 7), DTYPE_UINT8);
+    tensor_fill_rand_normal(x, &rng);
+    uint8_t y_values[] = {0, 2, 1, 1, 0, 2, 2};
+    memcpy(y->data, y_values, sizeof(y_values));
+    MlpWork w;
+    ret = mlp_work_init(&w, &m, 7, 0);
+    assert(ret == 0);
+    float want_loss;
+    ret = mlp_forward(&m, &w, x);
+    assert(ret == 0);
+    ret = mlp_metrics(&w, y, &want_loss, NULL);
+    assert(ret == 0);
+    ret = mlp_backward(&m, &w, x, y, m.grads);
+    assert(ret == 0);
+
+    // Slices of 2, 2 and 3 samples.
+    Pool pool;
+    ret = pool_init(&pool, 3);
+    assert(ret == 0);
+    ThreadTeam team;
+    ret = thread_team_init(&team, &pool, &m, 7, 0);
+    assert(ret == 0);
+    Tensor* grads[MLP_MAX_PARAMS];
+    ret = mlp_grads_alloc(&m, grads);
+    assert(ret == 0);
+    float loss;
+    ret = thread_team_step(&team, x, y, grads, &loss, NULL);
+    assert(ret == 0);
+    assert(fabs(loss - want_loss) < 1e-5);
+    for (size_t i = 0; i < m.n_params; ++i) {
+        float* got = (float*)grads[i]->data;
+        float* want = (float*)m.grads[i]->data;
+        for (size_t j = 0; j < grads[i]->size; ++j) {
+            assert(fabs(got[j] - want[j]) < 1e-6);
+        }
+    }
+    thread_team_free(&team);
+    pool_free(&pool);
+    mlp_grads_free(&m, grads);
+    mlp_work_free(&w);
+    mlp_free(&m);
+}
+
+typedef struct {
+    pthread_t ran_on[4];
+    size_t runs[4];
+} EachTest;
+
+static void each_task(void* ctx, size_t i) {
+    EachTest* e = (EachTest*)ctx;
+    e->ran_on[i] = pthread_self();
+    e->runs[i]++;
+}
+
+void test_pool_run_each() {
+    Pool pool;
+    int ret = pool_init(&pool, 4);
+    assert(ret == 0);
+    EachTest e = {0};
+    for (size_t round = 0; round < 50; ++round) {
+        memset(e.ran_on, 0, sizeof(e.ran_on));
+        ret = pool_run_each(&pool, each_task, &e);
+        assert(ret == 0);
+        assert(pthread_equal(e.ran_on[0], pthread_self()));
+        for (size_t i = 1; i < 4; ++i) {
+            assert(pthread_equal(e.ran_on[i], pool.threads[i]));
+        }
+    }
+    for (size_t i = 0; i < 4; ++i) assert(e.runs[i] == 50);
+    pool_free(&pool);
+}
+
+void test_numa() {
+    // Two nodes of two cpus: workers alternate between them.
+    NumaTopology t = {0};
+    t.n_nodes = 2;
+    t.n_cpus = 4;
+    int cpus[] = {0, 1, 8, 9};
+    int nodes[] = {0, 0, 1, 1};
+    memcpy(t.cpus, cpus, sizeof(cpus));
+    memcpy(t.nodes, nodes, sizeof(nodes));
+    int got[6];
+    int got_nodes[6];
+    numa_spread(&t, 6, got, got_nodes);
+    int want[] = {0, 8, 1, 9, 0, 8};
+    for (size_t i = 0; i < 6; ++i) {
+        assert(got[i] == want[i]);
+        assert(got_nodes[i] == (int)(i % 2));
+    }
+
+    Pool pool;
+    int ret = pool_init(&pool, 3);
+    assert(ret == 0);
+    Tensor* x = tensor_alloc(shapeN(1, 10000), DTYPE_FLOAT32);
+    for (size_t i = 0; i < x->size; ++i) ((float*)x->data)[i] = (float)i;
+    size_t bytes = 0;
+    ret = numa_place_tensor(&pool, x, &bytes);
+    assert(ret == 0);
+    assert(bytes == 10000 * sizeof(float));
+    for (size_t i = 0; i < x->size; ++i) {
+        assert(((float*)x->data)[i] == (float)i);
+    }
+    pool_free(&pool);
+    tensor_free(x);
+    free(x);
+}
+
+void test_sweep() {
+    size_t sizes[] = {6, 5, 3};
+    float lr[] = {0.01f, 0.001f};
+    uint64_t seeds[] = {3, 4};
+    Sweep s;
+    int ret = sweep_init(&s, sizes, 3, lr, seeds, 2);
+    assert(ret == 0);
+    RNG rng;
+    rng.state = 4;
+    Mlp m;
+    ret = mlp_init(&m, sizes, 3, &rng);
+    assert(ret == 0);
+    Tensor* x = tensor_alloc(shapeN(3, 4, 1, 6), DTYPE_FLOAT32);
+    Tensor* y = tensor_alloc(shapeN(1, 4), DTYPE_UINT8);
+    tensor_fill_rand_normal(x, &rng);
+    uint8_t y_values[] = {0, 2, 1, 2};
+    memcpy(y->data, y_values, sizeof(y_values));
+
+    MlpWork w;
+    float loss = 0.0f;
+    ret = mlp_work_init(&w, &m, 4, 0);
+    assert(ret == 0);
+    ret = mlp_forward(&m, &w, x);
+    assert(ret == 0);
+    ret = mlp_metrics(&w, y, &loss, NULL);
+    assert(ret == 0);
+    ret = mlp_backward(&m, &w, x, y, m.grads);
+    assert(ret == 0);
+    ret = mlp_adam_step(&m, m.grads, 0.001f, 0.9f, 0.999f, 1e-08f, 1);
+    assert(ret == 0);
+
+    SweepWork sw;
+    ret = sweep_work_init(&sw, &s, 4);
+    assert(ret == 0);
+    ret = sweep_forward(&s, &sw, x);
+    assert(ret == 0);
+    ret = sweep_metrics(&s, &sw, y);
+    assert(ret == 0);
+    assert(fabs(sw.loss[1] - loss) < 1e-6);
+    ret = sweep_backward(&s, &sw, y);
+    assert(ret == 0);
+    ret = sweep_adam_step(&s, 0.9f, 0.999f, 1e-08f, 1);
+    assert(ret == 0);
+    // Model 1 of the sweep has model m's seed and lr.
+    for (size_t i = 0; i < m.n_params; ++i) {
+        size_t n = m.params[i]->size;
+        float* got = (float*)s.params[i]->data + n;
+        float* want = (float*)m.params[i]->data;
+        for (size_t j = 0; j < n; ++j) {
+            assert(fabs(got[j] - want[j]) < 1e-6);
+        }
+    }
+    sweep_work_free(&sw);
+    sweep_free(&s);
+    mlp_work_free(&w);
+    mlp_free(&m);
+}
+
+void test_half() {
+    float exact[] = {0.0f, 1.0f, -2.5f, 65504.0f, 6.103515625e-05f,
+                     5.9604644775390625e-08f, -0.333251953125f};
+    for (size_t i = 0; i < sizeof(exact) / sizeof(exact[0]); ++i) {
+        assert(half_to_float(float_to_half(exact[i])) == exact[i]);
+        assert(bf16_to_float(float_to_bf16(exact[i])) ==
+               bf16_to_float(float_to_bf16(
+                   bf16_to_float(float_to_bf16(exact[i])))));
+    }
+    assert(isinf(half_to_float(float_to_half(65520.0f))));
+    assert(half_to_float(float_to_half(65519.0f)) == 65504.0f);
+    assert(half_to_float(float_to_half(1.0f + 1.0f / 4096.0f)) == 1.0f);
+    assert(half_to_float(float_to_half(2.0e-08f)) == 0.0f);
+    assert(bf16_to_float(float_to_bf16(1.00390625f)) == 1.0f);
+    assert(bf16_to_float(float_to_bf16(3.0e38f)) > 2.9e38f);
+}
+
+void test_metrics() {
+    MetricsQueue q;
+    memset(&q, 0, sizeof(q));
+    MetricsRecord r;
+    memset(&r, 0, sizeof(r));
+    for (size_t i = 0; i < METRICS_QUEUE + 5; ++i) {
+        r.step = i;
+        assert(metrics_queue_put(&q, &r) == (i < METRICS_QUEUE));
+    }
+    assert(q.dropped == 5);
+    for (size_t i = 0; i < 3; ++i) {
+        assert(metrics_queue_take(&q, &r));
+        assert(r.step == i);
+    }
+    // Taking three makes room for three more, wrapping around the ring.
+    for (size_t i = 0; i < 4; ++i) {
+        r.step = 100 + i;
+        assert(metrics_queue_put(&q, &r) == (i < 3));
+    }
+    assert(q.dropped == 6);
+    for (size_t i = 3; i < METRICS_QUEUE + 3; ++i) {
+        assert(metrics_queue_take(&q, &r));
+        assert(r.step == (i < METRICS_QUEUE ? i : 100 + i - METRICS_QUEUE));
+    }
+    assert(!metrics_queue_take(&q, &r));
+
+    MetricsSums s = {0};
+    metrics_add(&s, 2.0f, 0.5f, 4);
+    metrics_add(&s, 1.0f, 1.0f, 4);
+    MetricsRecord done = {2, 30, true, 0.5, s, -1};
+    FILE* f = tmpfile();
+    assert(f != NULL);
+    metrics_write_csv(f, &done);
+    done.model = 3;
+    done.epoch_end = false;
+    metrics_write_csv(f, &done);
+    rewind(f);
+    char line[128];
+    assert(fgets(line, sizeof(line), f) != NULL);
+    assert(strcmp(line, "2,30,epoch,8,0.500000,1.500000,0.750000,\n") == 0);
+    assert(fgets(line, sizeof(line), f) != NULL);
+    assert(strcmp(line, "2,30,interval,8,0.500000,1.500000,0.750000,3\n") ==
+           0);
+    fclose(f);
+}
+
+// Skips one JSON value at *p, or returns false if there is none.
+bool skip_json(const char** p) {
+    const char* s = *p + strspn(*p, " \n");
+    if (*s == '{' || *s == '[') {
+        char close = *s == '{' ? '}' : ']';
+        s += strspn(s + 1, " \n") + 1;
+        if (*s == close) {
+            *p = s + 1;
+            return true;
+        }
+        for (;;) {
+            if (close == '}') {
+                s += strspn(s, " \n");
+                if (*s != '"' || !skip_json(&s)) return false;
+                s += strspn(s, " \n");
+                if (*s++ != ':') return false;
+            }
+            if (!skip_json(&s)) return false;
+            s += strspn(s, " \n");
+            if (*s == close) break;
+            if (*s++ != ',') return false;
+        }
+        *p = s + 1;
+        return true;
+    }
+    if (*s == '"') {
+        for (++s; *s != '"'; ++s) {
+            if (*s == '\0' || *s == '\n') return false;
+            if (*s == '\\' && *++s == '\0') return false;
+        }
+        *p = s + 1;
+        return true;
+    }
+    char* end;
+    strtod(s, &end);
+    if (end == s) return false;
+    *p = end;
+    return true;
+}
+
+bool is_json(const char* s) {
+    return skip_json(&s) && s[strspn(s, " \n")] == '\0';
+}
+
+void test_trace() {
+    assert(is_json("{\"a\":[1,-2.5e3,{}],\"b\":\"x\\\"y\"}"));
+    assert(!is_json("{\"a\":[1,]}"));
+    assert(!is_json("[1],"));
+
+    trace_enable(3);
+    double t0 = trace_now();
+    trace_span("inner", t0);
+    trace_async("async", t0);
+    trace_span("outer", t0);
+    trace_on = false;
+    size_t len = 0;
+    char* events = trace_events_json(&len);
+    assert(events != NULL && strlen(events) == len);
+    assert(strstr(events, "\"name\":\"inner\",\"ph\":\"X\",\"pid\":3") !=
+           NULL);
+    assert(strstr(events, "\"ph\":\"b\"") != NULL);
+    assert(strstr(events, "\"ph\":\"e\"") != NULL);
+
+    char path[] = "/tmp/rvs_trace_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    assert(trace_write_file(path, events, len) == 0);
+    free(events);
+    FILE* f = fopen(path, "r");
+    assert(f != NULL);
+    char text[1 << 14];
+    size_t n = fread(text, 1, sizeof(text) - 1, f);
+    assert(n < sizeof(text) - 1);
+    text[n] = '\0';
+    fclose(f);
+    unlink(path);
+    assert(is_json(text));
+    assert(strncmp(text, "{\"traceEvents\":[", 16) == 0);
+    trace_clear();
+}
+
+void* perf_thread(void* arg) {
+    (void)arg;
+    for (size_t i = 0; i < 2; ++i) {
+        PerfSample s;
+        PERF_BEGIN(&s);
+        PERF_END(&s, "bmm", shapeN(2, 4, 5), 40.0);
+    }
+    PerfSample s;
+    PERF_BEGIN(&s);
+    PERF_END(&s, "bmm", shapeN(2, 5, 4), 40.0);
+    return NULL;
+}
+
+void test_perf() {
+    perf_enable();
+    for (size_t i = 0; i < 3; ++i) {
+        PerfSample s;
+        PERF_BEGIN(&s);
+        PERF_END(&s, "bmm", shapeN(2, 4, 5), 40.0);
+    }
+    PerfSample s;
+    PERF_BEGIN(&s);
+    PERF_END(&s, "relu", shapeN(2, 4, 5), 20.0);
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, perf_thread, NULL);
+    assert(ret == 0);
+    pthread_join(thread, NULL);
+    perf_on = false;
+
+    static KernelStats stats[PERF_MAX_KERNELS];
+    size_t n_dropped = 1;
+    size_t n = perf_collect(stats, &n_dropped);
+    assert(n == 3);
+    assert(n_dropped == 0);
+    size_t calls = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const KernelStats* k = &stats[i];
+        assert(i == 0 || stats[i - 1].seconds >= k->seconds);
+        calls += k->calls;
+        if (strcmp(k->kernel, "relu") == 0) {
+            assert(k->calls == 1 && k->flops == 20.0);
+        } else if (k->shape.dims[0] == 4) {
+            assert(k->calls == 5 && k->flops == 200.0);
+        } else {
+            assert(k->calls == 1 && k->flops == 40.0);
+        }
+    }
+    assert(calls == 7);
+    perf_clear();
+    assert(perf_collect(stats, NULL) == 0);
+}
+
+void test_topk() {
+    float r[] = {0.5f, -3.0f, 2.0f, 0.0f, -2.0f, 2.0f, 1.0f, -0.5f};
+    size_t n = sizeof(r) / sizeof(r[0]);
+    float scratch[8];
+    size_t picked[8];
+
+    assert(topk_select(r, n, 1, 0.0f, scratch, picked) == 1);
+    assert(picked[0] == 1);
+
+    // Three entries tie at 2 for the second and third places.
+    assert(topk_select(r, n, 3, 0.0f, scratch, picked) == 3);
+    assert(picked[0] == 1 && picked[1] == 2 && picked[2] == 4);
+    assert(topk_select(r, n, 4, 0.0f, scratch, picked) == 4);
+    assert(picked[3] == 5);
+
+    // All of them but the zero.
+    assert(topk_select(r, n, n, 0.0f, scratch, picked) == n - 1);
+    for (size_t i = 0; i < n - 1; ++i) assert(picked[i] == i + (i >= 3));
+
+    // A threshold above the cut leaves fewer than k.
+    assert(topk_select(r, n, 6, 1.5f, scratch, picked) == 4);
+    assert(topk_select(r, n, n, 2.5f, scratch, picked) == 1);
+
+    float same[] = {-1.0f, 1.0f, 1.0f, -1.0f, 1.0f};
+    assert(topk_select(same, 5, 2, 0.0f, scratch, picked) == 2);
+    assert(picked[0] == 0 && picked[1] == 1);
+    assert(topk_select(same, 5, 5, 0.0f, scratch, picked) == 5);
+}
+
 bool verify_endianness() {
     uint16_t dummy = 0x0100;
     uint8_t* dummy_ptr = (uint8_t*)(&dummy);
     return dummy_ptr[0] == 0 && dummy_ptr[1] == 1;
 }
 
-int main(void) {
+// Mean loss and accuracy over the full batches of d, through the plan if
+// there is one.
+static int evaluate(Mlp* m, MlpWork* work, Plan* plan, const Dataset* d,
+                    Tensor* batch_x, Tensor* batch_y, double* loss,
+                    double* acc) {
+    size_t batch_size = batch_x->shape.dims[0];
+    double loss_sum = 0.0;
+    double acc_sum = 0.0;
+    size_t batches = 0;
+    for (size_t batch = 0; batch + batch_size <= d->n;
+         batch += batch_size) {
+        RETURN_IF_ERROR(
+            tensor_slice(d->x, batch_x, 0, batch, batch + batch_size));
+        RETURN_IF_ERROR(
+            tensor_slice(d->y, batch_y, 0, batch, batch + batch_size));
+        float batch_loss = 0.0f;
+        float batch_acc = 0.0f;
+        if (plan != NULL) {
+            RETURN_IF_ERROR(plan_run_step(plan));
+            batch_loss = plan->loss;
+            batch_acc = plan->acc;
+        } else {
+            RETURN_IF_ERROR(mlp_forward(m, work, batch_x));
+            RETURN_IF_ERROR(
+                mlp_metrics(work, batch_y, &batch_loss, &batch_acc));
+        }
+        loss_sum += batch_loss;
+        acc_sum += batch_acc;
+        batches++;
+    }
+    if (batches == 0) return 1;
+    *loss = loss_sum / batches;
+    *acc = acc_sum / batches;
+    return 0;
+}
+
+int main(int argc, char** argv) {
     test_bcast();
+    test_tensor_gather();
     test_bmm();
     test_bmm_transpose_A();
     test_bmm_transpose_B();
     test_bmm_transpose_AB();
+    test_bmm_backward_wide();
     test_bmm_transpose_A_fuzz();
     test_bmm_transpose_B_fuzz();
+    test_mlp_checkpoint();
+    test_mlp_eval_work();
+    test_mlp_stages();
+    test_plan();
+    test_thread_team();
+    test_pool_run_each();
+    test_numa();
+    test_sweep();
+    test_half();
+    test_metrics();
+    test_trace();
+    test_perf();
+    test_topk();
     assert(("Your system is big-endian", verify_endianness()));
+
+    Config c = config_default();
+    if (config_parse(argc, argv, &c)) {
+        return 1;
+    }
+    CHECK(c.sizes[0] == IMG_SIZE);
+
     Dataset d;
     RETURN_IF_ERROR(
         dataset_load_bin("data/train-labels.bin", "data/train-data.bin", &d));
@@ -251,192 +1040,203 @@ int main(void) {
     Dataset d_test;
     RETURN_IF_ERROR(dataset_load_bin("data/test-labels.bin",
                                      "data/test-data.bin", &d_test));
+    CHECK(c.batch_size <= d.n && c.batch_size <= d_test.n);
 
-    reshape(d.x, shapeN(3, d.n, 1, 784));
+    RETURN_IF_ERROR(reshape(d.x, shapeN(3, d.n, 1, IMG_SIZE)));
+    RETURN_IF_ERROR(reshape(d_test.x, shapeN(3, d_test.n, 1, IMG_SIZE)));
 
     float acc = 0.0f;
     float loss = 0.0f;
     size_t t = 0;
-    size_t epochs = 1;
-    float lr = 0.001f;
-    float beta1 = 0.9f;
-    float beta2 = 0.999f;
-    float eps = 1e-08f;
-    int batch_size = 8;
-
-    Tensor* layer1_weight = tensor_alloc(shapeN(2, 784, 256), DTYPE_FLOAT32);
-    Tensor* layer1_bias = tensor_alloc(shapeN(1, 256), DTYPE_FLOAT32);
-    Tensor* layer2_weight = tensor_alloc(shapeN(2, 256, 10), DTYPE_FLOAT32);
-    Tensor* layer2_bias = tensor_alloc(shapeN(1, 10), DTYPE_FLOAT32);
-
-    RETURN_IF_ERROR(reshape(layer1_weight, shapeN(3, 1, 784, 256)));
-    RETURN_IF_ERROR(reshape(d.x, shapeN(3, d.n, 1, 784)));
-    RETURN_IF_ERROR(reshape(layer2_weight, shapeN(3, 1, 256, 10)));
+    size_t batch_size = c.batch_size;
 
     RNG r;
-    r.state = 67;
-
-    tensor_fill_uniform(layer1_weight, &r);
-    tensor_fill_uniform(layer1_bias, &r);
-    tensor_fill_uniform(layer2_weight, &r);
-    tensor_fill_uniform(layer2_bias, &r);
-
-    float k1 = sqrtf(1.0 / 784.0);
-    float k2 = sqrtf(1.0 / 256.0);
-
-    tensor_scale_and_add_const(layer1_weight, 2 * k1, -k1);
-    tensor_scale_and_add_const(layer1_bias, 2 * k1, -k1);
-
-    tensor_scale_and_add_const(layer2_weight, 2 * k2, -k2);
-    tensor_scale_and_add_const(layer2_bias, 2 * k2, -k2);
-
-    // forward
-    Tensor* hidden_1 =
-        tensor_alloc(shapeN(3, batch_size, 1, 256), DTYPE_FLOAT32);
-    Tensor* hidden_1_grad =
-        tensor_alloc(shapeN(3, batch_size, 1, 256), DTYPE_FLOAT32);
-    Tensor* hidden_1_pre_tanh = tensor_alloc(hidden_1->shape, DTYPE_FLOAT32);
-    Tensor* layer1_bias_grad = tensor_alloc(layer1_bias->shape, DTYPE_FLOAT32);
-    Tensor* layer1_weight_grad =
-        tensor_alloc(layer1_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer1_weight_m = tensor_alloc(layer1_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer1_weight_v = tensor_alloc(layer1_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer1_bias_m = tensor_alloc(layer1_bias->shape, DTYPE_FLOAT32);
-    Tensor* layer1_bias_v = tensor_alloc(layer1_bias->shape, DTYPE_FLOAT32);
-    tensor_fill_float(layer1_weight_m, 0.0f);
-    tensor_fill_float(layer1_weight_v, 0.0f);
-    tensor_fill_float(layer1_bias_m, 0.0f);
-    tensor_fill_float(layer1_bias_v, 0.0f);
-
-    Tensor* argmax_out = tensor_alloc(shapeN(2, batch_size, 1), DTYPE_UINT8);
-
-    Tensor* hidden_2 =
-        tensor_alloc(shapeN(3, batch_size, 1, 10), DTYPE_FLOAT32);
-    Tensor* hidden_2_grad =
-        tensor_alloc(shapeN(2, batch_size, 10), DTYPE_FLOAT32);
-
-    Tensor* layer2_bias_grad = tensor_alloc(layer2_bias->shape, DTYPE_FLOAT32);
-    Tensor* layer2_weight_grad =
-        tensor_alloc(layer2_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer2_weight_m = tensor_alloc(layer2_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer2_weight_v = tensor_alloc(layer2_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer2_bias_m = tensor_alloc(layer2_bias->shape, DTYPE_FLOAT32);
-    Tensor* layer2_bias_v = tensor_alloc(layer2_bias->shape, DTYPE_FLOAT32);
-    tensor_fill_float(layer2_weight_m, 0.0f);
-    tensor_fill_float(layer2_weight_v, 0.0f);
-    tensor_fill_float(layer2_bias_m, 0.0f);
-    tensor_fill_float(layer2_bias_v, 0.0f);
+    rng_seed(&r, c.seed);
+
+    Mlp model;
+    RETURN_IF_ERROR(mlp_init(&model, c.sizes, c.n_sizes, &r));
+
+    if (c.n_sweep_lr > 0 || c.n_sweep_seeds > 0) {
+        CHECK(!c.use_plan && c.hogwild == 0 && c.checkpoint_every == 0);
+        RETURN_IF_ERROR(sweep_run(&c, &d, &d_test, &r));
+        mlp_free(&model);
+        dataset_free(&d);
+        dataset_free(&d_test);
+        return 0;
+    }
+
     Shape d_x_shape = d.x->shape;
     d_x_shape.dims[0] = batch_size;
     Shape d_y_shape = d.y->shape;
     d_y_shape.dims[0] = batch_size;
     Tensor* batch_x = tensor_alloc(d_x_shape, DTYPE_FLOAT32);
     Tensor* batch_y = tensor_alloc(d_y_shape, DTYPE_UINT8);
+
+    MlpWork work = {0};
+    Plan plan;
+    Plan eval_plan;
+    Pool pool = {0};
+    if (c.use_plan && c.threads > 1) {
+        RETURN_IF_ERROR(pool_init(&pool, c.threads));
+    }
+    // Before any plan takes the addresses of the buffers being moved.
+    if (c.numa) {
+        // Hogwild starts its own threads on the cpus a pool of as many
+        // workers gets, so such a pool stands in for them while placing.
+        CHECK(pool.n_workers > 1 || c.hogwild > 1);
+        Pool placer = {0};
+        Pool* p = &pool;
+        if (c.hogwild > 1) {
+            RETURN_IF_ERROR(pool_init(&placer, c.hogwild));
+            p = &placer;
+        }
+        RETURN_IF_ERROR(numa_bind_pool(p, "numa"));
+        size_t bytes = 0;
+        RETURN_IF_ERROR(numa_place_tensor(p, d.x, &bytes));
+        RETURN_IF_ERROR(numa_place_tensor(p, d.y, &bytes));
+        RETURN_IF_ERROR(numa_place_mlp(p, &model, &bytes));
+        printf("numa: dataset, weights, gradients and moments (%.1f MiB) "
+               "interleaved over %zu workers\n",
+               (double)bytes / (1024.0 * 1024.0), p->n_workers);
+        pool_free(&placer);
+    }
+    if (c.use_plan) {
+        CHECK(c.checkpoint_every == 0);
+        RETURN_IF_ERROR(plan_build(&plan, &model, batch_x, batch_y, true, c.lr,
+                                   c.beta1, c.beta2, c.eps));
+        RETURN_IF_ERROR(plan_build(&eval_plan, &model, batch_x, batch_y, false,
+                                   c.lr, c.beta1, c.beta2, c.eps));
+        if (c.threads > 1) {
+            RETURN_IF_ERROR(plan_attach_pool(&plan, &pool));
+            RETURN_IF_ERROR(plan_attach_pool(&eval_plan, &pool));
+        }
+        plan_print_summary(&plan);
+    } else {
+        CHECK(c.threads == 1);
+        RETURN_IF_ERROR(
+            mlp_work_init(&work, &model, batch_size, c.checkpoint_every));
+    }
     printf("epoch NONE loss = UNK acc = UNK\n");
-    for (size_t ep = 0; ep < epochs; ++ep) {
+    if (c.trace_file != NULL) trace_enable(0);
+    if (c.perf_counters) perf_enable();
+    double train_start = wall_time();
+    size_t sync_epochs = c.epochs;
+    // Compared, Hogwild trains a copy and the model goes on to train
+    // synchronously from the same weights.
+    Mlp hog = {0};
+    HogwildStats stats = {0};
+    double hog_loss = 0.0;
+    double hog_acc = 0.0;
+    CHECK(!c.hogwild_compare || c.hogwild > 0);
+    if (c.hogwild > 0) {
+        CHECK(!c.use_plan);
+        Mlp* m = &model;
+        if (c.hogwild_compare) {
+            RETURN_IF_ERROR(mlp_alloc(&hog, c.sizes, c.n_sizes));
+            for (size_t i = 0; i < model.n_params; ++i) {
+                tensor_copy(hog.params[i], model.params[i]);
+            }
+            m = &hog;
+        }
+        RETURN_IF_ERROR(hogwild_train(m, &d, &c, &stats));
+        printf("hogwild %zu threads loss = %.5f acc = %.5f\n", c.hogwild,
+               stats.loss, stats.acc);
+        if (c.hogwild_compare) {
+            RETURN_IF_ERROR(evaluate(&hog, &work, NULL, &d_test, batch_x,
+                                     batch_y, &hog_loss, &hog_acc));
+            train_start = wall_time();
+        } else {
+            t = stats.steps;
+            sync_epochs = 0;
+        }
+    }
+    MetricsWriter writer;
+    RETURN_IF_ERROR(metrics_writer_init(&writer, c.metrics_file));
+    MetricsSums interval = {0};
+    MetricsSums epoch = {0};
+    for (size_t ep = 0; ep < sync_epochs; ++ep) {
+        double epoch_start = wall_time();
+        double interval_start = epoch_start;
         dataset_rand_perm(d.x, d.y, &r);
-        for (size_t batch = 0; batch < d.n - batch_size; batch += batch_size) {
+        for (size_t batch = 0; batch + batch_size <= d.n;
+             batch += batch_size) {
+            double t0 = trace_now();
             RETURN_IF_ERROR(
                 tensor_slice(d.x, batch_x, 0, batch, batch + batch_size));
             RETURN_IF_ERROR(
                 tensor_slice(d.y, batch_y, 0, batch, batch + batch_size));
-            tensor_fill_float(layer1_weight_grad, 0.0f);
-            tensor_fill_float(layer1_bias_grad, 0.0f);
-            tensor_fill_float(layer2_weight_grad, 0.0f);
-            tensor_fill_float(layer2_bias_grad, 0.0f);
-            tensor_fill_float(hidden_1, 0.0f);
-            tensor_fill_float(hidden_2, 0.0f);
-            tensor_fill_float(hidden_1_grad, 0.0f);
+            trace_span("batch", t0);
 
             t++;
 
-            RETURN_IF_ERROR(
-                bmm(hidden_1, batch_x, layer1_weight, false, false));
-            RETURN_IF_ERROR(tensor_add(hidden_1, layer1_bias));
-
-            RETURN_IF_ERROR(tensor_copy(hidden_1_pre_tanh, hidden_1));
-
-            RETURN_IF_ERROR(tensor_tanh(hidden_1));
-
-            RETURN_IF_ERROR(
-                bmm(hidden_2, hidden_1, layer2_weight, false, false));
-            RETURN_IF_ERROR(tensor_add(hidden_2, layer2_bias));
-
-            RETURN_IF_ERROR(tensor_argmax(hidden_2, argmax_out));
-            RETURN_IF_ERROR(reshape(argmax_out, shapeN(1, batch_size)));
-            RETURN_IF_ERROR(accuracy(argmax_out, batch_y, &acc));
-            RETURN_IF_ERROR(reshape(argmax_out, shapeN(2, batch_size, 1)));
-
-            RETURN_IF_ERROR(reshape(hidden_2, shapeN(2, batch_size, 10)));
-            RETURN_IF_ERROR(cross_entropy(hidden_2, batch_y, &loss));
-            printf("\repoch %zu loss = %.5f acc = %.5f %d/%d", ep, loss, acc,
-                   batch, d.n);
-            ////////////////////////////////////////////////////////////////////////////////////////////
-            RETURN_IF_ERROR(
-                cross_entropy_backward(hidden_2, batch_y, hidden_2_grad));
-            RETURN_IF_ERROR(reshape(hidden_2, shapeN(3, batch_size, 1, 10)));
-            RETURN_IF_ERROR(
-                reshape(hidden_2_grad, shapeN(3, batch_size, 1, 10)));
-
-            RETURN_IF_ERROR(
-                tensor_add_backward(hidden_2_grad, NULL, layer2_bias_grad));
-            RETURN_IF_ERROR(bmm_backward(hidden_1, layer2_weight, hidden_2_grad,
-                                         hidden_1_grad, layer2_weight_grad));
-            RETURN_IF_ERROR(reshape(hidden_2_grad, shapeN(2, batch_size, 10)));
-
-            RETURN_IF_ERROR(
-                tensor_tanh_backward(hidden_1_pre_tanh, hidden_1_grad));
-
-            RETURN_IF_ERROR(
-                tensor_add_backward(hidden_1_grad, NULL, layer1_bias_grad));
-            RETURN_IF_ERROR(bmm_backward(batch_x, layer1_weight, hidden_1_grad,
-                                         NULL, layer1_weight_grad));
-
-            RETURN_IF_ERROR(adam_step(lr, beta1, beta2, eps, t,
-                                      layer1_weight_grad, layer1_weight,
-                                      layer1_weight_m, layer1_weight_v));
-
-            RETURN_IF_ERROR(adam_step(lr, beta1, beta2, eps, t,
-                                      layer1_bias_grad, layer1_bias,
-                                      layer1_bias_m, layer1_bias_v));
-
-            RETURN_IF_ERROR(adam_step(lr, beta1, beta2, eps, t,
-                                      layer2_weight_grad, layer2_weight,
-                                      layer2_weight_m, layer2_weight_v));
-
-            RETURN_IF_ERROR(adam_step(lr, beta1, beta2, eps, t,
-                                      layer2_bias_grad, layer2_bias,
-                                      layer2_bias_m, layer2_bias_v));
+            t0 = trace_now();
+            if (c.use_plan) {
+                RETURN_IF_ERROR(plan_run_step(&plan));
+                loss = plan.loss;
+                acc = plan.acc;
+            } else {
+                RETURN_IF_ERROR(mlp_forward(&model, &work, batch_x));
+                RETURN_IF_ERROR(mlp_metrics(&work, batch_y, &loss, &acc));
+                RETURN_IF_ERROR(mlp_backward(&model, &work, batch_x, batch_y,
+                                             model.grads));
+            }
+            trace_span("compute", t0);
+            metrics_add(&interval, loss, acc, batch_size);
+            metrics_add(&epoch, loss, acc, batch_size);
+            if (t % c.metrics_every == 0) {
+                double now = wall_time();
+                metrics_report(&writer, &interval, ep, t, false,
+                               now - interval_start);
+                interval_start = now;
+            }
+            if (c.use_plan) {
+                RETURN_IF_ERROR(plan_run_update(&plan, t));
+            } else {
+                RETURN_IF_ERROR(mlp_adam_step(&model, model.grads, c.lr,
+                                              c.beta1, c.beta2, c.eps, t));
+            }
         }
+        metrics_report(&writer, &epoch, ep, t, true,
+                       wall_time() - epoch_start);
+        memset(&interval, 0, sizeof(interval));
     }
+    metrics_writer_free(&writer);
+    double train_seconds = wall_time() - train_start;
+    printf("train %zu steps in %.2fs (%.0f samples/s)\n", t, train_seconds,
+           (double)(t * batch_size) / train_seconds);
 
-    for (size_t batch = 0; batch < d_test.n - batch_size; batch += batch_size) {
-        RETURN_IF_ERROR(
-            tensor_slice(d_test.x, batch_x, 0, batch, batch + batch_size));
-        RETURN_IF_ERROR(
-            tensor_slice(d_test.y, batch_y, 0, batch, batch + batch_size));
-        tensor_fill_float(hidden_1, 0.0f);
-        tensor_fill_float(hidden_2, 0.0f);
-
-        RETURN_IF_ERROR(bmm(hidden_1, batch_x, layer1_weight, false, false));
-        RETURN_IF_ERROR(tensor_add(hidden_1, layer1_bias));
-
-        RETURN_IF_ERROR(tensor_tanh(hidden_1));
-
-        RETURN_IF_ERROR(bmm(hidden_2, hidden_1, layer2_weight, false, false));
-        RETURN_IF_ERROR(tensor_add(hidden_2, layer2_bias));
-
-        RETURN_IF_ERROR(tensor_argmax(hidden_2, argmax_out));
-        RETURN_IF_ERROR(reshape(argmax_out, shapeN(1, batch_size)));
-        RETURN_IF_ERROR(accuracy(argmax_out, batch_y, &acc));
-        RETURN_IF_ERROR(reshape(argmax_out, shapeN(2, batch_size, 1)));
-
-        RETURN_IF_ERROR(reshape(hidden_2, shapeN(2, batch_size, 10)));
-        RETURN_IF_ERROR(cross_entropy(hidden_2, batch_y, &loss));
-        printf("loss = %.5f acc = %.5f\n", loss, acc);
-        RETURN_IF_ERROR(reshape(hidden_2, shapeN(3, batch_size, 1, 10)));
+    double test_loss = 0.0;
+    double test_acc = 0.0;
+    RETURN_IF_ERROR(evaluate(&model, &work, c.use_plan ? &eval_plan : NULL,
+                             &d_test, batch_x, batch_y, &test_loss,
+                             &test_acc));
+    printf("test loss = %.5f acc = %.5f\n", test_loss, test_acc);
+    if (c.hogwild_compare) {
+        printf("%-20s %10s %10s %12s\n", "compare", "test loss", "test acc",
+               "samples/s");
+        printf("hogwild %-12zu %10.5f %10.5f %12.0f\n", c.hogwild, hog_loss,
+               hog_acc, (double)stats.samples / stats.seconds);
+        printf("%-20s %10.5f %10.5f %12.0f\n", "synchronous", test_loss,
+               test_acc, (double)(t * batch_size) / train_seconds);
+        mlp_free(&hog);
+    }
+    if (c.trace_file != NULL) {
+        size_t len = 0;
+        char* events = trace_events_json(&len);
+        CHECK(events != NULL);
+        CHECK(trace_write_file(c.trace_file, events, len) == 0);
+        free(events);
+        printf("trace written to %s\n", c.trace_file);
     }
+    if (c.perf_counters) perf_report();
 
+    if (c.use_plan) {
+        plan_free(&plan);
+        plan_free(&eval_plan);
+    }
+    pool_free(&pool);
+    mlp_work_free(&work);
+    mlp_free(&model);
     dataset_free(&d);
     dataset_free(&d_test);
     return 0;
@@ -7,227 +7,676 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "config.h"
 #include "dataset.h"
 #include "linalg.h"
+#include "metrics.h"
+#include "model.h"
+#include "mpi/async_eval.h"
+#include "mpi/collectives.h"
+#include "mpi/grad_buckets.h"
+#include "mpi/load_balance.h"
+#include "mpi/local_sgd.h"
+#include "mpi/param_server.h"
+#include "mpi/pipeline.h"
+#include "mpi/rank_metrics.h"
+#include "mpi/shared_dataset.h"
+#include "mpi/sharded_dataset.h"
+#include "mpi/streamed_dataset.h"
+#include "mpi/tensor_parallel.h"
+#include "mpi/sparse_grads.h"
+#include "mpi/trace_gather.h"
+#include "numa.h"
 #include "optim.h"
+#include "perf.h"
+#include "plan.h"
+#include "thread_team.h"
 #include "tensor.h"
+#include "trace.h"
 #include "utils.h"
 
+// The --eval-every rank: its own test set and model, fed snapshots of the
+// weights by training rank 0.
+static int run_evaluator(const Config* c, MPI_Comm comm) {
+    Dataset test;
+    RETURN_IF_ERROR(dataset_load_bin("data/test-labels.bin",
+                                     "data/test-data.bin", &test));
+    RETURN_IF_ERROR(reshape(test.x, shapeN(3, test.n, 1, IMG_SIZE)));
+    RNG r;
+    rng_seed(&r, c->seed);
+    Mlp m;
+    RETURN_IF_ERROR(mlp_init(&m, c->sizes, c->n_sizes, &r));
+    AsyncEval ae;
+    RETURN_IF_ERROR(async_eval_init(&ae, &m, comm));
+    RETURN_IF_ERROR(async_eval_run(&ae, &m, &test, c->eval_batch_size));
+    async_eval_free(&ae);
+    mlp_free(&m);
+    dataset_free(&test);
+    return 0;
+}
+
+// --check-collectives: every algorithm against MPI_Allreduce, on counts that
+// split unevenly over the ranks. The inputs are small integers, which sum
+// exactly in any order, so the results must match bit for bit.
+static int check_collectives(MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    Collectives coll;
+    RETURN_IF_ERROR(collectives_init(&coll, comm));
+    const size_t counts[] = {1, 3, 17, 1000, 65537};
+    size_t n_counts = sizeof(counts) / sizeof(counts[0]);
+    float* data = (float*)malloc(counts[n_counts - 1] * sizeof(float));
+    float* want = (float*)malloc(counts[n_counts - 1] * sizeof(float));
+    CHECK(data != NULL && want != NULL);
+    int failed = 0;
+    for (int algo = ALLREDUCE_RING; algo < ALLREDUCE_N_ALGOS; ++algo) {
+        for (size_t j = 0; j < n_counts; ++j) {
+            size_t n = counts[j];
+            for (size_t i = 0; i < n; ++i) {
+                want[i] = (float)(((size_t)rank * 7 + i * 13) % 29) - 14.0f;
+            }
+            memcpy(data, want, n * sizeof(float));
+            MPI_Allreduce(MPI_IN_PLACE, want, (int)n, MPI_FLOAT, MPI_SUM,
+                          comm);
+            RETURN_IF_ERROR(
+                allreduce_sum_with(&coll, (AllreduceAlgo)algo, data, n));
+            int wrong = memcmp(data, want, n * sizeof(float)) != 0;
+            MPI_Allreduce(MPI_IN_PLACE, &wrong, 1, MPI_INT, MPI_MAX, comm);
+            if (rank == 0) {
+                printf("collectives: %-12s %6zu floats %s\n",
+                       allreduce_algo_name((AllreduceAlgo)algo), n,
+                       wrong ? "MISMATCH" : "ok");
+            }
+            failed |= wrong;
+        }
+    }
+    free(data);
+    free(want);
+    collectives_free(&coll);
+    return failed ? 6 : 0;
+}
+
 int main(int argc, char** argv) {
-    MPI_Init(NULL, NULL);
+    // Only the main thread calls MPI; --threads workers just compute.
+    int provided;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
     int world_size, world_rank;
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
     MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
-    Dataset d;
-    RETURN_IF_ERROR(
-        dataset_load_bin("data/train-labels.bin", "data/train-data.bin", &d));
 
+    Config c = config_default();
+    c.batch_size = 64;
+    if (config_parse(argc, argv, &c)) {
+        MPI_Finalize();
+        return 1;
+    }
+    CHECK(c.sizes[0] == IMG_SIZE);
+    CHECK(c.threads == 1 || provided >= MPI_THREAD_FUNNELED);
+    if (c.check_collectives) {
+        int ret = check_collectives(MPI_COMM_WORLD);
+        MPI_Finalize();
+        return ret;
+    }
+
+    // An evaluator rank leaves the others to train on their own
+    // communicator, the only one any of the training code below sees.
+    bool evaluated = c.eval_every > 0;
+    bool evaluator = evaluated && world_rank == world_size - 1;
+    MPI_Comm train_comm = MPI_COMM_WORLD;
+    MPI_Comm eval_comm = MPI_COMM_NULL;
+    if (evaluated) {
+        CHECK(world_size > 1 && c.pipeline_stages == 1 &&
+              c.tensor_parallel == 1 && strcmp(c.distribute, "files") == 0);
+        MPI_Comm_split(MPI_COMM_WORLD, evaluator, world_rank, &train_comm);
+        bool paired = evaluator || world_rank == 0;
+        MPI_Comm_split(MPI_COMM_WORLD, paired ? 0 : MPI_UNDEFINED,
+                       world_rank, &eval_comm);
+        if (evaluator) {
+            int ret = run_evaluator(&c, eval_comm);
+            MPI_Comm_free(&eval_comm);
+            MPI_Comm_free(&train_comm);
+            MPI_Finalize();
+            return ret;
+        }
+        MPI_Comm_size(train_comm, &world_size);
+        MPI_Comm_rank(train_comm, &world_rank);
+    }
+
+    // Gradients are summed over the data parallel ranks of the grid only.
+    bool piped = c.pipeline_stages > 1;
+    CHECK(!piped || c.tensor_parallel == 1);
+    CHECK(piped || c.micro_batches == 1);
+    CHECK(!piped || c.batch_size % c.micro_batches == 0);
+    TpGrid grid;
+    RETURN_IF_ERROR(
+        tp_grid_init(&grid, train_comm, (int)c.tensor_parallel));
+    Pipeline pipe = {0};
+    if (piped) {
+        RETURN_IF_ERROR(
+            pipeline_init(&pipe, train_comm, (int)c.pipeline_stages));
+    }
+    MPI_Comm dp_comm = piped ? pipe.dp_comm : grid.dp_comm;
+    int dp_rank = piped ? pipe.dp_rank : grid.dp_rank;
+    int dp_size = piped ? pipe.dp_size : grid.dp_size;
+    Collectives coll;
+    RETURN_IF_ERROR(collectives_init(&coll, dp_comm));
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(train_comm, MPI_COMM_TYPE_SHARED, world_rank,
+                        MPI_INFO_NULL, &node_comm);
+
+    // One copy of each set per node, shared by all of its ranks, unless each
+    // rank reads just its own shard of the training set. Without a shared
+    // filesystem rank 0 reads both sets and streams them out instead.
+    bool streamed = strcmp(c.distribute, "scatter") == 0;
+    CHECK(streamed || strcmp(c.distribute, "files") == 0);
+    bool sharded = streamed || strcmp(c.shard, "none") != 0;
+    CHECK(!streamed || dp_size == world_size);
+    SharedDataset train = {0};
+    SharedDataset test = {0};
+    StreamedDataset train_stream = {0};
+    StreamedDataset test_stream = {0};
+    Dataset d;
     Dataset d_test;
-    RETURN_IF_ERROR(dataset_load_bin("data/test-labels.bin",
-                                     "data/test-data.bin", &d_test));
+    size_t n_train = 0;
+    ShardLayout layout = SHARD_BLOCK;
+    if (strcmp(c.shard, "none") != 0) {
+        RETURN_IF_ERROR(shard_layout_parse(c.shard, &layout));
+    }
+    if (streamed) {
+        RETURN_IF_ERROR(streamed_dataset_scatter("data/train-labels.bin",
+                                                 "data/train-data.bin",
+                                                 train_comm, layout,
+                                                 &train_stream));
+        RETURN_IF_ERROR(streamed_dataset_bcast("data/test-labels.bin",
+                                               "data/test-data.bin",
+                                               train_comm, &test_stream));
+        d = train_stream.d;
+        n_train = train_stream.n_total;
+        d_test = test_stream.d;
+    } else {
+        if (sharded) {
+            RETURN_IF_ERROR(dataset_load_shard("data/train-labels.bin",
+                                               "data/train-data.bin",
+                                               dp_comm, layout, &d,
+                                               &n_train));
+        } else {
+            RETURN_IF_ERROR(shared_dataset_load_bin("data/train-labels.bin",
+                                                    "data/train-data.bin",
+                                                    node_comm, &train));
+            d = train.d;
+            n_train = d.n;
+        }
+        RETURN_IF_ERROR(shared_dataset_load_bin("data/test-labels.bin",
+                                                "data/test-data.bin",
+                                                node_comm, &test));
+        d_test = test.d;
+    }
 
-    reshape(d.x, shapeN(3, 60000, 1, 784));
-    reshape(d_test.x, shapeN(3, 10000, 1, 784));
+    RETURN_IF_ERROR(reshape(d.x, shapeN(3, d.n, 1, IMG_SIZE)));
+    RETURN_IF_ERROR(reshape(d_test.x, shapeN(3, d_test.n, 1, IMG_SIZE)));
 
     float acc = 0.0f;
     float loss = 0.0f;
     size_t t = 0;
-    size_t epochs = 1;
-    float lr = 0.001f;
-    float beta1 = 0.9f;
-    float beta2 = 0.999f;
-    float eps = 1e-08f;
-    int batch_size = 64;
-
-    Tensor* layer1_weight = tensor_alloc(shapeN(2, 784, 256), DTYPE_FLOAT32);
-    Tensor* layer1_bias = tensor_alloc(shapeN(1, 256), DTYPE_FLOAT32);
-    Tensor* layer2_weight = tensor_alloc(shapeN(2, 256, 10), DTYPE_FLOAT32);
-    Tensor* layer2_bias = tensor_alloc(shapeN(1, 10), DTYPE_FLOAT32);
-
-    RETURN_IF_ERROR(reshape(layer1_weight, shapeN(3, 1, 784, 256)));
-    RETURN_IF_ERROR(reshape(d.x, shapeN(3, d.n, 1, 784)));
-    RETURN_IF_ERROR(reshape(layer2_weight, shapeN(3, 1, 256, 10)));
+    size_t batch_size = c.batch_size;
 
     RNG r;
-    r.state = 67;
-
-    tensor_fill_uniform(layer1_weight, &r);
-    tensor_fill_uniform(layer1_bias, &r);
-    tensor_fill_uniform(layer2_weight, &r);
-    tensor_fill_uniform(layer2_bias, &r);
-
-    float k1 = sqrtf(1.0 / 784.0);
-    float k2 = sqrtf(1.0 / 256.0);
-
-    tensor_scale_and_add_const(layer1_weight, 2 * k1, -k1);
-    tensor_scale_and_add_const(layer1_bias, 2 * k1, -k1);
-
-    tensor_scale_and_add_const(layer2_weight, 2 * k2, -k2);
-    tensor_scale_and_add_const(layer2_bias, 2 * k2, -k2);
-
-    // forward
-    Tensor* hidden_1 =
-        tensor_alloc(shapeN(3, batch_size, 1, 256), DTYPE_FLOAT32);
-    Tensor* hidden_1_grad =
-        tensor_alloc(shapeN(3, batch_size, 1, 256), DTYPE_FLOAT32);
-    Tensor* hidden_1_pre_tanh = tensor_alloc(hidden_1->shape, DTYPE_FLOAT32);
-    Tensor* layer1_bias_grad = tensor_alloc(layer1_bias->shape, DTYPE_FLOAT32);
-    Tensor* layer1_weight_grad =
-        tensor_alloc(layer1_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer1_weight_m = tensor_alloc(layer1_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer1_weight_v = tensor_alloc(layer1_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer1_bias_m = tensor_alloc(layer1_bias->shape, DTYPE_FLOAT32);
-    Tensor* layer1_bias_v = tensor_alloc(layer1_bias->shape, DTYPE_FLOAT32);
-    tensor_fill_float(layer1_weight_m, 0.0f);
-    tensor_fill_float(layer1_weight_v, 0.0f);
-    tensor_fill_float(layer1_bias_m, 0.0f);
-    tensor_fill_float(layer1_bias_v, 0.0f);
-
-    Tensor* argmax_out = tensor_alloc(shapeN(2, batch_size, 1), DTYPE_UINT8);
-
-    Tensor* hidden_2 =
-        tensor_alloc(shapeN(3, batch_size, 1, 10), DTYPE_FLOAT32);
-    Tensor* hidden_2_grad =
-        tensor_alloc(shapeN(2, batch_size, 10), DTYPE_FLOAT32);
-
-    Tensor* layer2_bias_grad = tensor_alloc(layer2_bias->shape, DTYPE_FLOAT32);
-    Tensor* layer2_weight_grad =
-        tensor_alloc(layer2_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer2_weight_m = tensor_alloc(layer2_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer2_weight_v = tensor_alloc(layer2_weight->shape, DTYPE_FLOAT32);
-    Tensor* layer2_bias_m = tensor_alloc(layer2_bias->shape, DTYPE_FLOAT32);
-    Tensor* layer2_bias_v = tensor_alloc(layer2_bias->shape, DTYPE_FLOAT32);
-    tensor_fill_float(layer2_weight_m, 0.0f);
-    tensor_fill_float(layer2_weight_v, 0.0f);
-    tensor_fill_float(layer2_bias_m, 0.0f);
-    tensor_fill_float(layer2_bias_v, 0.0f);
+    rng_seed(&r, c.seed);
+
+    Mlp model;
+    RETURN_IF_ERROR(mlp_init(&model, c.sizes, c.n_sizes, &r));
+    AsyncEval snapshots = {0};
+    if (eval_comm != MPI_COMM_NULL) {
+        RETURN_IF_ERROR(async_eval_init(&snapshots, &model, eval_comm));
+    }
+    if (grid.tp_size > 1) {
+        CHECK(!c.use_plan);
+        RETURN_IF_ERROR(tp_shard_mlp(&grid, &model));
+        if (world_rank == 0) {
+            printf("grid %d data x %d tensor parallel, %zu of %zu hidden "
+                   "units per rank\n",
+                   dp_size, grid.tp_size, grid.hidden_hi - grid.hidden_lo,
+                   c.sizes[1]);
+        }
+    }
+    if (piped) {
+        CHECK(!c.use_plan);
+        RETURN_IF_ERROR(pipeline_shard_mlp(&pipe, &model));
+        if (world_rank == 0) {
+            printf("grid %d data x %d pipeline stages, %zu micro-batches of "
+                   "%zu\n",
+                   dp_size, pipe.n_stages, c.micro_batches,
+                   batch_size / c.micro_batches);
+        }
+    }
+
     Shape d_x_shape = d.x->shape;
     d_x_shape.dims[0] = batch_size;
     Shape d_y_shape = d.y->shape;
     d_y_shape.dims[0] = batch_size;
     Tensor* batch_x = tensor_alloc(d_x_shape, DTYPE_FLOAT32);
     Tensor* batch_y = tensor_alloc(d_y_shape, DTYPE_UINT8);
-    for (size_t ep = 0; ep < epochs; ++ep) {
-        dataset_rand_perm(d.x, d.y, &r);
-        for (size_t batch = 0; batch < d.n - batch_size * world_size;
-             batch += batch_size * world_size) {
-            RETURN_IF_ERROR(
-                tensor_slice(d.x, batch_x, 0, batch + world_rank * batch_size,
-                             batch + world_rank * batch_size + batch_size));
-            RETURN_IF_ERROR(
-                tensor_slice(d.y, batch_y, 0, batch + world_rank * batch_size,
-                             batch + world_rank * batch_size + batch_size));
-            tensor_fill_float(layer1_weight_grad, 0.0f);
-            tensor_fill_float(layer1_bias_grad, 0.0f);
-            tensor_fill_float(layer2_weight_grad, 0.0f);
-            tensor_fill_float(layer2_bias_grad, 0.0f);
-            tensor_fill_float(hidden_1, 0.0f);
-            tensor_fill_float(hidden_2, 0.0f);
-            tensor_fill_float(hidden_1_grad, 0.0f);
-
-            t++;
-
-            RETURN_IF_ERROR(
-                bmm(hidden_1, batch_x, layer1_weight, false, false));
-            RETURN_IF_ERROR(tensor_add(hidden_1, layer1_bias));
-
-            RETURN_IF_ERROR(tensor_copy(hidden_1_pre_tanh, hidden_1));
-
-            RETURN_IF_ERROR(tensor_tanh(hidden_1));
-
-            RETURN_IF_ERROR(
-                bmm(hidden_2, hidden_1, layer2_weight, false, false));
-            RETURN_IF_ERROR(tensor_add(hidden_2, layer2_bias));
-
-            RETURN_IF_ERROR(tensor_argmax(hidden_2, argmax_out));
-            RETURN_IF_ERROR(reshape(argmax_out, shapeN(1, batch_size)));
-            RETURN_IF_ERROR(accuracy(argmax_out, batch_y, &acc));
-            RETURN_IF_ERROR(reshape(argmax_out, shapeN(2, batch_size, 1)));
-
-            RETURN_IF_ERROR(reshape(hidden_2, shapeN(2, batch_size, 10)));
-            RETURN_IF_ERROR(cross_entropy(hidden_2, batch_y, &loss));
-            printf("epoch %zu loss = %.5f acc = %.5f %d/%d\n", ep, loss, acc,
-                   batch, d.n);
-            ////////////////////////////////////////////////////////////////////////////////////////////
-            RETURN_IF_ERROR(
-                cross_entropy_backward(hidden_2, batch_y, hidden_2_grad));
-            RETURN_IF_ERROR(reshape(hidden_2, shapeN(3, batch_size, 1, 10)));
-            RETURN_IF_ERROR(
-                reshape(hidden_2_grad, shapeN(3, batch_size, 1, 10)));
-
-            RETURN_IF_ERROR(
-                tensor_add_backward(hidden_2_grad, NULL, layer2_bias_grad));
-            RETURN_IF_ERROR(bmm_backward(hidden_1, layer2_weight, hidden_2_grad,
-                                         hidden_1_grad, layer2_weight_grad));
-            RETURN_IF_ERROR(reshape(hidden_2_grad, shapeN(2, batch_size, 10)));
-
-            RETURN_IF_ERROR(
-                tensor_tanh_backward(hidden_1_pre_tanh, hidden_1_grad));
-
-            RETURN_IF_ERROR(
-                tensor_add_backward(hidden_1_grad, NULL, layer1_bias_grad));
-            RETURN_IF_ERROR(bmm_backward(batch_x, layer1_weight, hidden_1_grad,
-                                         NULL, layer1_weight_grad));
-
-            MPI_Allreduce(MPI_IN_PLACE, layer1_weight_grad->data,
-                          layer1_weight_grad->size, MPI_FLOAT, MPI_SUM,
-                          MPI_COMM_WORLD);
-
-            MPI_Allreduce(MPI_IN_PLACE, layer1_bias_grad->data,
-                          layer1_bias_grad->size, MPI_FLOAT, MPI_SUM,
-                          MPI_COMM_WORLD);
-
-            MPI_Allreduce(MPI_IN_PLACE, layer2_weight_grad->data,
-                          layer2_weight_grad->size, MPI_FLOAT, MPI_SUM,
-                          MPI_COMM_WORLD);
-
-            MPI_Allreduce(MPI_IN_PLACE, layer2_bias_grad->data,
-                          layer2_bias_grad->size, MPI_FLOAT, MPI_SUM,
-                          MPI_COMM_WORLD);
-
-            RETURN_IF_ERROR(adam_step(lr, beta1, beta2, eps, t,
-                                      layer1_weight_grad, layer1_weight,
-                                      layer1_weight_m, layer1_weight_v));
-
-            RETURN_IF_ERROR(adam_step(lr, beta1, beta2, eps, t,
-                                      layer1_bias_grad, layer1_bias,
-                                      layer1_bias_m, layer1_bias_v));
-
-            RETURN_IF_ERROR(adam_step(lr, beta1, beta2, eps, t,
-                                      layer2_weight_grad, layer2_weight,
-                                      layer2_weight_m, layer2_weight_v));
+    // A balanced rank trains on up to twice its even share, through views
+    // of share_x and share_y.
+    bool balanced = c.balance_every > 0;
+    CHECK(balanced || batch_size * (size_t)dp_size <= n_train);
+    size_t capacity = balanced ? 2 * batch_size : batch_size;
+    LoadBalancer lb = {0};
+    Tensor* share_x = NULL;
+    Tensor* share_y = NULL;
+    if (balanced) {
+        CHECK(!sharded && !c.use_plan && !piped && grid.tp_size == 1);
+        RETURN_IF_ERROR(load_balancer_init(&lb, c.balance_every, capacity,
+                                           dp_comm));
+        d_x_shape.dims[0] = capacity;
+        d_y_shape.dims[0] = capacity;
+        share_x = tensor_alloc(d_x_shape, DTYPE_FLOAT32);
+        share_y = tensor_alloc(d_y_shape, DTYPE_UINT8);
+        CHECK(share_x != NULL && share_y != NULL);
+    }
 
-            RETURN_IF_ERROR(adam_step(lr, beta1, beta2, eps, t,
-                                      layer2_bias_grad, layer2_bias,
-                                      layer2_bias_m, layer2_bias_v));
+    MlpWork work = {0};
+    bool threaded = !c.use_plan && !piped && c.threads > 1;
+    ThreadTeam team = {0};
+    Plan plan;
+    Pool pool = {0};
+    if (c.threads > 1 && !piped) {
+        RETURN_IF_ERROR(pool_init(&pool, c.threads));
+    }
+    // Within whatever cpus the launcher bound this rank to. The node's
+    // shared dataset window stays where it was loaded, as does a streamed
+    // shard still being received.
+    if (c.numa) {
+        CHECK(pool.n_workers > 1);
+        char who[32];
+        snprintf(who, sizeof(who), "rank %d numa", world_rank);
+        RETURN_IF_ERROR(numa_bind_pool(&pool, who));
+        size_t bytes = 0;
+        RETURN_IF_ERROR(numa_place_mlp(&pool, &model, &bytes));
+        RETURN_IF_ERROR(numa_place_tensor(&pool, batch_x, &bytes));
+        if (balanced) {
+            RETURN_IF_ERROR(numa_place_tensor(&pool, share_x, &bytes));
+        }
+        bool own_data = sharded && !streamed;
+        if (own_data) {
+            RETURN_IF_ERROR(numa_place_tensor(&pool, d.x, &bytes));
+            RETURN_IF_ERROR(numa_place_tensor(&pool, d.y, &bytes));
         }
+        printf("%s: weights, gradients, moments, batch%s (%.1f MiB) "
+               "interleaved over %zu workers\n",
+               who, own_data ? " and dataset shard" : "",
+               (double)bytes / (1024.0 * 1024.0), pool.n_workers);
     }
-    for (size_t batch = 0; batch < d_test.n - batch_size; batch += batch_size) {
+    if (c.use_plan) {
+        CHECK(c.checkpoint_every == 0);
+        RETURN_IF_ERROR(plan_build(&plan, &model, batch_x, batch_y, true, c.lr,
+                                   c.beta1, c.beta2, c.eps));
+        if (c.threads > 1) {
+            RETURN_IF_ERROR(plan_attach_pool(&plan, &pool));
+        }
+        plan_print_summary(&plan);
+    } else if (piped) {
+        CHECK(c.threads == 1);
+        RETURN_IF_ERROR(pipeline_work_init(&pipe, &model, batch_size,
+                                           c.micro_batches,
+                                           c.checkpoint_every));
+    } else if (threaded) {
+        // One copy of the model per rank; each thread takes a slice of the
+        // rank's batch and their gradients are summed before any MPI.
+        CHECK(grid.tp_size == 1);
+        RETURN_IF_ERROR(thread_team_init(&team, &pool, &model, capacity,
+                                         c.checkpoint_every));
+        if (world_rank == 0) {
+            printf("%d ranks x %zu threads\n", world_size, c.threads);
+        }
+    } else {
         RETURN_IF_ERROR(
-            tensor_slice(d_test.x, batch_x, 0, batch, batch + batch_size));
+            mlp_work_init(&work, &model, capacity, c.checkpoint_every));
+        work.partial_logits = tp_reduce_logits;
+        work.partial_logits_ctx = &grid;
+    }
+    MlpWork eval_work = {0};
+    if (!piped && !threaded) {
         RETURN_IF_ERROR(
-            tensor_slice(d_test.y, batch_y, 0, batch, batch + batch_size));
-        tensor_fill_float(hidden_1, 0.0f);
-        tensor_fill_float(hidden_2, 0.0f);
-
-        RETURN_IF_ERROR(bmm(hidden_1, batch_x, layer1_weight, false, false));
-        RETURN_IF_ERROR(tensor_add(hidden_1, layer1_bias));
-
-        RETURN_IF_ERROR(tensor_tanh(hidden_1));
-
-        RETURN_IF_ERROR(bmm(hidden_2, hidden_1, layer2_weight, false, false));
-        RETURN_IF_ERROR(tensor_add(hidden_2, layer2_bias));
-
-        RETURN_IF_ERROR(tensor_argmax(hidden_2, argmax_out));
-        RETURN_IF_ERROR(reshape(argmax_out, shapeN(1, batch_size)));
-        RETURN_IF_ERROR(accuracy(argmax_out, batch_y, &acc));
-        RETURN_IF_ERROR(reshape(argmax_out, shapeN(2, batch_size, 1)));
+            mlp_eval_work_init(&eval_work, &model, c.eval_batch_size));
+        eval_work.partial_logits = tp_reduce_logits;
+        eval_work.partial_logits_ctx = &grid;
+    }
+    if (strcmp(c.allreduce, "auto") == 0) {
+        collectives_use_cutoffs(&coll, c.allreduce_small, c.allreduce_large);
+    } else if (strcmp(c.allreduce, "tune") == 0) {
+        RETURN_IF_ERROR(collectives_tune(
+            &coll, model.grads[0]->size * sizeof(float)));
+    } else {
+        AllreduceAlgo algo;
+        RETURN_IF_ERROR(allreduce_algo_parse(c.allreduce, &algo));
+        collectives_use(&coll, algo);
+    }
+    WireFormat wire;
+    RETURN_IF_ERROR(wire_format_parse(c.wire, &wire));
+    collectives_set_wire(&coll, wire);
+    collectives_print(&coll);
+    GradBuckets buckets;
+    RETURN_IF_ERROR(grad_buckets_init(&buckets, &model, model.grads,
+                                      c.bucket_kb * 1024, dp_comm,
+                                      &coll));
+    grad_buckets_set_scale(&buckets, c.loss_scale, c.dynamic_loss_scale);
+    bool sparse = c.topk > 0.0f || c.topk_threshold > 0.0f;
+    SparseGrads sparse_grads = {0};
+    bool local = c.local_steps > 0;
+    LocalSgd local_sgd = {0};
+    CHECK(local || (!c.local_adaptive && !c.average_moments));
+    bool async = c.param_server;
+    ParamServer ps = {0};
+    bool bucketed = !sparse && !local && !async;
+    CHECK(!balanced || bucketed);
+    if (sparse) {
+        CHECK(!local && !async && wire == WIRE_FP32 && c.loss_scale == 1.0f);
+        RETURN_IF_ERROR(sparse_grads_init(&sparse_grads, &model, model.grads,
+                                          c.topk, c.topk_threshold, dp_comm));
+    } else if (local) {
+        CHECK(!async && wire == WIRE_FP32 && c.loss_scale == 1.0f);
+        RETURN_IF_ERROR(local_sgd_init(&local_sgd, &model, c.local_steps,
+                                       c.local_adaptive, c.average_moments,
+                                       dp_comm));
+    } else if (async) {
+        CHECK(wire == WIRE_FP32 && c.loss_scale == 1.0f);
+        RETURN_IF_ERROR(param_server_init(&ps, &model, c.staleness, dp_comm));
+    } else {
+        work.grad_ready = grad_buckets_ready;
+        work.grad_ready_ctx = &buckets;
+    }
+    MetricsWriter writer;
+    if (world_rank == 0) {
+        RETURN_IF_ERROR(metrics_writer_init(&writer, c.metrics_file));
+    }
+    // Each replica's loss once: summed over the data parallel ranks only.
+    RankMetrics metrics;
+    RETURN_IF_ERROR(rank_metrics_init(&metrics, c.metrics_every, dp_comm,
+                                      world_rank == 0 ? &writer : NULL));
+    // The shared rows stay put; every rank shuffles the same row numbers and
+    // takes its batch out of each group of dp_size batches. A sharded rank
+    // shuffles only its own rows, with its own stream, and takes the next
+    // batch of them each step. Every shard holds at least
+    // n_train / dp_size rows, so all ranks run the same number of steps.
+    // Balanced, the ranks split each step's rows by their shares instead,
+    // and the last step takes whatever is left.
+    size_t* order = (size_t*)malloc(d.n * sizeof(size_t));
+    CHECK(order != NULL);
+    for (size_t i = 0; i < d.n; ++i) order[i] = i;
+    RNG sampler;
+    rng_seed(&sampler,
+             c.seed + 0x9E3779B97F4A7C15ull * (uint64_t)(dp_rank + 1));
+    if (c.trace_file != NULL) {
+        // Every rank's clock starts at the same moment, give or take the
+        // barrier's skew.
+        MPI_Barrier(train_comm);
+        trace_enable(world_rank);
+    }
+    if (c.perf_counters) perf_enable();
+    for (size_t ep = 0; ep < c.epochs; ++ep) {
+        if (streamed && ep == 0) {
+            // Only rows that have arrived can be drawn from yet.
+            RETURN_IF_ERROR(streamed_dataset_shuffle_chunks(&train_stream,
+                                                            order, &sampler));
+        } else {
+            if (streamed) {
+                RETURN_IF_ERROR(streamed_dataset_wait(&train_stream, d.n));
+            }
+            RETURN_IF_ERROR(
+                dataset_rand_perm_index(order, d.n, sharded ? &sampler : &r));
+        }
+        size_t step = batch_size * dp_size;
+        for (size_t batch = 0; batch < n_train; batch += step) {
+            // Unbalanced, every step takes a full batch on every rank.
+            if (!balanced && batch + step > n_train) break;
+            double started = wall_time();
+            double blocked = buckets.blocked_seconds;
+            Tensor* x = batch_x;
+            Tensor* y = batch_y;
+            Tensor step_x;
+            Tensor step_y;
+            size_t share = batch_size;
+            const size_t* rows = sharded
+                                     ? order + batch / dp_size
+                                     : order + batch + dp_rank * batch_size;
+            if (balanced) {
+                size_t total = n_train - batch < step ? n_train - batch : step;
+                RETURN_IF_ERROR(load_balancer_split(&lb, total));
+                share = lb.shares[dp_rank];
+                rows = order + batch + lb.offsets[dp_rank];
+                // Sums weighted by share match the mean over the step.
+                grad_buckets_set_weight(
+                    &buckets, (float)(dp_size * share) / (float)total);
+                RETURN_IF_ERROR(tensor_view(&step_x, share_x->data,
+                                            shapeN(3, share, 1, IMG_SIZE),
+                                            DTYPE_FLOAT32));
+                RETURN_IF_ERROR(tensor_view(&step_y, share_y->data,
+                                            shapeN(1, share), DTYPE_UINT8));
+                x = &step_x;
+                y = &step_y;
+            }
+            double t0 = trace_now();
+            if (streamed) {
+                RETURN_IF_ERROR(streamed_dataset_wait(
+                    &train_stream, batch / dp_size + batch_size));
+            }
+            if (share > 0) {
+                RETURN_IF_ERROR(tensor_gather(d.x, x, rows, share));
+                RETURN_IF_ERROR(tensor_gather(d.y, y, rows, share));
+            }
+            trace_span("batch", t0);
 
-        RETURN_IF_ERROR(reshape(hidden_2, shapeN(2, batch_size, 10)));
-        RETURN_IF_ERROR(cross_entropy(hidden_2, batch_y, &loss));
-        printf("\rloss = %.5f acc = %.5f %d/%d\n", loss, acc, batch, d_test.n);
+            t++;
 
-        RETURN_IF_ERROR(reshape(hidden_2, shapeN(3, batch_size, 1, 10)));
+            t0 = trace_now();
+            if (c.use_plan) {
+                RETURN_IF_ERROR(plan_run_step(&plan));
+                loss = plan.loss;
+                acc = plan.acc;
+            } else if (piped) {
+                RETURN_IF_ERROR(pipeline_step(&pipe, &model, batch_x, batch_y,
+                                              model.grads));
+                loss = pipe.loss;
+                acc = pipe.acc;
+            } else if (share == 0) {
+                // Nothing left for this rank, but it still joins the sums.
+                for (size_t i = 0; i < model.n_params; ++i) {
+                    RETURN_IF_ERROR(tensor_fill_float(model.grads[i], 0.0f));
+                }
+            } else if (threaded) {
+                RETURN_IF_ERROR(thread_team_step(&team, x, y, model.grads,
+                                                 &loss, &acc));
+            } else {
+                RETURN_IF_ERROR(mlp_forward(&model, &work, x));
+                RETURN_IF_ERROR(mlp_metrics(&work, y, &loss, &acc));
+                RETURN_IF_ERROR(mlp_backward(&model, &work, x, y, model.grads));
+            }
+            trace_span("compute", t0);
+            // The rank's own work only: a point-to-point algorithm reduces
+            // buckets from inside the backward hook, and that time is spent
+            // waiting on the slowest peer.
+            if (balanced) {
+                blocked = buckets.blocked_seconds - blocked;
+                load_balancer_record(&lb, wall_time() - started - blocked);
+            }
+            // Only the single threaded backward has a per-gradient hook;
+            // otherwise reduce after the step.
+            bool hooked = !c.use_plan && !piped && !threaded && share > 0;
+            for (size_t i = model.n_params; !hooked && bucketed && i-- > 0;) {
+                grad_buckets_ready(&buckets, i);
+            }
+            rank_metrics_step(&metrics, loss, acc, share, ep, t);
+
+            t0 = trace_now();
+            if (sparse) {
+                RETURN_IF_ERROR(sparse_grads_reduce(&sparse_grads));
+            } else if (bucketed) {
+                RETURN_IF_ERROR(grad_buckets_wait(&buckets));
+                grad_buckets_update_scale(&buckets);
+            }
+            trace_span("grad sync", t0);
+            if (buckets.overflow) {
+                // Every rank sees the same sums, so all of them skip.
+                t--;
+                if (world_rank == 0) {
+                    printf("gradient overflow, step skipped, scale = %g\n",
+                           buckets.scale);
+                }
+                continue;
+            }
+
+            if (c.use_plan) {
+                RETURN_IF_ERROR(plan_run_update(&plan, t));
+            } else {
+                RETURN_IF_ERROR(mlp_adam_step(&model, model.grads, c.lr,
+                                              c.beta1, c.beta2, c.eps, t));
+            }
+            if (local) {
+                RETURN_IF_ERROR(local_sgd_step(&local_sgd, &model, loss));
+            }
+            if (async) RETURN_IF_ERROR(param_server_step(&ps, &model));
+            if (eval_comm != MPI_COMM_NULL && t % c.eval_every == 0) {
+                RETURN_IF_ERROR(
+                    async_eval_send(&snapshots, &model, (int64_t)t, false));
+            }
+        }
+        rank_metrics_end_epoch(&metrics, ep, t);
+    }
+    rank_metrics_free(&metrics);
+    if (world_rank == 0) metrics_writer_free(&writer);
+    if (async) {
+        RETURN_IF_ERROR(param_server_finish(&ps, &model));
+        if (world_rank == 0) {
+            printf("parameter server: staleness %zu, rank 0 ran up to %lld "
+                   "steps ahead and waited %.3f s\n",
+                   c.staleness, (long long)ps.max_lag, ps.wait_seconds);
+        }
+    }
+    if (local) {
+        if (local_sgd.since_sync > 0) {
+            RETURN_IF_ERROR(local_sgd_average(&local_sgd, &model));
+        }
+        if (world_rank == 0 && local_sgd.n_steps > 0) {
+            printf("local sgd: %zu averages over %zu steps, last period %zu, "
+                   "%zu bytes/step\n",
+                   local_sgd.n_averages, local_sgd.n_steps, local_sgd.steps,
+                   local_sgd.bytes / local_sgd.n_steps);
+        }
+    }
+    if (balanced) {
+        RETURN_IF_ERROR(load_balancer_split(&lb, batch_size * dp_size));
+        if (world_rank == 0) {
+            printf("load balance: %zu rebalances, shares of a full step",
+                   lb.n_rebalances);
+            for (int i = 0; i < dp_size; ++i) printf(" %zu", lb.shares[i]);
+            printf("\n");
+        }
+    }
+    if (world_rank == 0 && buckets.n_steps > 0) {
+        printf("gradient allreduce payload %zu bytes/step (%s)\n",
+               buckets.wire_bytes / buckets.n_steps, c.wire);
+    }
+    if (sparse) {
+        size_t bytes = sparse_grads_mean_bytes(&sparse_grads);
+        size_t dense = sparse_grads.offsets[model.n_params] * sizeof(float);
+        if (world_rank == 0) {
+            printf("sparse gradient payload %zu bytes/step per rank "
+                   "(dense %zu, %.2f%%)\n",
+                   bytes, dense, 100.0 * (double)bytes / (double)dense);
+        }
+    }
+    if (eval_comm != MPI_COMM_NULL) {
+        RETURN_IF_ERROR(async_eval_send(&snapshots, &model, (int64_t)t, true));
+        printf("async eval: %zu snapshots, training waited %.3f s for the "
+               "evaluator\n",
+               snapshots.n_snapshots, snapshots.wait_seconds);
+    }
+    if (streamed) {
+        RETURN_IF_ERROR(streamed_dataset_wait(&test_stream, d_test.n));
+    }
+    // Each data parallel replica evaluates its own rows of the test set,
+    // straight from the dataset and tail included; the pipeline and the
+    // thread team are limited to the batch sizes they were built for.
+    size_t test_lo = d_test.n * (size_t)dp_rank / (size_t)dp_size;
+    size_t test_hi = d_test.n * (size_t)(dp_rank + 1) / (size_t)dp_size;
+    size_t eval_batch = piped      ? batch_size
+                        : threaded ? capacity
+                                   : c.eval_batch_size;
+    // Loss and correct predictions summed over the samples.
+    double sums[2] = {0.0, 0.0};
+    for (size_t lo = test_lo; lo < test_hi; lo += eval_batch) {
+        size_t n = test_hi - lo < eval_batch ? test_hi - lo : eval_batch;
+        Tensor x;
+        Tensor y;
+        RETURN_IF_ERROR(tensor_view(&x, (float*)d_test.x->data + lo * IMG_SIZE,
+                                    shapeN(3, n, 1, IMG_SIZE),
+                                    DTYPE_FLOAT32));
+        RETURN_IF_ERROR(tensor_view(&y, (uint8_t*)d_test.y->data + lo,
+                                    shapeN(1, n), DTYPE_UINT8));
+        if (piped) {
+            RETURN_IF_ERROR(pipeline_eval(&pipe, &model, &x, &y));
+            loss = pipe.loss / (float)n;
+            acc = pipe.acc / (float)n;
+        } else if (threaded) {
+            RETURN_IF_ERROR(thread_team_eval(&team, &x, &y, &loss, &acc));
+        } else {
+            RETURN_IF_ERROR(mlp_forward(&model, &eval_work, &x));
+            RETURN_IF_ERROR(mlp_metrics(&eval_work, &y, &loss, &acc));
+        }
+        sums[0] += (double)loss * (double)n;
+        sums[1] += round((double)acc * (double)n);
+    }
+    MPI_Reduce(dp_rank == 0 ? MPI_IN_PLACE : sums, sums, 2, MPI_DOUBLE,
+               MPI_SUM, 0, dp_comm);
+    if (world_rank == 0) {
+        printf("test loss = %.5f acc = %.5f %.0f/%zu correct\n",
+               sums[0] / (double)d_test.n, sums[1] / (double)d_test.n,
+               sums[1], d_test.n);
+    }
+    if (c.trace_file != NULL &&
+        trace_gather_write(c.trace_file, train_comm) == 0 && world_rank == 0) {
+        printf("trace written to %s\n", c.trace_file);
+    }
+    // Rank 0's kernels stand for the others; they run the same shapes.
+    if (c.perf_counters && world_rank == 0) perf_report();
+    if (c.use_plan) plan_free(&plan);
+    grad_buckets_free(&buckets);
+    sparse_grads_free(&sparse_grads);
+    local_sgd_free(&local_sgd);
+    load_balancer_free(&lb);
+    if (balanced) {
+        tensor_free(share_x);
+        tensor_free(share_y);
+        free(share_x);
+        free(share_y);
+    }
+    param_server_free(&ps);
+    thread_team_free(&team);
+    pool_free(&pool);
+    pipeline_free(&pipe);
+    mlp_work_free(&work);
+    mlp_work_free(&eval_work);
+    mlp_free(&model);
+    free(order);
+    if (streamed) {
+        streamed_dataset_free(&train_stream);
+        streamed_dataset_free(&test_stream);
+    } else {
+        if (sharded) {
+            dataset_shard_free(&d);
+        } else {
+            shared_dataset_free(&train);
+        }
+        shared_dataset_free(&test);
+    }
+    collectives_free(&coll);
+    MPI_Comm_free(&node_comm);
+    tp_grid_free(&grid);
+    if (evaluated) {
+        async_eval_free(&snapshots);
+        if (eval_comm != MPI_COMM_NULL) MPI_Comm_free(&eval_comm);
+        MPI_Comm_free(&train_comm);
     }
     MPI_Finalize();
     return 0;
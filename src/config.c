@@ -0,0 +1,344 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Config config_default(void) {
+    Config c;
+    memset(&c, 0, sizeof(c));
+    c.epochs = 1;
+    c.batch_size = 8;
+    c.metrics_every = 100;
+    c.metrics_file = NULL;
+    c.trace_file = NULL;
+    c.perf_counters = false;
+    c.check_collectives = false;
+    c.eval_batch_size = 1000;
+    c.eval_every = 0;
+    c.lr = 0.001f;
+    c.beta1 = 0.9f;
+    c.beta2 = 0.999f;
+    c.eps = 1e-08f;
+    c.seed = 67;
+    c.sizes[0] = 784;
+    c.sizes[1] = 256;
+    c.sizes[2] = 10;
+    c.n_sizes = 3;
+    c.checkpoint_every = 0;
+    c.use_plan = false;
+    c.threads = 1;
+    c.hogwild = 0;
+    c.hogwild_compare = false;
+    c.numa = false;
+    c.bucket_kb = 64;
+    c.allreduce = "mpi";
+    c.allreduce_small = 4096;
+    c.allreduce_large = 256 * 1024;
+    c.wire = "fp32";
+    c.loss_scale = 1.0f;
+    c.dynamic_loss_scale = false;
+    c.topk = 0.0f;
+    c.topk_threshold = 0.0f;
+    c.local_steps = 0;
+    c.local_adaptive = false;
+    c.average_moments = false;
+    c.param_server = false;
+    c.staleness = 4;
+    c.balance_every = 0;
+    c.shard = "none";
+    c.distribute = "files";
+    c.tensor_parallel = 1;
+    c.pipeline_stages = 1;
+    c.micro_batches = 1;
+    return c;
+}
+
+static int parse_size(const char* s, size_t* out) {
+    char* end = NULL;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s || *end != '\0') return 1;
+    *out = (size_t)v;
+    return 0;
+}
+
+static int parse_float(const char* s, float* out) {
+    char* end = NULL;
+    float v = strtof(s, &end);
+    if (end == s || *end != '\0') return 1;
+    *out = v;
+    return 0;
+}
+
+static int parse_sizes(const char* s, size_t* sizes, size_t max, size_t* n) {
+    size_t count = 0;
+    const char* p = s;
+    while (*p) {
+        char* end = NULL;
+        unsigned long long v = strtoull(p, &end, 10);
+        if (end == p) return 1;
+        if (count == max) return 2;
+        sizes[count++] = (size_t)v;
+        p = end;
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return 3;
+        }
+    }
+    *n = count;
+    return 0;
+}
+
+static int parse_layers(const char* s, size_t* sizes, size_t* n) {
+    size_t count = 0;
+    if (parse_sizes(s, sizes, MLP_MAX_LAYERS + 1, &count)) return 1;
+    if (count < 2) return 4;
+    for (size_t i = 0; i < count; ++i) {
+        if (sizes[i] == 0) return 5;
+    }
+    *n = count;
+    return 0;
+}
+
+static int parse_floats(const char* s, float* values, size_t max, size_t* n) {
+    size_t count = 0;
+    const char* p = s;
+    while (*p) {
+        char* end = NULL;
+        float v = strtof(p, &end);
+        if (end == p) return 1;
+        if (count == max) return 2;
+        values[count++] = v;
+        p = end;
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return 3;
+        }
+    }
+    *n = count;
+    return 0;
+}
+
+void config_usage(const char* prog) {
+    printf("usage: %s [options]\n", prog);
+    printf("  --epochs N          training epochs (default 1)\n");
+    printf("  --batch-size N      samples per step\n");
+    printf("  --metrics-every N   report training metrics every N steps "
+           "(default 100)\n");
+    printf("  --metrics-file PATH also write them to PATH as CSV\n");
+    printf("  --trace PATH        write a Chrome trace of per-phase timings\n");
+    printf("  --perf              count cycles, instructions and cache misses "
+           "per kernel\n");
+    printf("  --eval-batch N      samples per test forward pass (mpi, "
+           "default 1000)\n");
+    printf("  --eval-every N      evaluate every N steps on a separate rank "
+           "(mpi)\n");
+    printf("  --lr F              adam learning rate (default 0.001)\n");
+    printf("  --seed N            init and shuffle seed (default 67)\n");
+    printf("  --layers A,B,...    layer widths, input first (default "
+           "784,256,10)\n");
+    printf("  --checkpoint K      keep every K-th activation, recompute the "
+           "rest\n");
+    printf("  --plan              run steps from a static plan with buffer "
+           "reuse\n");
+    printf("  --threads N         run independent plan ops on N workers "
+           "(needs --plan), or\n"
+           "                      split each rank's batch over N threads "
+           "(mpi)\n");
+    printf("  --hogwild T         train on T threads updating shared weights "
+           "without locks\n");
+    printf("  --hogwild-compare   also train synchronously from the same "
+           "weights and compare\n");
+    printf("  --numa              pin workers across NUMA nodes and place "
+           "buffers where\n"
+           "                      they are used\n");
+    printf("  --bucket-kb N       gradient allreduce bucket size (mpi, default "
+           "64)\n");
+    printf("  --allreduce NAME    mpi, ring, rd, rabenseifner, hier, auto or "
+           "tune (mpi)\n");
+    printf("  --allreduce-cutoffs S,L  auto: rd below S bytes, ring from L, "
+           "rabenseifner\n"
+           "                      between\n");
+    printf("  --check-collectives  compare every allreduce with MPI_Allreduce "
+           "and exit (mpi)\n");
+    printf("  --wire FMT          gradient wire format: fp32, fp16 or bf16 "
+           "(mpi)\n");
+    printf("  --loss-scale S      scale gradients on the wire by S, or "
+           "'dynamic'\n");
+    printf("  --topk F            send only the largest fraction F of each "
+           "gradient (mpi)\n");
+    printf("  --topk-threshold T  send only gradient entries with |g| >= T "
+           "(mpi)\n");
+    printf("  --local-steps H     average models every H local steps instead "
+           "of summing\n"
+           "                      gradients every step (mpi)\n");
+    printf("  --local-adaptive    shrink H as the loss falls\n");
+    printf("  --average-moments   average the adam moments with the weights\n");
+    printf("  --param-server      push updates to and fetch weights from "
+           "an asynchronous\n"
+           "                      parameter server in RMA windows (mpi)\n");
+    printf("  --staleness S       run at most S steps ahead of the slowest "
+           "rank (default 4)\n");
+    printf("  --balance-every N   resize each rank's share of the batch to "
+           "its speed every\n"
+           "                      N steps and cover every epoch in full "
+           "(mpi)\n");
+    printf("  --shard LAYOUT      read only this rank's training rows: block "
+           "or strided\n"
+           "                      (mpi, default none)\n");
+    printf("  --distribute MODE   files, or scatter: rank 0 reads and streams "
+           "the data (mpi)\n");
+    printf("  --tensor-parallel T split the hidden layer over T ranks, data "
+           "parallel across\n"
+           "                      groups of T (mpi)\n");
+    printf("  --pipeline P        run consecutive layers on P ranks, data "
+           "parallel across\n"
+           "                      groups of P (mpi)\n");
+    printf("  --micro-batches M   split each pipelined batch into M "
+           "micro-batches (mpi)\n");
+    printf("  --sweep-lr A,B,...  train one model per lr (and per seed) side "
+           "by side\n");
+    printf("  --sweep-seeds A,..  init seeds for the sweep\n");
+}
+
+int config_parse(int argc, char** argv, Config* c) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+        int err = 0;
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            config_usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(arg, "--plan") == 0) {
+            c->use_plan = true;
+            continue;
+        }
+        if (strcmp(arg, "--local-adaptive") == 0) {
+            c->local_adaptive = true;
+            continue;
+        }
+        if (strcmp(arg, "--average-moments") == 0) {
+            c->average_moments = true;
+            continue;
+        }
+        if (strcmp(arg, "--numa") == 0) {
+            c->numa = true;
+            continue;
+        }
+        if (strcmp(arg, "--perf") == 0) {
+            c->perf_counters = true;
+            continue;
+        }
+        if (strcmp(arg, "--hogwild-compare") == 0) {
+            c->hogwild_compare = true;
+            continue;
+        }
+        if (strcmp(arg, "--check-collectives") == 0) {
+            c->check_collectives = true;
+            continue;
+        }
+        if (strcmp(arg, "--param-server") == 0) {
+            c->param_server = true;
+            continue;
+        }
+        if (val == NULL) {
+            printf("missing value for %s\n", arg);
+            return 2;
+        }
+        if (strcmp(arg, "--epochs") == 0) {
+            err = parse_size(val, &c->epochs);
+        } else if (strcmp(arg, "--batch-size") == 0) {
+            err = parse_size(val, &c->batch_size) || c->batch_size == 0;
+        } else if (strcmp(arg, "--metrics-every") == 0) {
+            err = parse_size(val, &c->metrics_every) || c->metrics_every == 0;
+        } else if (strcmp(arg, "--metrics-file") == 0) {
+            c->metrics_file = val;
+        } else if (strcmp(arg, "--trace") == 0) {
+            c->trace_file = val;
+        } else if (strcmp(arg, "--eval-batch") == 0) {
+            err = parse_size(val, &c->eval_batch_size) ||
+                  c->eval_batch_size == 0;
+        } else if (strcmp(arg, "--eval-every") == 0) {
+            err = parse_size(val, &c->eval_every);
+        } else if (strcmp(arg, "--lr") == 0) {
+            err = parse_float(val, &c->lr);
+        } else if (strcmp(arg, "--seed") == 0) {
+            size_t seed = 0;
+            err = parse_size(val, &seed);
+            c->seed = seed;
+        } else if (strcmp(arg, "--layers") == 0) {
+            err = parse_layers(val, c->sizes, &c->n_sizes);
+        } else if (strcmp(arg, "--checkpoint") == 0) {
+            err = parse_size(val, &c->checkpoint_every);
+        } else if (strcmp(arg, "--threads") == 0) {
+            err = parse_size(val, &c->threads) || c->threads == 0;
+        } else if (strcmp(arg, "--hogwild") == 0) {
+            err = parse_size(val, &c->hogwild);
+        } else if (strcmp(arg, "--bucket-kb") == 0) {
+            err = parse_size(val, &c->bucket_kb);
+        } else if (strcmp(arg, "--allreduce") == 0) {
+            c->allreduce = val;
+        } else if (strcmp(arg, "--allreduce-cutoffs") == 0) {
+            size_t cutoffs[2];
+            size_t n = 0;
+            err = parse_sizes(val, cutoffs, 2, &n) || n != 2 ||
+                  cutoffs[0] > cutoffs[1];
+            if (!err) {
+                c->allreduce_small = cutoffs[0];
+                c->allreduce_large = cutoffs[1];
+            }
+        } else if (strcmp(arg, "--wire") == 0) {
+            c->wire = val;
+        } else if (strcmp(arg, "--loss-scale") == 0) {
+            c->dynamic_loss_scale = strcmp(val, "dynamic") == 0;
+            if (c->dynamic_loss_scale) {
+                c->loss_scale = 65536.0f;
+            } else {
+                err = parse_float(val, &c->loss_scale) || c->loss_scale <= 0;
+            }
+        } else if (strcmp(arg, "--topk") == 0) {
+            err = parse_float(val, &c->topk) || c->topk < 0.0f ||
+                  c->topk > 1.0f;
+        } else if (strcmp(arg, "--topk-threshold") == 0) {
+            err = parse_float(val, &c->topk_threshold) ||
+                  c->topk_threshold < 0.0f;
+        } else if (strcmp(arg, "--staleness") == 0) {
+            err = parse_size(val, &c->staleness);
+        } else if (strcmp(arg, "--balance-every") == 0) {
+            err = parse_size(val, &c->balance_every);
+        } else if (strcmp(arg, "--local-steps") == 0) {
+            err = parse_size(val, &c->local_steps);
+        } else if (strcmp(arg, "--shard") == 0) {
+            c->shard = val;
+        } else if (strcmp(arg, "--distribute") == 0) {
+            c->distribute = val;
+        } else if (strcmp(arg, "--tensor-parallel") == 0) {
+            err = parse_size(val, &c->tensor_parallel) ||
+                  c->tensor_parallel == 0;
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            err = parse_size(val, &c->pipeline_stages) ||
+                  c->pipeline_stages == 0;
+        } else if (strcmp(arg, "--micro-batches") == 0) {
+            err = parse_size(val, &c->micro_batches) || c->micro_batches == 0;
+        } else if (strcmp(arg, "--sweep-lr") == 0) {
+            err = parse_floats(val, c->sweep_lr, SWEEP_MAX_MODELS,
+                               &c->n_sweep_lr);
+        } else if (strcmp(arg, "--sweep-seeds") == 0) {
+            err = parse_sizes(val, c->sweep_seeds, SWEEP_MAX_MODELS,
+                              &c->n_sweep_seeds);
+        } else {
+            printf("unknown option %s\n", arg);
+            config_usage(argv[0]);
+            return 3;
+        }
+        if (err) {
+            printf("bad value for %s: %s\n", arg, val);
+            return 4;
+        }
+        ++i;
+    }
+    return 0;
+}
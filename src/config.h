@@ -0,0 +1,116 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "model.h"
+
+#define SWEEP_MAX_MODELS 64
+
+typedef struct {
+    size_t epochs;
+    size_t batch_size;
+    // Training loss, accuracy and throughput are reported every this many
+    // steps and per epoch, also as CSV to metrics_file unless it is NULL.
+    size_t metrics_every;
+    const char* metrics_file;
+    // Chrome trace JSON of per-phase spans is written here unless NULL.
+    const char* trace_file;
+    // Read hardware counters around every kernel call and print them per
+    // kernel and shape at exit.
+    bool perf_counters;
+    // Samples per forward pass when the MPI driver evaluates the test set.
+    size_t eval_batch_size;
+    // The MPI driver's last rank leaves training to evaluate snapshots of
+    // rank 0's weights every this many steps; 0 only evaluates at the end.
+    size_t eval_every;
+    float lr;
+    float beta1;
+    float beta2;
+    float eps;
+    uint64_t seed;
+    // Layer widths including the input and the output, e.g. 784,256,10.
+    size_t sizes[MLP_MAX_LAYERS + 1];
+    size_t n_sizes;
+    // Keep every k-th activation and recompute the rest in backward, 0 keeps
+    // all of them.
+    size_t checkpoint_every;
+    // Replay a prebuilt op list with a shared activation arena each step.
+    bool use_plan;
+    // Workers running independent plan ops concurrently; without a plan
+    // the MPI driver splits each rank's batch over them instead.
+    size_t threads;
+    // Threads training lock-free on shared weights, 0 trains synchronously.
+    size_t hogwild;
+    // Also train synchronously from the same initial weights and report
+    // both runs' test metrics and throughput side by side.
+    bool hogwild_compare;
+    // Pin worker threads to cores spread over the NUMA nodes and first touch
+    // the dataset, weights and per-thread buffers from the workers using them.
+    bool numa;
+    // Gradient allreduce bucket size in KiB for the MPI driver.
+    size_t bucket_kb;
+    // Allreduce algorithm for the MPI driver: mpi, ring, rd, rabenseifner,
+    // hier (shared memory within a node, then across node leaders), auto (by
+    // the cutoffs below, in bytes) or tune (measured at startup).
+    const char* allreduce;
+    size_t allreduce_small;
+    size_t allreduce_large;
+    // The MPI driver only checks every allreduce algorithm against
+    // MPI_Allreduce and exits.
+    bool check_collectives;
+    // Gradient element format on the wire: fp32, fp16 or bf16.
+    const char* wire;
+    // Gradients are scaled by this before communication; with
+    // dynamic_loss_scale it adapts to overflows.
+    float loss_scale;
+    bool dynamic_loss_scale;
+    // Sparse gradient exchange: send the top fraction of each gradient's
+    // entries and/or those at least topk_threshold in magnitude, carrying the
+    // rest to the next step. Both 0 exchange dense gradients.
+    float topk;
+    float topk_threshold;
+    // Local SGD: each rank takes local_steps optimizer steps on its own
+    // batches between model averages, 0 sums gradients every step. With
+    // local_adaptive the period shrinks with the loss; average_moments also
+    // averages the Adam moments.
+    size_t local_steps;
+    bool local_adaptive;
+    bool average_moments;
+    // Asynchronous training against a parameter server held in MPI windows;
+    // no rank gets more than `staleness` steps ahead of the slowest.
+    bool param_server;
+    size_t staleness;
+    // Every this many steps, resize each rank's share of the global batch
+    // to its measured speed; the epoch tail is then spread over the ranks
+    // too. 0 gives every rank batch_size samples and drops the tail.
+    size_t balance_every;
+    // MPI training data: none loads it once per node, block or strided reads
+    // only each rank's shard of the rows.
+    const char* shard;
+    // How MPI ranks get the data: files, read by every node, or scatter,
+    // read by rank 0 and streamed to the others (block shards by default).
+    const char* distribute;
+    // Ranks splitting each model's hidden layer; the world is a grid of
+    // world_size / tensor_parallel data parallel replicas of that many ranks.
+    size_t tensor_parallel;
+    // Stages each model's layers are split over, data parallel across groups
+    // of that many ranks, and micro-batches per batch in the pipeline.
+    size_t pipeline_stages;
+    size_t micro_batches;
+    // Train one model per (lr, seed) pair in a single process; an empty list
+    // stands for the single lr or seed above.
+    float sweep_lr[SWEEP_MAX_MODELS];
+    size_t n_sweep_lr;
+    size_t sweep_seeds[SWEEP_MAX_MODELS];
+    size_t n_sweep_seeds;
+} Config;
+
+Config config_default(void);
+
+int config_parse(int argc, char** argv, Config* c);
+
+void config_usage(const char* prog);
+
+#endif
@@ -0,0 +1,61 @@
+#include "half.h"
+
+#include <string.h>
+
+static uint32_t float_bits(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    return x;
+}
+
+static float bits_float(uint32_t x) {
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+uint16_t float_to_half(float f) {
+    uint32_t x = float_bits(f);
+    uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+    uint32_t abs = x & 0x7fffffff;
+    if (abs > 0x7f800000) return sign | 0x7e00;
+    // 65520 and up round past the largest half, 65504.
+    if (abs >= 0x477ff000) return sign | 0x7c00;
+    if (abs < 0x38800000) {
+        // Below 2^-14: subnormal half, in units of 2^-24.
+        if (abs <= 0x33000000) return sign;
+        uint32_t e = abs >> 23;
+        uint32_t m = (abs & 0x7fffff) | 0x800000;
+        uint32_t shift = 126 - e;
+        uint32_t h = m >> shift;
+        uint32_t rem = m & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (h & 1))) h++;
+        return sign | (uint16_t)h;
+    }
+    uint32_t h = (abs - 0x38000000) >> 13;
+    uint32_t rem = abs & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+    return sign | (uint16_t)h;
+}
+
+float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1f;
+    uint32_t m = h & 0x3ff;
+    if (e == 0x1f) return bits_float(sign | 0x7f800000 | (m << 13));
+    if (e == 0) {
+        float f = (float)m * (1.0f / 16777216.0f);
+        return sign ? -f : f;
+    }
+    return bits_float(sign | ((e + 112) << 23) | (m << 13));
+}
+
+uint16_t float_to_bf16(float f) {
+    uint32_t x = float_bits(f);
+    if ((x & 0x7fffffff) > 0x7f800000) return (uint16_t)((x >> 16) | 0x40);
+    x += 0x7fff + ((x >> 16) & 1);
+    return (uint16_t)(x >> 16);
+}
+
+float bf16_to_float(uint16_t b) { return bits_float((uint32_t)b << 16); }
@@ -0,0 +1,16 @@
+#ifndef HALF_H
+#define HALF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// IEEE binary16 and bfloat16 bit patterns, rounded to nearest even.
+uint16_t float_to_half(float f);
+
+float half_to_float(uint16_t h);
+
+uint16_t float_to_bf16(float f);
+
+float bf16_to_float(uint16_t b);
+
+#endif
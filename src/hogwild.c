@@ -0,0 +1,157 @@
+#include "hogwild.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "numa.h"
+#include "rng.h"
+#include "utils.h"
+
+typedef struct {
+    Mlp* model;
+    const Dataset* d;
+    const Config* c;
+    atomic_size_t* t;
+    size_t id;
+    // Pinned here before allocating anything, or -1.
+    int cpu;
+    size_t steps;
+    double loss_sum;
+    double acc_sum;
+    int ret;
+} HogwildWorker;
+
+static int worker_run(HogwildWorker* hw, MlpWork* work, Tensor** grads,
+                      Tensor* batch_x, Tensor* batch_y, size_t* rows) {
+    const Config* c = hw->c;
+    const Dataset* d = hw->d;
+    size_t batch_size = c->batch_size;
+    RNG r;
+    rng_seed(&r, c->seed + 0x9E3779B97F4A7C15ull * (hw->id + 1));
+
+    for (size_t step = 0; step < hw->steps; ++step) {
+        for (size_t i = 0; i < batch_size; ++i) {
+            rows[i] = rng_rand(&r) % d->n;
+        }
+        RETURN_IF_ERROR(tensor_gather(d->x, batch_x, rows, batch_size));
+        RETURN_IF_ERROR(tensor_gather(d->y, batch_y, rows, batch_size));
+
+        float loss = 0.0f;
+        float acc = 0.0f;
+        RETURN_IF_ERROR(mlp_forward(hw->model, work, batch_x));
+        RETURN_IF_ERROR(mlp_metrics(work, batch_y, &loss, &acc));
+        RETURN_IF_ERROR(mlp_backward(hw->model, work, batch_x, batch_y, grads));
+        hw->loss_sum += loss;
+        hw->acc_sum += acc;
+
+        // Other threads read and write the same params, m and v while this
+        // runs; lost or torn updates are the accepted cost of no locking.
+        size_t t = atomic_fetch_add(hw->t, 1) + 1;
+        RETURN_IF_ERROR(mlp_adam_step(hw->model, grads, c->lr, c->beta1,
+                                      c->beta2, c->eps, t));
+    }
+    return 0;
+}
+
+static void* worker_main(void* arg) {
+    HogwildWorker* hw = (HogwildWorker*)arg;
+    if (hw->cpu >= 0 && numa_pin_self(hw->cpu)) {
+        hw->ret = 5;
+        return NULL;
+    }
+    size_t batch_size = hw->c->batch_size;
+    MlpWork work = {0};
+    Tensor* grads[MLP_MAX_PARAMS] = {0};
+    Shape x_shape = hw->d->x->shape;
+    x_shape.dims[0] = batch_size;
+    Shape y_shape = hw->d->y->shape;
+    y_shape.dims[0] = batch_size;
+    Tensor* batch_x = tensor_alloc(x_shape, DTYPE_FLOAT32);
+    Tensor* batch_y = tensor_alloc(y_shape, DTYPE_UINT8);
+    size_t* rows = (size_t*)malloc(batch_size * sizeof(size_t));
+
+    if (!batch_x || !batch_y || !rows) {
+        hw->ret = 1;
+    } else if ((hw->ret = mlp_work_init(&work, hw->model, batch_size,
+                                        hw->c->checkpoint_every)) == 0 &&
+               (hw->ret = mlp_grads_alloc(hw->model, grads)) == 0) {
+        hw->ret = worker_run(hw, &work, grads, batch_x, batch_y, rows);
+    }
+
+    mlp_grads_free(hw->model, grads);
+    mlp_work_free(&work);
+    tensor_free(batch_x);
+    tensor_free(batch_y);
+    free(batch_x);
+    free(batch_y);
+    free(rows);
+    return NULL;
+}
+
+int hogwild_train(Mlp* m, const Dataset* d, const Config* c,
+                  HogwildStats* stats) {
+    if (m == NULL || d == NULL || c == NULL || stats == NULL) return 1;
+    if (c->hogwild == 0 || c->batch_size == 0 || d->n == 0) return 2;
+    size_t n_threads = c->hogwild;
+    HogwildWorker* workers =
+        (HogwildWorker*)calloc(n_threads, sizeof(HogwildWorker));
+    pthread_t* threads = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+    int* cpus = (int*)malloc(n_threads * sizeof(int));
+    NumaTopology topo;
+    if (!workers || !threads || !cpus ||
+        (c->numa && numa_discover(&topo))) {
+        free(workers);
+        free(threads);
+        free(cpus);
+        return 3;
+    }
+    // Same cpus as a pool of n_threads bound with numa_bind_pool.
+    for (size_t i = 0; i < n_threads; ++i) cpus[i] = -1;
+    if (c->numa) numa_spread(&topo, n_threads, cpus, NULL);
+
+    // Same number of steps as the synchronous loop, split across threads.
+    size_t total = c->epochs * (d->n / c->batch_size);
+    atomic_size_t t;
+    atomic_init(&t, 0);
+    double start = wall_time();
+    size_t started = 0;
+    int ret = 0;
+    for (size_t i = 0; i < n_threads; ++i) {
+        workers[i].model = m;
+        workers[i].d = d;
+        workers[i].c = c;
+        workers[i].t = &t;
+        workers[i].id = i;
+        workers[i].cpu = cpus[i];
+        workers[i].steps = total / n_threads + (i < total % n_threads);
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i])) {
+            ret = 4;
+            break;
+        }
+        started++;
+    }
+    double loss_sum = 0.0;
+    double acc_sum = 0.0;
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+        if (workers[i].ret != 0 && ret == 0) ret = workers[i].ret;
+        loss_sum += workers[i].loss_sum;
+        acc_sum += workers[i].acc_sum;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->steps = atomic_load(&t);
+    stats->samples = stats->steps * c->batch_size;
+    stats->seconds = wall_time() - start;
+    if (stats->steps > 0) {
+        stats->loss = (float)(loss_sum / (double)stats->steps);
+        stats->acc = (float)(acc_sum / (double)stats->steps);
+    }
+    free(workers);
+    free(threads);
+    free(cpus);
+    return ret;
+}
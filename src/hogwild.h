@@ -0,0 +1,25 @@
+#ifndef HOGWILD_H
+#define HOGWILD_H
+
+#include <stddef.h>
+
+#include "config.h"
+#include "dataset.h"
+#include "model.h"
+
+typedef struct {
+    size_t steps;
+    size_t samples;
+    double seconds;
+    float loss;
+    float acc;
+} HogwildStats;
+
+// Trains m for c->epochs on c->hogwild threads. Each thread samples its own
+// minibatches, keeps private activations and gradients and applies Adam to
+// the shared params and moments without any locking; only the step counter
+// is shared atomically. loss and acc in stats average over all steps taken.
+int hogwild_train(Mlp* m, const Dataset* d, const Config* c,
+                  HogwildStats* stats);
+
+#endif
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <utils.h>
 
+#include "perf.h"
 #include "tensor.h"
 #include "utils.h"
 
@@ -17,8 +18,8 @@ int max(size_t a, size_t b) {
     }
 }
 
-int bmm(Tensor* C, const Tensor* A, const Tensor* B, bool transpose_A,
-        bool transpose_B) {
+int bmm_check(const Tensor* C, const Tensor* A, const Tensor* B,
+              bool transpose_A, bool transpose_B) {
     if (C == NULL || A == NULL || B == NULL) return 1;
     if (C->shape.rank != 3 || A->shape.rank != 3 || B->shape.rank != 3)
         return 2;
@@ -34,14 +35,23 @@ int bmm(Tensor* C, const Tensor* A, const Tensor* B, bool transpose_A,
     if (A->dtype != DTYPE_FLOAT32 || B->dtype != DTYPE_FLOAT32 ||
         C->dtype != DTYPE_FLOAT32)
         return 4;
+    return 0;
+}
 
+void bmm_unchecked(Tensor* C, const Tensor* A, const Tensor* B,
+                   bool transpose_A, bool transpose_B) {
+    size_t a_axis = transpose_A ? 1 : 2;
     float* a_data = (float*)A->data;
     float* b_data = (float*)B->data;
     float* c_data = (float*)C->data;
     size_t true_C0 =
         max(A->shape.dims[0], max(C->shape.dims[0], B->shape.dims[0]));
-    size_t true_C1 = max(A->shape.dims[1], C->shape.dims[1]);
-    size_t true_C2 = max(B->shape.dims[2], C->shape.dims[2]);
+    size_t a_rows = transpose_A ? A->shape.dims[2] : A->shape.dims[1];
+    size_t b_cols = transpose_B ? B->shape.dims[1] : B->shape.dims[2];
+    size_t true_C1 = max(a_rows, C->shape.dims[1]);
+    size_t true_C2 = max(b_cols, C->shape.dims[2]);
+    PerfSample perf;
+    PERF_BEGIN(&perf);
     for (size_t i = 0; i < true_C0; ++i) {
         for (size_t j = 0; j < true_C1; ++j) {
             for (size_t k = 0; k < true_C2; ++k) {
@@ -76,10 +86,23 @@ int bmm(Tensor* C, const Tensor* A, const Tensor* B, bool transpose_A,
             }
         }
     }
+    size_t inner = A->shape.dims[a_axis];
+    PERF_END(&perf,
+             transpose_A   ? "bmm A^T"
+             : transpose_B ? "bmm B^T"
+                           : "bmm",
+             shapeN(4, true_C0, true_C1, true_C2, inner),
+             2.0 * (double)(true_C0 * true_C1 * true_C2 * inner));
+}
+
+int bmm(Tensor* C, const Tensor* A, const Tensor* B, bool transpose_A,
+        bool transpose_B) {
+    RETURN_IF_ERROR(bmm_check(C, A, B, transpose_A, transpose_B));
+    bmm_unchecked(C, A, B, transpose_A, transpose_B);
     return 0;
 }
 
-int tensor_add(Tensor* a, const Tensor* b) {
+int tensor_add_check(const Tensor* a, const Tensor* b) {
     if (a == NULL || b == NULL) {
         return 1;
     }
@@ -88,9 +111,14 @@ int tensor_add(Tensor* a, const Tensor* b) {
         return 2;
     }
     RETURN_IF_ERROR(shape_is_compatible(b->shape, a->shape));
+    return 0;
+}
 
+void tensor_add_unchecked(Tensor* a, const Tensor* b) {
     size_t b_indicies[MAX_RANK];
     size_t new_dims = a->shape.rank - b->shape.rank;
+    PerfSample perf;
+    PERF_BEGIN(&perf);
     for (size_t i = 0; i < a->size; ++i) {
         tensor_unindex(a->shape, i, b_indicies);
 
@@ -122,6 +150,12 @@ int tensor_add(Tensor* a, const Tensor* b) {
             a_data[i] += b_data[src_i];
         }
     }
+    PERF_END(&perf, "tensor_add", a->shape, (double)a->size);
+}
+
+int tensor_add(Tensor* a, const Tensor* b) {
+    RETURN_IF_ERROR(tensor_add_check(a, b));
+    tensor_add_unchecked(a, b);
     return 0;
 }
 
@@ -133,14 +167,17 @@ int tensor_tanh(Tensor* a) {
         return 2;
     }
     float* a_data = (float*)a->data;
+    PerfSample perf;
+    PERF_BEGIN(&perf);
     for (size_t i = 0; i < a->size; ++i) {
         a_data[i] = tanh(a_data[i]);
     }
+    PERF_END(&perf, "tensor_tanh", a->shape, (double)a->size);
 
     return 0;
 }
 
-int tensor_argmax(const Tensor* a, Tensor* out) {
+int tensor_argmax_check(const Tensor* a, const Tensor* out) {
     if (a == NULL || out == NULL) {
         return 1;
     }
@@ -164,27 +201,35 @@ int tensor_argmax(const Tensor* a, Tensor* out) {
         print_shape(out->shape);
         return 4;
     }
+    return 0;
+}
 
+void tensor_argmax_unchecked(const Tensor* a, Tensor* out) {
+    size_t last = a->shape.rank - 1;
     size_t indicies[MAX_RANK];
     float* a_data = (float*)a->data;
     uint8_t* out_data = (uint8_t*)out->data;
     for (size_t i = 0; i < out->size; ++i) {
         tensor_unindex(out->shape, i, indicies);
-        indicies[s.rank] = 0;
+        indicies[last] = 0;
         size_t new_i = tensor_index_array(a->shape, indicies);
         size_t argmax = 0;
-        for (size_t j = 1; j < a->shape.dims[s.rank]; ++j) {
+        for (size_t j = 1; j < a->shape.dims[last]; ++j) {
             if (a_data[new_i + j] > a_data[new_i + argmax]) {
                 argmax = j;
             }
         }
         out_data[i] = argmax;
     }
+}
 
+int tensor_argmax(const Tensor* a, Tensor* out) {
+    RETURN_IF_ERROR(tensor_argmax_check(a, out));
+    tensor_argmax_unchecked(a, out);
     return 0;
 }
 
-int accuracy(const Tensor* a, const Tensor* b, float* acc) {
+int accuracy_check(const Tensor* a, const Tensor* b) {
     if (a == NULL || b == NULL) {
         return 1;
     }
@@ -196,7 +241,10 @@ int accuracy(const Tensor* a, const Tensor* b, float* acc) {
     if (!shape_is_equal(a->shape, b->shape)) {
         return 3;
     }
+    return 0;
+}
 
+void accuracy_unchecked(const Tensor* a, const Tensor* b, float* acc) {
     uint8_t* a_data = (uint8_t*)a->data;
     uint8_t* b_data = (uint8_t*)b->data;
     size_t matches = 0;
@@ -207,11 +255,15 @@ int accuracy(const Tensor* a, const Tensor* b, float* acc) {
     }
 
     *acc = (float)(matches) / a->size;
+}
 
+int accuracy(const Tensor* a, const Tensor* b, float* acc) {
+    RETURN_IF_ERROR(accuracy_check(a, b));
+    accuracy_unchecked(a, b, acc);
     return 0;
 }
 
-int cross_entropy(const Tensor* y_, const Tensor* y, float* loss) {
+int cross_entropy_check(const Tensor* y_, const Tensor* y) {
     if (y_ == NULL || y == NULL) {
         return 1;
     }
@@ -228,17 +280,23 @@ int cross_entropy(const Tensor* y_, const Tensor* y, float* loss) {
     if (!shape_is_equal(s, y->shape)) {
         return 3;
     }
+    return 0;
+}
 
+void cross_entropy_unchecked(const Tensor* y_, const Tensor* y, float* loss) {
+    size_t last = y_->shape.rank - 1;
     float* y_data_ = (float*)y_->data;
     uint8_t* y_data = (uint8_t*)y->data;
     size_t indicies[MAX_RANK];
+    PerfSample perf;
+    PERF_BEGIN(&perf);
     *loss = 0.0;
     for (size_t i = 0; i < y->size; ++i) {
         tensor_unindex(y->shape, i, indicies);
-        indicies[s.rank] = 0;
+        indicies[last] = 0;
         size_t new_i = tensor_index_array(y_->shape, indicies);
         float denom = 0.0;
-        for (size_t j = 0; j < y_->shape.dims[s.rank]; ++j) {
+        for (size_t j = 0; j < y_->shape.dims[last]; ++j) {
             size_t y_i_ = new_i + j;
             denom += exp(y_data_[y_i_]);
         }
@@ -247,14 +305,20 @@ int cross_entropy(const Tensor* y_, const Tensor* y, float* loss) {
     }
 
     *loss /= y->size;
+    PERF_END(&perf, "cross_entropy", y_->shape, 2.0 * (double)y_->size);
+}
 
+int cross_entropy(const Tensor* y_, const Tensor* y, float* loss) {
+    RETURN_IF_ERROR(cross_entropy_check(y_, y));
+    cross_entropy_unchecked(y_, y, loss);
     return 0;
 }
 
 // op in c_e a,b,c and we add them (a+b+c) / 3 to get the avg and the output y
 // (y=(a+b+c) / 3) what is dy/da? b = 0, c = 0, a = 1 / 3 dy/da = 1/3
-int cross_entropy_backward(const Tensor* y_, const Tensor* y, Tensor* y_grad_) {
-    if (y == NULL) {
+int cross_entropy_backward_check(const Tensor* y_, const Tensor* y,
+                                 const Tensor* y_grad_) {
+    if (y_ == NULL || y == NULL || y_grad_ == NULL) {
         return 1;
     }
 
@@ -276,22 +340,34 @@ int cross_entropy_backward(const Tensor* y_, const Tensor* y, Tensor* y_grad_) {
         return 4;
     }
 
-    RETURN_IF_ERROR(tensor_fill_float(y_grad_, 1.0));
-    RETURN_IF_ERROR(tensor_scale_float(y_grad_, 1.0 / y->size));
+    if (!shape_is_equal(y_->shape, y_grad_->shape) ||
+        y_grad_->dtype != DTYPE_FLOAT32) {
+        return 5;
+    }
+    return 0;
+}
+
+void cross_entropy_backward_unchecked(const Tensor* y_, const Tensor* y,
+                                      Tensor* y_grad_) {
+    size_t last = y_->shape.rank - 1;
+    PerfSample perf;
+    PERF_BEGIN(&perf);
+    tensor_fill_float(y_grad_, 1.0);
+    tensor_scale_float(y_grad_, 1.0 / y->size);
     float* y_data_ = (float*)y_->data;
     uint8_t* y_data = (uint8_t*)y->data;
     float* y_grad_data_ = (float*)y_grad_->data;
     size_t indicies[MAX_RANK];
     for (size_t i = 0; i < y->size; ++i) {
         tensor_unindex(y->shape, i, indicies);
-        indicies[s.rank] = 0;
+        indicies[last] = 0;
         size_t new_i = tensor_index_array(y_->shape, indicies);
         float denom = 0.0;
-        for (size_t j = 0; j < y_->shape.dims[s.rank]; ++j) {
+        for (size_t j = 0; j < y_->shape.dims[last]; ++j) {
             size_t y_i_ = new_i + j;
             denom += exp(y_data_[y_i_]);
         }
-        for (size_t j = 0; j < y_grad_->shape.dims[s.rank]; ++j) {
+        for (size_t j = 0; j < y_grad_->shape.dims[last]; ++j) {
             size_t y_i_ = new_i + j;
             if (j == y_data[i]) {
                 y_grad_data_[y_i_] *= (-denom + exp(y_data_[y_i_])) / denom;
@@ -300,11 +376,17 @@ int cross_entropy_backward(const Tensor* y_, const Tensor* y, Tensor* y_grad_) {
             }
         }
     }
+    PERF_END(&perf, "cross_entropy_backward", y_->shape,
+             4.0 * (double)y_->size);
+}
 
+int cross_entropy_backward(const Tensor* y_, const Tensor* y, Tensor* y_grad_) {
+    RETURN_IF_ERROR(cross_entropy_backward_check(y_, y, y_grad_));
+    cross_entropy_backward_unchecked(y_, y, y_grad_);
     return 0;
 }
 
-int tensor_tanh_backward(const Tensor* a, Tensor* a_grad) {
+int tensor_tanh_backward_check(const Tensor* a, const Tensor* a_grad) {
     if (a == NULL || a_grad == NULL) {
         return 1;
     }
@@ -315,23 +397,41 @@ int tensor_tanh_backward(const Tensor* a, Tensor* a_grad) {
     if (!shape_is_equal(a->shape, a_grad->shape)) {
         return 3;
     }
+    return 0;
+}
 
+void tensor_tanh_backward_unchecked(const Tensor* a, Tensor* a_grad) {
     float* a_data = (float*)a->data;
     float* a_grad_data = (float*)a_grad->data;
+    PerfSample perf;
+    PERF_BEGIN(&perf);
     for (size_t i = 0; i < a->size; ++i) {
         float a_data_y = tanh(a_data[i]);
         a_grad_data[i] = (1 - a_data_y * a_data_y) * a_grad_data[i];
     }
+    PERF_END(&perf, "tensor_tanh_backward", a->shape, 4.0 * (double)a->size);
+}
 
+int tensor_tanh_backward(const Tensor* a, Tensor* a_grad) {
+    RETURN_IF_ERROR(tensor_tanh_backward_check(a, a_grad));
+    tensor_tanh_backward_unchecked(a, a_grad);
     return 0;
 }
 
-int tensor_bcast_grad(const Tensor* y_grad, Tensor* x_grad) {
+int tensor_bcast_grad_check(const Tensor* y_grad, const Tensor* x_grad) {
+    if (y_grad == NULL || x_grad == NULL || x_grad->data == NULL) {
+        return 1;
+    }
     RETURN_IF_ERROR(shape_is_compatible(x_grad->shape, y_grad->shape));
+    return 0;
+}
 
+void tensor_bcast_grad_unchecked(const Tensor* y_grad, Tensor* x_grad) {
     size_t indicies[MAX_RANK];
     size_t new_dims = y_grad->shape.rank - x_grad->shape.rank;
-    RETURN_IF_ERROR(tensor_fill_float(x_grad, 0.0f));
+    PerfSample perf;
+    PERF_BEGIN(&perf);
+    tensor_fill_float(x_grad, 0.0f);
     float* y_grad_data = (float*)y_grad->data;
     float* x_grad_data = (float*)x_grad->data;
 
@@ -348,6 +448,13 @@ int tensor_bcast_grad(const Tensor* y_grad, Tensor* x_grad) {
         size_t x_i = tensor_index_array(x_grad->shape, indicies);
         x_grad_data[x_i] += y_grad_data[i];
     }
+    PERF_END(&perf, "tensor_bcast_grad", y_grad->shape,
+             (double)y_grad->size);
+}
+
+int tensor_bcast_grad(const Tensor* y_grad, Tensor* x_grad) {
+    RETURN_IF_ERROR(tensor_bcast_grad_check(y_grad, x_grad));
+    tensor_bcast_grad_unchecked(y_grad, x_grad);
     return 0;
 }
 
@@ -6,22 +6,56 @@
 
 int bmm(Tensor *C, const Tensor *A, const Tensor *B, bool transpose_A, bool transpose_B);
 
+// Each op below is split into a shape/dtype check and an unchecked kernel so
+// that callers with static shapes (see plan.h) can validate once up front.
+int bmm_check(const Tensor *C, const Tensor *A, const Tensor *B, bool transpose_A, bool transpose_B);
+
+void bmm_unchecked(Tensor *C, const Tensor *A, const Tensor *B, bool transpose_A, bool transpose_B);
+
 int tensor_add(Tensor *a, const Tensor *b);
 
+int tensor_add_check(const Tensor *a, const Tensor *b);
+
+void tensor_add_unchecked(Tensor *a, const Tensor *b);
+
 int tensor_tanh(Tensor *a);
 
 int tensor_argmax(const Tensor *a, Tensor *out);
 
+int tensor_argmax_check(const Tensor *a, const Tensor *out);
+
+void tensor_argmax_unchecked(const Tensor *a, Tensor *out);
+
 int accuracy(const Tensor *a, const Tensor *b, float *acc);
 
+int accuracy_check(const Tensor *a, const Tensor *b);
+
+void accuracy_unchecked(const Tensor *a, const Tensor *b, float *acc);
+
 int cross_entropy(const Tensor *y_, const Tensor *y, float *loss);
 
+int cross_entropy_check(const Tensor *y_, const Tensor *y);
+
+void cross_entropy_unchecked(const Tensor *y_, const Tensor *y, float *loss);
+
 int cross_entropy_backward(const Tensor *y_, const Tensor *y, Tensor *y_grad_);
 
+int cross_entropy_backward_check(const Tensor *y_, const Tensor *y, const Tensor *y_grad_);
+
+void cross_entropy_backward_unchecked(const Tensor *y_, const Tensor *y, Tensor *y_grad_);
+
 int tensor_tanh_backward(const Tensor *a, Tensor *a_grad);
 
+int tensor_tanh_backward_check(const Tensor *a, const Tensor *a_grad);
+
+void tensor_tanh_backward_unchecked(const Tensor *a, Tensor *a_grad);
+
 int tensor_bcast_grad(const Tensor *y_grad, Tensor *x_grad);
 
+int tensor_bcast_grad_check(const Tensor *y_grad, const Tensor *x_grad);
+
+void tensor_bcast_grad_unchecked(const Tensor *y_grad, Tensor *x_grad);
+
 int tensor_add_backward(const Tensor *ab_grad, Tensor *a_grad, Tensor *b_grad);
 
 int bmm_backward(const Tensor *A, const Tensor *B, const Tensor *C_grad, Tensor* A_grad, Tensor* B_grad);
@@ -0,0 +1,104 @@
+#include "metrics.h"
+
+#include <string.h>
+
+void metrics_write_csv(FILE* f, const MetricsRecord* r) {
+    double n = r->sums.samples;
+    double loss = n > 0.0 ? r->sums.loss / n : 0.0;
+    double acc = n > 0.0 ? r->sums.correct / n : 0.0;
+    fprintf(f, "%zu,%zu,%s,%.0f,%.6f,%.6f,%.6f,", r->epoch, r->step,
+            r->epoch_end ? "epoch" : "interval", n, r->seconds, loss, acc);
+    if (r->model >= 0) fprintf(f, "%d", r->model);
+    fprintf(f, "\n");
+}
+
+static void write_record(MetricsWriter* w, const MetricsRecord* r) {
+    double n = r->sums.samples;
+    double loss = n > 0.0 ? r->sums.loss / n : 0.0;
+    double acc = n > 0.0 ? r->sums.correct / n : 0.0;
+    double rate = r->seconds > 0.0 ? n / r->seconds : 0.0;
+    if (r->model >= 0) printf("model %d ", r->model);
+    printf("epoch %zu %s %zu loss = %.5f acc = %.5f %.0f samples/s\n",
+           r->epoch, r->epoch_end ? "done at step" : "step", r->step, loss,
+           acc, rate);
+    fflush(stdout);
+    if (w->file != NULL) {
+        metrics_write_csv(w->file, r);
+        fflush(w->file);
+    }
+}
+
+bool metrics_queue_put(MetricsQueue* q, const MetricsRecord* r) {
+    if (q->tail - q->head == METRICS_QUEUE) {
+        q->dropped++;
+        return false;
+    }
+    q->items[q->tail++ % METRICS_QUEUE] = *r;
+    return true;
+}
+
+bool metrics_queue_take(MetricsQueue* q, MetricsRecord* r) {
+    if (q->head == q->tail) return false;
+    *r = q->items[q->head++ % METRICS_QUEUE];
+    return true;
+}
+
+static void* writer_main(void* arg) {
+    MetricsWriter* w = (MetricsWriter*)arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->queue.head == w->queue.tail && !w->stop) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        MetricsRecord r;
+        if (!metrics_queue_take(&w->queue, &r)) break;
+        pthread_mutex_unlock(&w->lock);
+        write_record(w, &r);
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+int metrics_writer_init(MetricsWriter* w, const char* path) {
+    if (w == NULL) return 1;
+    memset(w, 0, sizeof(*w));
+    if (path != NULL) {
+        w->file = fopen(path, "w");
+        if (w->file == NULL) return 2;
+        fprintf(w->file, "epoch,step,kind,samples,seconds,loss,acc,model\n");
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    if (pthread_create(&w->thread, NULL, writer_main, w)) return 3;
+    return 0;
+}
+
+void metrics_writer_push(MetricsWriter* w, const MetricsRecord* r) {
+    pthread_mutex_lock(&w->lock);
+    if (metrics_queue_put(&w->queue, r)) pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void metrics_writer_free(MetricsWriter* w) {
+    if (w == NULL) return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    if (w->queue.dropped > 0) {
+        printf("metrics: %zu records dropped\n", w->queue.dropped);
+    }
+    if (w->file != NULL) fclose(w->file);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+    memset(w, 0, sizeof(*w));
+}
+
+void metrics_report(MetricsWriter* w, MetricsSums* s, size_t epoch,
+                    size_t step, bool epoch_end, double seconds) {
+    MetricsRecord r = {epoch, step, epoch_end, seconds, *s, -1};
+    metrics_writer_push(w, &r);
+    memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define METRICS_QUEUE 64
+
+// Loss and correct predictions summed over some samples.
+typedef struct {
+    double loss;
+    double correct;
+    double samples;
+} MetricsSums;
+
+// What one training step adds: its mean loss and accuracy over n samples.
+static inline void metrics_add(MetricsSums* s, float loss, float acc,
+                               size_t n) {
+    s->loss += (double)loss * (double)n;
+    s->correct += (double)acc * (double)n;
+    s->samples += (double)n;
+}
+
+// Sums over the `seconds` up to global step `step`: since the previous
+// report, or over the whole epoch when epoch_end is set. model is the index
+// of a sweep's model the sums are for, -1 outside a sweep.
+typedef struct {
+    size_t epoch;
+    size_t step;
+    bool epoch_end;
+    double seconds;
+    MetricsSums sums;
+    int model;
+} MetricsRecord;
+
+// Bounded FIFO of records that drops new ones once full; not locked.
+typedef struct {
+    MetricsRecord items[METRICS_QUEUE];
+    size_t head;
+    size_t tail;
+    size_t dropped;
+} MetricsQueue;
+
+// False, counting a drop, when q already holds METRICS_QUEUE records.
+bool metrics_queue_put(MetricsQueue* q, const MetricsRecord* r);
+
+bool metrics_queue_take(MetricsQueue* q, MetricsRecord* r);
+
+// One line of the CSV file: epoch,step,kind,samples,seconds,loss,acc,model
+// with loss and acc as means over the samples and model empty outside a
+// sweep.
+void metrics_write_csv(FILE* f, const MetricsRecord* r);
+
+// Formats records on a thread of its own, to stdout and, given a path, as
+// CSV lines to that file, so the training loop never waits on stdio.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    MetricsQueue queue;
+    bool stop;
+    FILE* file;
+} MetricsWriter;
+
+// path may be NULL.
+int metrics_writer_init(MetricsWriter* w, const char* path);
+
+// Returns at once; the record is dropped if the writer is METRICS_QUEUE
+// records behind.
+void metrics_writer_push(MetricsWriter* w, const MetricsRecord* r);
+
+// Writes whatever is still queued and stops the thread.
+void metrics_writer_free(MetricsWriter* w);
+
+// Single process reporting: queues s as a record and clears it.
+void metrics_report(MetricsWriter* w, MetricsSums* s, size_t epoch,
+                    size_t step, bool epoch_end, double seconds);
+
+#endif
@@ -0,0 +1,364 @@
+#include "model.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linalg.h"
+#include "optim.h"
+#include "trace.h"
+#include "utils.h"
+
+int mlp_alloc(Mlp* m, const size_t* sizes, size_t n_sizes) {
+    if (m == NULL || sizes == NULL) return 1;
+    if (n_sizes < 2 || n_sizes > MLP_MAX_LAYERS + 1) return 2;
+    memset(m, 0, sizeof(*m));
+    m->n_layers = n_sizes - 1;
+    m->n_params = 2 * m->n_layers;
+    memcpy(m->sizes, sizes, n_sizes * sizeof(size_t));
+
+    for (size_t l = 0; l < m->n_layers; ++l) {
+        size_t in = sizes[l];
+        size_t out = sizes[l + 1];
+        m->params[2 * l] = tensor_alloc(shapeN(3, 1, in, out), DTYPE_FLOAT32);
+        m->params[2 * l + 1] = tensor_alloc(shapeN(1, out), DTYPE_FLOAT32);
+        if (!m->params[2 * l] || !m->params[2 * l + 1]) return 3;
+        tensor_fill_float(m->params[2 * l], 0.0f);
+        tensor_fill_float(m->params[2 * l + 1], 0.0f);
+    }
+
+    RETURN_IF_ERROR(mlp_grads_alloc(m, m->grads));
+    for (size_t i = 0; i < m->n_params; ++i) {
+        Shape s = m->params[i]->shape;
+        m->m[i] = tensor_alloc(s, DTYPE_FLOAT32);
+        m->v[i] = tensor_alloc(s, DTYPE_FLOAT32);
+        if (!m->m[i] || !m->v[i]) return 4;
+        tensor_fill_float(m->m[i], 0.0f);
+        tensor_fill_float(m->v[i], 0.0f);
+    }
+    return 0;
+}
+
+int mlp_init(Mlp* m, const size_t* sizes, size_t n_sizes, RNG* r) {
+    if (r == NULL) return 1;
+    RETURN_IF_ERROR(mlp_alloc(m, sizes, n_sizes));
+    for (size_t l = 0; l < m->n_layers; ++l) {
+        RETURN_IF_ERROR(tensor_fill_uniform(m->params[2 * l], r));
+        RETURN_IF_ERROR(tensor_fill_uniform(m->params[2 * l + 1], r));
+    }
+
+    for (size_t l = 0; l < m->n_layers; ++l) {
+        float k = sqrtf(1.0 / (double)sizes[l]);
+        tensor_scale_and_add_const(m->params[2 * l], 2 * k, -k);
+        tensor_scale_and_add_const(m->params[2 * l + 1], 2 * k, -k);
+    }
+    return 0;
+}
+
+static void free_tensor(Tensor* t) {
+    tensor_free(t);
+    free(t);
+}
+
+void mlp_free(Mlp* m) {
+    if (m == NULL) return;
+    for (size_t i = 0; i < m->n_params; ++i) {
+        free_tensor(m->params[i]);
+        free_tensor(m->grads[i]);
+        free_tensor(m->m[i]);
+        free_tensor(m->v[i]);
+    }
+    memset(m, 0, sizeof(*m));
+}
+
+static void* work_buffer(MlpWork* w, size_t bytes) {
+    void* p = malloc(bytes);
+    if (p != NULL) w->owned[w->n_owned++] = p;
+    return p;
+}
+
+int mlp_work_init(MlpWork* w, const Mlp* m, size_t capacity,
+                  size_t checkpoint_every) {
+    if (w == NULL || m == NULL) return 1;
+    if (capacity == 0) return 2;
+    memset(w, 0, sizeof(*w));
+    size_t L = m->n_layers;
+    size_t k = checkpoint_every > L ? L : checkpoint_every;
+    w->n_layers = L;
+    w->capacity = capacity;
+    w->batch = capacity;
+    w->checkpoint_every = k;
+
+    size_t max_width = 0;
+    for (size_t l = 1; l <= L; ++l) {
+        if (m->sizes[l] > max_width) max_width = m->sizes[l];
+    }
+    size_t slot_bytes = capacity * max_width * sizeof(float);
+
+    void* scratch_pre[MLP_MAX_LAYERS];
+    void* scratch_act[MLP_MAX_LAYERS];
+    for (size_t j = 0; j < k; ++j) {
+        scratch_pre[j] = work_buffer(w, slot_bytes);
+        scratch_act[j] = work_buffer(w, slot_bytes);
+        if (!scratch_pre[j] || !scratch_act[j]) return 3;
+    }
+
+    for (size_t l = 0; l < L; ++l) {
+        Shape s = shapeN(3, capacity, 1, m->sizes[l + 1]);
+        size_t bytes = shape_numel(s) * sizeof(float);
+        bool is_logits = l + 1 == L;
+        bool is_kept = k == 0 || (l + 1) % k == 0 || is_logits;
+        void* pre = k == 0 || is_logits ? work_buffer(w, bytes)
+                                        : scratch_pre[l % k];
+        if (pre == NULL) return 3;
+        RETURN_IF_ERROR(tensor_view(&w->pre[l], pre, s, DTYPE_FLOAT32));
+        if (is_logits && !m->activate_last) continue;
+        void* act = is_kept ? work_buffer(w, bytes) : scratch_act[l % k];
+        if (act == NULL) return 3;
+        RETURN_IF_ERROR(tensor_view(&w->act[l], act, s, DTYPE_FLOAT32));
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        void* g = work_buffer(w, slot_bytes);
+        if (g == NULL) return 3;
+        RETURN_IF_ERROR(tensor_view(&w->grad[i], g,
+                                    shapeN(3, capacity, 1, max_width),
+                                    DTYPE_FLOAT32));
+    }
+    void* argmax = work_buffer(w, capacity);
+    if (argmax == NULL) return 3;
+    RETURN_IF_ERROR(
+        tensor_view(&w->argmax, argmax, shapeN(2, capacity, 1), DTYPE_UINT8));
+    return 0;
+}
+
+int mlp_eval_work_init(MlpWork* w, const Mlp* m, size_t capacity) {
+    if (w == NULL || m == NULL) return 1;
+    if (capacity == 0) return 2;
+    memset(w, 0, sizeof(*w));
+    size_t L = m->n_layers;
+    w->n_layers = L;
+    w->capacity = capacity;
+    w->batch = capacity;
+
+    size_t max_width = 0;
+    for (size_t l = 1; l <= L; ++l) {
+        if (m->sizes[l] > max_width) max_width = m->sizes[l];
+    }
+    size_t slot_bytes = capacity * max_width * sizeof(float);
+    void* pre = work_buffer(w, slot_bytes);
+    void* act = work_buffer(w, slot_bytes);
+    void* argmax = work_buffer(w, capacity);
+    if (!pre || !act || !argmax) return 3;
+    for (size_t l = 0; l < L; ++l) {
+        Shape s = shapeN(3, capacity, 1, m->sizes[l + 1]);
+        RETURN_IF_ERROR(tensor_view(&w->pre[l], pre, s, DTYPE_FLOAT32));
+        if (l + 1 == L && !m->activate_last) continue;
+        RETURN_IF_ERROR(tensor_view(&w->act[l], act, s, DTYPE_FLOAT32));
+    }
+    return tensor_view(&w->argmax, argmax, shapeN(2, capacity, 1),
+                       DTYPE_UINT8);
+}
+
+void mlp_work_free(MlpWork* w) {
+    if (w == NULL) return;
+    for (size_t i = 0; i < w->n_owned; ++i) free(w->owned[i]);
+    memset(w, 0, sizeof(*w));
+}
+
+Tensor* mlp_logits(MlpWork* w) { return &w->pre[w->n_layers - 1]; }
+
+static void set_batch(Tensor* t, size_t batch) {
+    t->shape.dims[0] = batch;
+    t->size = shape_numel(t->shape);
+}
+
+static const Tensor* layer_input(MlpWork* w, const Tensor* x, size_t l) {
+    return l == 0 ? x : &w->act[l - 1];
+}
+
+static int forward_layer(const Mlp* m, MlpWork* w, const Tensor* x,
+                         size_t l) {
+    Tensor* pre = &w->pre[l];
+    RETURN_IF_ERROR(tensor_fill_float(pre, 0.0f));
+    double t0 = trace_now();
+    RETURN_IF_ERROR(
+        bmm(pre, layer_input(w, x, l), m->params[2 * l], false, false));
+    trace_span("forward gemm", t0);
+    if (l + 1 == m->n_layers && w->partial_logits) {
+        w->partial_logits(w->partial_logits_ctx, pre);
+    }
+    RETURN_IF_ERROR(tensor_add(pre, m->params[2 * l + 1]));
+    if (l + 1 < m->n_layers || m->activate_last) {
+        t0 = trace_now();
+        RETURN_IF_ERROR(tensor_copy(&w->act[l], pre));
+        RETURN_IF_ERROR(tensor_tanh(&w->act[l]));
+        trace_span("activation", t0);
+    }
+    return 0;
+}
+
+int mlp_forward(const Mlp* m, MlpWork* w, const Tensor* x) {
+    if (m == NULL || w == NULL || x == NULL) return 1;
+    if (x->shape.rank != 3 || x->shape.dims[2] != m->sizes[0]) return 2;
+    if (x->shape.dims[0] > w->capacity) return 3;
+
+    w->batch = x->shape.dims[0];
+    for (size_t l = 0; l < m->n_layers; ++l) {
+        set_batch(&w->pre[l], w->batch);
+        if (l + 1 < m->n_layers || m->activate_last) {
+            set_batch(&w->act[l], w->batch);
+        }
+    }
+    for (size_t l = 0; l < m->n_layers; ++l) {
+        RETURN_IF_ERROR(forward_layer(m, w, x, l));
+    }
+    return 0;
+}
+
+int mlp_metrics(MlpWork* w, const Tensor* y, float* loss, float* acc) {
+    if (w == NULL || y == NULL) return 1;
+    double t0 = trace_now();
+    Tensor* logits = mlp_logits(w);
+    size_t classes = logits->shape.dims[2];
+    Tensor logits_2d;
+    Tensor argmax;
+    RETURN_IF_ERROR(tensor_view(&logits_2d, logits->data,
+                                shapeN(2, w->batch, classes), DTYPE_FLOAT32));
+    RETURN_IF_ERROR(tensor_view(&argmax, w->argmax.data,
+                                shapeN(2, w->batch, 1), DTYPE_UINT8));
+
+    if (acc != NULL) {
+        RETURN_IF_ERROR(tensor_argmax(logits, &argmax));
+        RETURN_IF_ERROR(reshape(&argmax, shapeN(1, w->batch)));
+        RETURN_IF_ERROR(accuracy(&argmax, y, acc));
+    }
+    if (loss != NULL) {
+        RETURN_IF_ERROR(cross_entropy(&logits_2d, y, loss));
+    }
+    trace_span("loss", t0);
+    return 0;
+}
+
+// Expects w->grad[*cur] to hold dL/d(output of layer l) and leaves
+// dL/d(output of layer l - 1) in the other gradient buffer, or dL/dx in
+// x_grad for layer 0.
+static int backward_layer(const Mlp* m, MlpWork* w, const Tensor* x, size_t l,
+                          size_t* cur, Tensor* x_grad, Tensor** grads) {
+    Tensor* g = &w->grad[*cur];
+    RETURN_IF_ERROR(tensor_view(g, g->data,
+                                shapeN(3, w->batch, 1, m->sizes[l + 1]),
+                                DTYPE_FLOAT32));
+    if (l + 1 < m->n_layers || m->activate_last) {
+        RETURN_IF_ERROR(tensor_tanh_backward(&w->pre[l], g));
+    }
+    RETURN_IF_ERROR(tensor_add_backward(g, NULL, grads[2 * l + 1]));
+    if (w->grad_ready) w->grad_ready(w->grad_ready_ctx, 2 * l + 1);
+    RETURN_IF_ERROR(tensor_fill_float(grads[2 * l], 0.0f));
+
+    Tensor* g_in = l == 0 ? x_grad : NULL;
+    if (l > 0) {
+        g_in = &w->grad[1 - *cur];
+        RETURN_IF_ERROR(tensor_view(g_in, g_in->data,
+                                    shapeN(3, w->batch, 1, m->sizes[l]),
+                                    DTYPE_FLOAT32));
+    }
+    if (g_in != NULL) RETURN_IF_ERROR(tensor_fill_float(g_in, 0.0f));
+    double t0 = trace_now();
+    RETURN_IF_ERROR(bmm_backward(layer_input(w, x, l), m->params[2 * l], g,
+                                 g_in, grads[2 * l]));
+    trace_span("backward gemm", t0);
+    if (w->grad_ready) w->grad_ready(w->grad_ready_ctx, 2 * l);
+    *cur = 1 - *cur;
+    return 0;
+}
+
+// Expects w->grad[0] to hold dL/d(output of the last layer).
+static int backward_layers(const Mlp* m, MlpWork* w, const Tensor* x,
+                           Tensor* x_grad, Tensor** grads) {
+    size_t L = m->n_layers;
+    size_t cur = 0;
+    // Segments are walked last to first. The scratch slots still hold the
+    // last segment from forward, every earlier one is recomputed from the
+    // activation kept at its start.
+    size_t k = w->checkpoint_every ? w->checkpoint_every : L;
+    for (size_t end = L; end > 0;) {
+        size_t start = ((end - 1) / k) * k;
+        if (w->checkpoint_every && end != L) {
+            for (size_t l = start; l < end; ++l) {
+                RETURN_IF_ERROR(forward_layer(m, w, x, l));
+            }
+        }
+        for (size_t l = end; l-- > start;) {
+            RETURN_IF_ERROR(backward_layer(m, w, x, l, &cur, x_grad, grads));
+        }
+        end = start;
+    }
+    return 0;
+}
+
+int mlp_backward(const Mlp* m, MlpWork* w, const Tensor* x, const Tensor* y,
+                 Tensor** grads) {
+    if (m == NULL || w == NULL || x == NULL || y == NULL || grads == NULL)
+        return 1;
+    if (w->grad[0].data == NULL) return 2;
+    Tensor* logits = mlp_logits(w);
+    size_t classes = logits->shape.dims[2];
+    Tensor logits_2d;
+    RETURN_IF_ERROR(tensor_view(&logits_2d, logits->data,
+                                shapeN(2, w->batch, classes), DTYPE_FLOAT32));
+    RETURN_IF_ERROR(tensor_view(&w->grad[0], w->grad[0].data,
+                                shapeN(2, w->batch, classes), DTYPE_FLOAT32));
+    double t0 = trace_now();
+    RETURN_IF_ERROR(cross_entropy_backward(&logits_2d, y, &w->grad[0]));
+    RETURN_IF_ERROR(backward_layers(m, w, x, NULL, grads));
+    trace_span("backward", t0);
+    return 0;
+}
+
+int mlp_backward_from(const Mlp* m, MlpWork* w, const Tensor* x,
+                      const Tensor* out_grad, Tensor* x_grad, Tensor** grads) {
+    if (m == NULL || w == NULL || x == NULL || out_grad == NULL ||
+        grads == NULL)
+        return 1;
+    if (w->grad[0].data == NULL) return 2;
+    Tensor* g = &w->grad[0];
+    RETURN_IF_ERROR(tensor_view(g, g->data,
+                                shapeN(3, w->batch, 1, m->sizes[m->n_layers]),
+                                DTYPE_FLOAT32));
+    double t0 = trace_now();
+    RETURN_IF_ERROR(tensor_copy(g, out_grad));
+    RETURN_IF_ERROR(backward_layers(m, w, x, x_grad, grads));
+    trace_span("backward", t0);
+    return 0;
+}
+
+int mlp_grads_alloc(const Mlp* m, Tensor** grads) {
+    if (m == NULL || grads == NULL) return 1;
+    for (size_t i = 0; i < m->n_params; ++i) {
+        grads[i] = tensor_alloc(m->params[i]->shape, DTYPE_FLOAT32);
+        if (grads[i] == NULL) return 2;
+        tensor_fill_float(grads[i], 0.0f);
+    }
+    return 0;
+}
+
+void mlp_grads_free(const Mlp* m, Tensor** grads) {
+    if (m == NULL || grads == NULL) return;
+    for (size_t i = 0; i < m->n_params; ++i) {
+        free_tensor(grads[i]);
+        grads[i] = NULL;
+    }
+}
+
+int mlp_adam_step(Mlp* m, Tensor** grads, float lr, float beta1, float beta2,
+                  float eps, size_t t) {
+    if (m == NULL || grads == NULL) return 1;
+    double t0 = trace_now();
+    for (size_t i = 0; i < m->n_params; ++i) {
+        RETURN_IF_ERROR(adam_step(lr, beta1, beta2, eps, t, grads[i],
+                                  m->params[i], m->m[i], m->v[i]));
+    }
+    trace_span("optimizer", t0);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stddef.h>
+
+#include "rng.h"
+#include "tensor.h"
+
+#define MLP_MAX_LAYERS 16
+#define MLP_MAX_PARAMS (2 * MLP_MAX_LAYERS)
+
+// Stack of dense layers with tanh between them. Layer l has weight
+// params[2 * l] of shape [1, in, out] and bias params[2 * l + 1] of shape
+// [out]; the last layer has no activation and produces the logits.
+typedef struct {
+    size_t n_layers;
+    size_t sizes[MLP_MAX_LAYERS + 1];
+    size_t n_params;
+    Tensor* params[MLP_MAX_PARAMS];
+    Tensor* grads[MLP_MAX_PARAMS];
+    Tensor* m[MLP_MAX_PARAMS];
+    Tensor* v[MLP_MAX_PARAMS];
+    // Set on a pipeline stage feeding another: the last layer gets tanh as
+    // well and its output is act[n_layers - 1] instead of logits.
+    bool activate_last;
+} Mlp;
+
+// Called from mlp_backward as soon as grads[param] is final.
+typedef void (*MlpGradHook)(void* ctx, size_t param);
+
+// Called from mlp_forward with the last layer's product before its bias is
+// added, e.g. to sum the partial products of a layer split across ranks.
+typedef void (*MlpLogitsHook)(void* ctx, Tensor* logits);
+
+// Activation buffers for one forward/backward pass over at most `capacity`
+// samples. With checkpoint_every = k > 0 only the output of every k-th layer
+// is kept after forward, the others share k scratch slots and are recomputed
+// segment by segment in backward.
+typedef struct {
+    size_t n_layers;
+    size_t capacity;
+    size_t batch;
+    size_t checkpoint_every;
+    Tensor pre[MLP_MAX_LAYERS];
+    Tensor act[MLP_MAX_LAYERS];
+    Tensor grad[2];
+    Tensor argmax;
+    void* owned[2 * MLP_MAX_LAYERS + 4];
+    size_t n_owned;
+    MlpGradHook grad_ready;
+    void* grad_ready_ctx;
+    MlpLogitsHook partial_logits;
+    void* partial_logits_ctx;
+} MlpWork;
+
+// Allocates parameters, gradients and moments for the given widths, all
+// zero.
+int mlp_alloc(Mlp* m, const size_t* sizes, size_t n_sizes);
+
+int mlp_init(Mlp* m, const size_t* sizes, size_t n_sizes, RNG* r);
+
+void mlp_free(Mlp* m);
+
+int mlp_work_init(MlpWork* w, const Mlp* m, size_t capacity,
+                  size_t checkpoint_every);
+
+// Buffers for mlp_forward and mlp_metrics only: all layers share one
+// product and one activation slot, as each layer's input is dead once its
+// product is taken. mlp_backward refuses them.
+int mlp_eval_work_init(MlpWork* w, const Mlp* m, size_t capacity);
+
+void mlp_work_free(MlpWork* w);
+
+Tensor* mlp_logits(MlpWork* w);
+
+int mlp_forward(const Mlp* m, MlpWork* w, const Tensor* x);
+
+int mlp_metrics(MlpWork* w, const Tensor* y, float* loss, float* acc);
+
+// Writes the gradients of the mean cross entropy of the last forward into
+// grads, which is laid out like m->params.
+int mlp_backward(const Mlp* m, MlpWork* w, const Tensor* x, const Tensor* y,
+                 Tensor** grads);
+
+// Like mlp_backward, starting from out_grad = dL/d(output of the last
+// layer) instead of the cross entropy. If x_grad is not NULL it receives
+// dL/dx.
+int mlp_backward_from(const Mlp* m, MlpWork* w, const Tensor* x,
+                      const Tensor* out_grad, Tensor* x_grad, Tensor** grads);
+
+// Allocates a zeroed gradient set laid out like m->params.
+int mlp_grads_alloc(const Mlp* m, Tensor** grads);
+
+void mlp_grads_free(const Mlp* m, Tensor** grads);
+
+int mlp_adam_step(Mlp* m, Tensor** grads, float lr, float beta1, float beta2,
+                  float eps, size_t t);
+
+#endif
@@ -0,0 +1,123 @@
+#include "async_eval.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+static void copy_params(float* flat, const Mlp* m, bool out) {
+    size_t off = 0;
+    for (size_t p = 0; p < m->n_params; ++p) {
+        float* data = (float*)m->params[p]->data;
+        size_t bytes = m->params[p]->size * sizeof(float);
+        if (out) {
+            memcpy(flat + off, data, bytes);
+        } else {
+            memcpy(data, flat + off, bytes);
+        }
+        off += m->params[p]->size;
+    }
+}
+
+int async_eval_init(AsyncEval* ae, const Mlp* m, MPI_Comm comm) {
+    if (ae == NULL || m == NULL) return 1;
+    memset(ae, 0, sizeof(*ae));
+    ae->comm = comm;
+    MPI_Comm_rank(comm, &ae->rank);
+    for (size_t p = 0; p < m->n_params; ++p) ae->count += m->params[p]->size;
+    size_t n_buffers = ae->rank == 0 ? 1 : 2;
+    for (size_t b = 0; b < 2; ++b) {
+        for (size_t i = 0; i < 2; ++i) ae->requests[b][i] = MPI_REQUEST_NULL;
+        if (b >= n_buffers) continue;
+        ae->buffers[b] = (float*)malloc(ae->count * sizeof(float));
+        if (ae->buffers[b] == NULL) return 2;
+    }
+    return 0;
+}
+
+static void post(AsyncEval* ae, size_t b) {
+    MPI_Ibcast(ae->header[b], 2, MPI_INT64_T, 0, ae->comm,
+               &ae->requests[b][0]);
+    MPI_Ibcast(ae->buffers[b], (int)ae->count, MPI_FLOAT, 0, ae->comm,
+               &ae->requests[b][1]);
+}
+
+int async_eval_send(AsyncEval* ae, const Mlp* m, int64_t step, bool last) {
+    if (ae == NULL || m == NULL || ae->rank != 0) return 1;
+    int done = 0;
+    MPI_Testall(2, ae->requests[0], &done, MPI_STATUSES_IGNORE);
+    if (!done) {
+        double start = wall_time();
+        MPI_Waitall(2, ae->requests[0], MPI_STATUSES_IGNORE);
+        ae->wait_seconds += wall_time() - start;
+    }
+    copy_params(ae->buffers[0], m, true);
+    ae->header[0][0] = step;
+    ae->header[0][1] = last;
+    post(ae, 0);
+    ae->n_snapshots++;
+    return 0;
+}
+
+int async_eval_run(AsyncEval* ae, Mlp* m, const Dataset* test,
+                   size_t batch) {
+    if (ae == NULL || m == NULL || test == NULL || ae->rank != 1) return 1;
+    MlpWork w;
+    RETURN_IF_ERROR(mlp_eval_work_init(&w, m, batch));
+    size_t b = 0;
+    post(ae, b);
+    bool last = false;
+    int64_t done_step = -1;
+    for (; !last; b = 1 - b) {
+        MPI_Waitall(2, ae->requests[b], MPI_STATUSES_IGNORE);
+        int64_t step = ae->header[b][0];
+        last = ae->header[b][1] != 0;
+        if (!last) post(ae, 1 - b);
+        // The closing snapshot repeats the last one if it fell on a step
+        // already sent.
+        if (step == done_step) continue;
+        done_step = step;
+        copy_params(ae->buffers[b], m, false);
+
+        double loss_sum = 0.0;
+        double correct = 0.0;
+        for (size_t lo = 0; lo < test->n; lo += batch) {
+            size_t n = test->n - lo < batch ? test->n - lo : batch;
+            Tensor x;
+            Tensor y;
+            RETURN_IF_ERROR(tensor_view(&x,
+                                        (float*)test->x->data + lo * IMG_SIZE,
+                                        shapeN(3, n, 1, IMG_SIZE),
+                                        DTYPE_FLOAT32));
+            RETURN_IF_ERROR(tensor_view(&y, (uint8_t*)test->y->data + lo,
+                                        shapeN(1, n), DTYPE_UINT8));
+            float loss;
+            float acc;
+            RETURN_IF_ERROR(mlp_forward(m, &w, &x));
+            RETURN_IF_ERROR(mlp_metrics(&w, &y, &loss, &acc));
+            loss_sum += (double)loss * (double)n;
+            correct += round((double)acc * (double)n);
+            // Lets the next snapshot arrive while this one is evaluated.
+            int done;
+            MPI_Testall(2, ae->requests[1 - b], &done, MPI_STATUSES_IGNORE);
+        }
+        printf("eval step %lld: test loss = %.5f acc = %.5f %.0f/%zu "
+               "correct\n",
+               (long long)step, loss_sum / (double)test->n,
+               correct / (double)test->n, correct, test->n);
+        ae->n_snapshots++;
+    }
+    mlp_work_free(&w);
+    return 0;
+}
+
+void async_eval_free(AsyncEval* ae) {
+    if (ae == NULL || ae->buffers[0] == NULL) return;
+    for (size_t b = 0; b < 2; ++b) {
+        MPI_Waitall(2, ae->requests[b], MPI_STATUSES_IGNORE);
+        free(ae->buffers[b]);
+    }
+    memset(ae, 0, sizeof(*ae));
+}
@@ -0,0 +1,47 @@
+#ifndef ASYNC_EVAL_H
+#define ASYNC_EVAL_H
+
+#include <mpi.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dataset.h"
+#include "model.h"
+
+// Test metrics computed on a rank of their own while training goes on.
+// comm holds two ranks: the trainer sending snapshots of its weights as
+// rank 0 and the evaluator as rank 1. Each snapshot is a nonblocking
+// broadcast; the evaluator already has the next one posted while it works
+// on the current, so the trainer only waits when it is about to send a
+// snapshot the evaluator has not started receiving, i.e. when the
+// evaluator is more than one snapshot behind.
+typedef struct {
+    MPI_Comm comm;
+    int rank;
+    size_t count;
+    // The trainer sends from buffers[0]; the evaluator receives into both
+    // in turn.
+    float* buffers[2];
+    // Step of each snapshot and whether it is the last.
+    int64_t header[2][2];
+    MPI_Request requests[2][2];
+    size_t n_snapshots;
+    double wait_seconds;
+} AsyncEval;
+
+int async_eval_init(AsyncEval* ae, const Mlp* m, MPI_Comm comm);
+
+// Trainer: broadcasts m's weights as of `step`; `last` ends the run once
+// the evaluator is done with it.
+int async_eval_send(AsyncEval* ae, const Mlp* m, int64_t step, bool last);
+
+// Evaluator: loads every snapshot into m, which has the trainer's shapes,
+// and prints its loss and accuracy over the test set in batches of up to
+// `batch`, until the last one.
+int async_eval_run(AsyncEval* ae, Mlp* m, const Dataset* test,
+                   size_t batch);
+
+// Waits for the snapshots still in flight.
+void async_eval_free(AsyncEval* ae);
+
+#endif
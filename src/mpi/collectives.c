@@ -0,0 +1,530 @@
+#include "collectives.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "half.h"
+#include "trace.h"
+
+#define COLL_TAG 0x5a1
+
+static const char* algo_names[ALLREDUCE_N_ALGOS] = {
+    "mpi",
+    "ring",
+    "rd",
+    "rabenseifner",
+    "hier",
+};
+
+static const char* wire_names[] = {"fp32", "fp16", "bf16"};
+
+void wire_encode(WireFormat wire, const float* src, uint16_t* dst, size_t n) {
+    if (wire == WIRE_FP16) {
+        for (size_t i = 0; i < n; ++i) dst[i] = float_to_half(src[i]);
+    } else {
+        for (size_t i = 0; i < n; ++i) dst[i] = float_to_bf16(src[i]);
+    }
+}
+
+void wire_decode(WireFormat wire, const uint16_t* src, float* dst, size_t n) {
+    if (wire == WIRE_FP16) {
+        for (size_t i = 0; i < n; ++i) dst[i] = half_to_float(src[i]);
+    } else {
+        for (size_t i = 0; i < n; ++i) dst[i] = bf16_to_float(src[i]);
+    }
+}
+
+size_t wire_element_bytes(WireFormat wire) {
+    return wire == WIRE_FP32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+int wire_format_parse(const char* name, WireFormat* wire) {
+    if (name == NULL || wire == NULL) return 1;
+    for (int w = WIRE_FP32; w <= WIRE_BF16; ++w) {
+        if (strcmp(name, wire_names[w]) == 0) {
+            *wire = (WireFormat)w;
+            return 0;
+        }
+    }
+    return 2;
+}
+
+static void half_sum_op(void* in, void* inout, int* len, MPI_Datatype* type) {
+    (void)type;
+    uint16_t* a = (uint16_t*)in;
+    uint16_t* b = (uint16_t*)inout;
+    for (int i = 0; i < *len; ++i) {
+        b[i] = float_to_half(half_to_float(a[i]) + half_to_float(b[i]));
+    }
+}
+
+static void bf16_sum_op(void* in, void* inout, int* len, MPI_Datatype* type) {
+    (void)type;
+    uint16_t* a = (uint16_t*)in;
+    uint16_t* b = (uint16_t*)inout;
+    for (int i = 0; i < *len; ++i) {
+        b[i] = float_to_bf16(bf16_to_float(a[i]) + bf16_to_float(b[i]));
+    }
+}
+
+int collectives_init(Collectives* c, MPI_Comm comm) {
+    if (c == NULL) return 1;
+    memset(c, 0, sizeof(*c));
+    c->comm = comm;
+    MPI_Comm_rank(comm, &c->rank);
+    MPI_Comm_size(comm, &c->size);
+    MPI_Op_create(half_sum_op, 1, &c->half_sum);
+    MPI_Op_create(bf16_sum_op, 1, &c->bf16_sum);
+    collectives_use(c, ALLREDUCE_MPI);
+
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, c->rank, MPI_INFO_NULL,
+                        &c->node_comm);
+    MPI_Comm_rank(c->node_comm, &c->node_rank);
+    MPI_Comm_size(c->node_comm, &c->node_size);
+    MPI_Comm_split(comm, c->node_rank == 0 ? 0 : MPI_UNDEFINED, c->rank,
+                   &c->leader_comm);
+    int leader = c->node_rank == 0;
+    MPI_Allreduce(&leader, &c->n_nodes, 1, MPI_INT, MPI_SUM, comm);
+    c->node_win = MPI_WIN_NULL;
+    c->node_slots = (float**)calloc(c->node_size, sizeof(float*));
+    if (c->node_slots == NULL) return 2;
+    return 0;
+}
+
+static void node_window_free(Collectives* c) {
+    if (c->node_win == MPI_WIN_NULL) return;
+    MPI_Win_unlock_all(c->node_win);
+    MPI_Win_free(&c->node_win);
+    c->node_count = 0;
+}
+
+void collectives_free(Collectives* c) {
+    if (c == NULL) return;
+    node_window_free(c);
+    free(c->node_slots);
+    if (c->leader_comm != MPI_COMM_NULL) MPI_Comm_free(&c->leader_comm);
+    if (c->node_comm != MPI_COMM_NULL) MPI_Comm_free(&c->node_comm);
+    free(c->scratch);
+    free(c->wire_buf);
+    if (c->half_sum != MPI_OP_NULL) MPI_Op_free(&c->half_sum);
+    if (c->bf16_sum != MPI_OP_NULL) MPI_Op_free(&c->bf16_sum);
+    memset(c, 0, sizeof(*c));
+}
+
+void collectives_set_wire(Collectives* c, WireFormat wire) { c->wire = wire; }
+
+MPI_Op collectives_wire_op(const Collectives* c) {
+    if (c->wire == WIRE_FP16) return c->half_sum;
+    if (c->wire == WIRE_BF16) return c->bf16_sum;
+    return MPI_SUM;
+}
+
+void collectives_use(Collectives* c, AllreduceAlgo algo) {
+    for (size_t i = 0; i < COLL_SIZE_CLASSES; ++i) c->algo_for[i] = algo;
+}
+
+static size_t size_class(size_t bytes) {
+    size_t cls = 0;
+    while (cls + 1 < COLL_SIZE_CLASSES && ((size_t)2 << cls) <= bytes) cls++;
+    return cls;
+}
+
+void collectives_use_cutoffs(Collectives* c, size_t small_bytes,
+                             size_t large_bytes) {
+    for (size_t i = 0; i < COLL_SIZE_CLASSES; ++i) {
+        size_t bytes = (size_t)1 << i;
+        if (bytes < small_bytes) {
+            c->algo_for[i] = ALLREDUCE_RECURSIVE_DOUBLING;
+        } else if (c->node_size > 1 && c->n_nodes > 1) {
+            c->algo_for[i] = ALLREDUCE_HIERARCHICAL;
+        } else if (bytes < large_bytes) {
+            c->algo_for[i] = ALLREDUCE_RABENSEIFNER;
+        } else {
+            c->algo_for[i] = ALLREDUCE_RING;
+        }
+    }
+}
+
+AllreduceAlgo collectives_select(const Collectives* c, size_t bytes) {
+    return c->algo_for[size_class(bytes)];
+}
+
+static int reserve(Collectives* c, size_t count) {
+    if (c->scratch_count < count) {
+        float* scratch = (float*)realloc(c->scratch, count * sizeof(float));
+        if (scratch == NULL) return 1;
+        c->scratch = scratch;
+        c->scratch_count = count;
+    }
+    if (c->wire != WIRE_FP32 && c->wire_count < 2 * count) {
+        uint16_t* buf =
+            (uint16_t*)realloc(c->wire_buf, 2 * count * sizeof(uint16_t));
+        if (buf == NULL) return 1;
+        c->wire_buf = buf;
+        c->wire_count = 2 * count;
+    }
+    return 0;
+}
+
+// Collective over node_comm; every node rank asks for the same count.
+static int node_window_reserve(Collectives* c, size_t count) {
+    if (c->node_count >= count) return 0;
+    node_window_free(c);
+    size_t capacity = 1024;
+    while (capacity < count) capacity *= 2;
+    float* base = NULL;
+    if (MPI_Win_allocate_shared((MPI_Aint)(capacity * sizeof(float)),
+                                sizeof(float), MPI_INFO_NULL, c->node_comm,
+                                &base, &c->node_win) != MPI_SUCCESS) {
+        return 1;
+    }
+    for (int r = 0; r < c->node_size; ++r) {
+        MPI_Aint bytes;
+        int disp_unit;
+        MPI_Win_shared_query(c->node_win, r, &bytes, &disp_unit,
+                             &c->node_slots[r]);
+    }
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, c->node_win);
+    c->node_count = capacity;
+    return 0;
+}
+
+// Makes the window writes of every node rank visible to all of them.
+static void node_sync(Collectives* c) {
+    MPI_Win_sync(c->node_win);
+    MPI_Barrier(c->node_comm);
+    MPI_Win_sync(c->node_win);
+}
+
+// Rounds to what the wire can carry, so the copy a rank keeps matches the
+// copies it sends.
+static void quantize(Collectives* c, float* data, size_t n) {
+    if (c->wire == WIRE_FP32) return;
+    wire_encode(c->wire, data, c->wire_buf, n);
+    wire_decode(c->wire, c->wire_buf, data, n);
+}
+
+static void add(float* dst, const float* src, size_t n) {
+    for (size_t i = 0; i < n; ++i) dst[i] += src[i];
+}
+
+static void exchange(Collectives* c, const float* send, size_t send_count,
+                     float* recv, size_t recv_count, int peer_send,
+                     int peer_recv) {
+    if (c->wire == WIRE_FP32) {
+        MPI_Sendrecv(send, (int)send_count, MPI_FLOAT, peer_send, COLL_TAG,
+                     recv, (int)recv_count, MPI_FLOAT, peer_recv, COLL_TAG,
+                     c->comm, MPI_STATUS_IGNORE);
+        return;
+    }
+    uint16_t* out = c->wire_buf;
+    uint16_t* in = c->wire_buf + send_count;
+    wire_encode(c->wire, send, out, send_count);
+    MPI_Sendrecv(out, (int)send_count, MPI_UINT16_T, peer_send, COLL_TAG, in,
+                 (int)recv_count, MPI_UINT16_T, peer_recv, COLL_TAG, c->comm,
+                 MPI_STATUS_IGNORE);
+    wire_decode(c->wire, in, recv, recv_count);
+}
+
+static void send_to(Collectives* c, const float* data, size_t count,
+                    int peer) {
+    if (c->wire == WIRE_FP32) {
+        MPI_Send(data, (int)count, MPI_FLOAT, peer, COLL_TAG, c->comm);
+        return;
+    }
+    wire_encode(c->wire, data, c->wire_buf, count);
+    MPI_Send(c->wire_buf, (int)count, MPI_UINT16_T, peer, COLL_TAG, c->comm);
+}
+
+static void recv_from(Collectives* c, float* data, size_t count, int peer) {
+    if (c->wire == WIRE_FP32) {
+        MPI_Recv(data, (int)count, MPI_FLOAT, peer, COLL_TAG, c->comm,
+                 MPI_STATUS_IGNORE);
+        return;
+    }
+    MPI_Recv(c->wire_buf, (int)count, MPI_UINT16_T, peer, COLL_TAG, c->comm,
+             MPI_STATUS_IGNORE);
+    wire_decode(c->wire, c->wire_buf, data, count);
+}
+
+static int largest_pof2(int n) {
+    int p = 1;
+    while (p * 2 <= n) p *= 2;
+    return p;
+}
+
+// Folds the group onto its largest power of two subset: among the first
+// 2 * rem ranks each even one hands its data to the odd one above it and
+// sits out. Returns the rank within the subset, or -1.
+static int fold_in(Collectives* c, float* data, size_t count, int pof2) {
+    int rem = c->size - pof2;
+    if (c->rank >= 2 * rem) return c->rank - rem;
+    if (c->rank % 2 == 0) {
+        send_to(c, data, count, c->rank + 1);
+        return -1;
+    }
+    recv_from(c, c->scratch, count, c->rank - 1);
+    add(data, c->scratch, count);
+    return c->rank / 2;
+}
+
+static void fold_out(Collectives* c, float* data, size_t count, int pof2) {
+    int rem = c->size - pof2;
+    if (c->rank >= 2 * rem) return;
+    if (c->rank % 2 == 0) {
+        recv_from(c, data, count, c->rank + 1);
+    } else {
+        send_to(c, data, count, c->rank - 1);
+    }
+}
+
+static int subset_to_rank(int subset_rank, int rem) {
+    return subset_rank < rem ? 2 * subset_rank + 1 : subset_rank + rem;
+}
+
+// log2(p) full-size exchanges; latency bound, best for small messages.
+static void recursive_doubling(Collectives* c, float* data, size_t count) {
+    int pof2 = largest_pof2(c->size);
+    int rem = c->size - pof2;
+    int me = fold_in(c, data, count, pof2);
+    if (me >= 0) {
+        for (int mask = 1; mask < pof2; mask <<= 1) {
+            int peer = subset_to_rank(me ^ mask, rem);
+            quantize(c, data, count);
+            exchange(c, data, count, c->scratch, count, peer, peer);
+            add(data, c->scratch, count);
+        }
+        quantize(c, data, count);
+    }
+    fold_out(c, data, count, pof2);
+}
+
+// Reduce-scatter by recursive halving, then allgather by recursive
+// doubling: log2(p) steps moving about 2 * count floats in total.
+static void rabenseifner(Collectives* c, float* data, size_t count) {
+    int pof2 = largest_pof2(c->size);
+    int rem = c->size - pof2;
+    int me = fold_in(c, data, count, pof2);
+    if (me >= 0) {
+        size_t lo[32];
+        size_t hi[32];
+        size_t steps = 0;
+        size_t cur_lo = 0;
+        size_t cur_hi = count;
+        for (int mask = pof2 >> 1; mask > 0; mask >>= 1) {
+            int peer = subset_to_rank(me ^ mask, rem);
+            size_t mid = cur_lo + (cur_hi - cur_lo) / 2;
+            bool lower = (me & mask) == 0;
+            size_t keep_lo = lower ? cur_lo : mid;
+            size_t keep_hi = lower ? mid : cur_hi;
+            size_t send_lo = lower ? mid : cur_lo;
+            size_t send_hi = lower ? cur_hi : mid;
+            exchange(c, data + send_lo, send_hi - send_lo, c->scratch,
+                     keep_hi - keep_lo, peer, peer);
+            add(data + keep_lo, c->scratch, keep_hi - keep_lo);
+            lo[steps] = cur_lo;
+            hi[steps] = cur_hi;
+            steps++;
+            cur_lo = keep_lo;
+            cur_hi = keep_hi;
+        }
+        for (int mask = 1; mask < pof2; mask <<= 1) {
+            steps--;
+            int peer = subset_to_rank(me ^ mask, rem);
+            bool lower = (me & mask) == 0;
+            size_t other_lo = lower ? cur_hi : lo[steps];
+            size_t other_hi = lower ? hi[steps] : cur_lo;
+            quantize(c, data + cur_lo, cur_hi - cur_lo);
+            exchange(c, data + cur_lo, cur_hi - cur_lo, data + other_lo,
+                     other_hi - other_lo, peer, peer);
+            cur_lo = lo[steps];
+            cur_hi = hi[steps];
+        }
+    }
+    fold_out(c, data, count, pof2);
+}
+
+// Reduce-scatter then allgather around a ring: 2 * (p - 1) steps, each
+// moving count / p floats; bandwidth optimal for large messages.
+static void ring(Collectives* c, float* data, size_t count) {
+    int p = c->size;
+    int right = (c->rank + 1) % p;
+    int left = (c->rank + p - 1) % p;
+#define SEG_START(s) (count * (size_t)(s) / (size_t)p)
+#define SEG_COUNT(s) (SEG_START((s) + 1) - SEG_START(s))
+    for (int step = 0; step < p - 1; ++step) {
+        int send = (c->rank - step + p) % p;
+        int recv = (c->rank - step - 1 + 2 * p) % p;
+        exchange(c, data + SEG_START(send), SEG_COUNT(send), c->scratch,
+                 SEG_COUNT(recv), right, left);
+        add(data + SEG_START(recv), c->scratch, SEG_COUNT(recv));
+    }
+    // Segment rank + 1 is now fully reduced here.
+    int own = (c->rank + 1) % p;
+    quantize(c, data + SEG_START(own), SEG_COUNT(own));
+    for (int step = 0; step < p - 1; ++step) {
+        int send = (c->rank - step + 1 + p) % p;
+        int recv = (c->rank - step + p) % p;
+        exchange(c, data + SEG_START(send), SEG_COUNT(send),
+                 data + SEG_START(recv), SEG_COUNT(recv), right, left);
+    }
+#undef SEG_START
+#undef SEG_COUNT
+}
+
+// Every node rank sums its share of the slots into slot 0 in node rank
+// order, the leaders reduce slot 0 across nodes and everyone copies it out.
+static int hierarchical(Collectives* c, float* data, size_t count) {
+    if (node_window_reserve(c, count)) return 1;
+    float* sum = c->node_slots[0];
+    memcpy(c->node_slots[c->node_rank], data, count * sizeof(float));
+    node_sync(c);
+    size_t lo = count * (size_t)c->node_rank / (size_t)c->node_size;
+    size_t hi = count * (size_t)(c->node_rank + 1) / (size_t)c->node_size;
+    for (int r = 1; r < c->node_size; ++r) {
+        add(sum + lo, c->node_slots[r] + lo, hi - lo);
+    }
+    node_sync(c);
+    if (c->leader_comm != MPI_COMM_NULL && c->n_nodes > 1) {
+        if (c->wire == WIRE_FP32) {
+            MPI_Allreduce(MPI_IN_PLACE, sum, (int)count, MPI_FLOAT, MPI_SUM,
+                          c->leader_comm);
+        } else {
+            wire_encode(c->wire, sum, c->wire_buf, count);
+            MPI_Allreduce(MPI_IN_PLACE, c->wire_buf, (int)count, MPI_UINT16_T,
+                          collectives_wire_op(c), c->leader_comm);
+            wire_decode(c->wire, c->wire_buf, sum, count);
+        }
+    }
+    node_sync(c);
+    memcpy(data, sum, count * sizeof(float));
+    // Slot 0 is overwritten by the next call.
+    node_sync(c);
+    return 0;
+}
+
+static int allreduce_dispatch(Collectives* c, AllreduceAlgo algo, float* data,
+                              size_t count) {
+    if (algo == ALLREDUCE_MPI) {
+        if (c->wire == WIRE_FP32) {
+            MPI_Allreduce(MPI_IN_PLACE, data, (int)count, MPI_FLOAT, MPI_SUM,
+                          c->comm);
+        } else {
+            wire_encode(c->wire, data, c->wire_buf, count);
+            MPI_Allreduce(MPI_IN_PLACE, c->wire_buf, (int)count, MPI_UINT16_T,
+                          collectives_wire_op(c), c->comm);
+            wire_decode(c->wire, c->wire_buf, data, count);
+        }
+        return 0;
+    }
+    if (c->size == 1 || count == 0) return 0;
+    switch (algo) {
+        case ALLREDUCE_RING:
+            ring(c, data, count);
+            break;
+        case ALLREDUCE_RECURSIVE_DOUBLING:
+            recursive_doubling(c, data, count);
+            break;
+        case ALLREDUCE_RABENSEIFNER:
+            rabenseifner(c, data, count);
+            break;
+        case ALLREDUCE_HIERARCHICAL:
+            if (hierarchical(c, data, count)) return 2;
+            break;
+        default:
+            return 3;
+    }
+    return 0;
+}
+
+int allreduce_sum_with(Collectives* c, AllreduceAlgo algo, float* data,
+                       size_t count) {
+    if (c == NULL || (data == NULL && count > 0)) return 1;
+    if (reserve(c, count)) return 2;
+    double t0 = trace_now();
+    int status = allreduce_dispatch(c, algo, data, count);
+    trace_span("allreduce", t0);
+    return status;
+}
+
+int allreduce_sum(Collectives* c, float* data, size_t count) {
+    if (c == NULL) return 1;
+    return allreduce_sum_with(c, collectives_select(c, count * sizeof(float)),
+                              data, count);
+}
+
+int collectives_tune(Collectives* c, size_t max_bytes) {
+    if (c == NULL) return 1;
+    size_t max_count = max_bytes / sizeof(float);
+    if (max_count == 0) return 2;
+    float* buffer = (float*)malloc(max_count * sizeof(float));
+    if (buffer == NULL) return 3;
+
+    const int reps = 5;
+    size_t last = 2;
+    for (size_t cls = 2;
+         cls < COLL_SIZE_CLASSES && ((size_t)1 << cls) <= max_bytes; ++cls) {
+        size_t count = ((size_t)1 << cls) / sizeof(float);
+        double best = INFINITY;
+        for (int a = 0; a < ALLREDUCE_N_ALGOS; ++a) {
+            for (size_t i = 0; i < count; ++i) buffer[i] = 1.0f;
+            allreduce_sum_with(c, (AllreduceAlgo)a, buffer, count);
+            MPI_Barrier(c->comm);
+            double start = MPI_Wtime();
+            for (int r = 0; r < reps; ++r) {
+                allreduce_sum_with(c, (AllreduceAlgo)a, buffer, count);
+            }
+            double elapsed = MPI_Wtime() - start;
+            // Every rank decides on the same, slowest, timings.
+            MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX,
+                          c->comm);
+            if (elapsed < best) {
+                best = elapsed;
+                c->algo_for[cls] = (AllreduceAlgo)a;
+            }
+        }
+        last = cls;
+    }
+    for (size_t cls = 0; cls < 2; ++cls) c->algo_for[cls] = c->algo_for[2];
+    for (size_t cls = last + 1; cls < COLL_SIZE_CLASSES; ++cls) {
+        c->algo_for[cls] = c->algo_for[last];
+    }
+    free(buffer);
+    return 0;
+}
+
+void collectives_print(const Collectives* c) {
+    if (c->rank != 0) return;
+    size_t start = 0;
+    for (size_t cls = 1; cls <= COLL_SIZE_CLASSES; ++cls) {
+        if (cls < COLL_SIZE_CLASSES && c->algo_for[cls] == c->algo_for[start])
+            continue;
+        if (cls == COLL_SIZE_CLASSES) {
+            printf("allreduce >= %zu bytes: %s\n", (size_t)1 << start,
+                   allreduce_algo_name(c->algo_for[start]));
+        } else {
+            printf("allreduce %zu..%zu bytes: %s\n", (size_t)1 << start,
+                   ((size_t)1 << cls) - 1,
+                   allreduce_algo_name(c->algo_for[start]));
+        }
+        start = cls;
+    }
+}
+
+int allreduce_algo_parse(const char* name, AllreduceAlgo* algo) {
+    if (name == NULL || algo == NULL) return 1;
+    for (int a = 0; a < ALLREDUCE_N_ALGOS; ++a) {
+        if (strcmp(name, algo_names[a]) == 0) {
+            *algo = (AllreduceAlgo)a;
+            return 0;
+        }
+    }
+    return 2;
+}
+
+const char* allreduce_algo_name(AllreduceAlgo algo) {
+    if (algo < 0 || algo >= ALLREDUCE_N_ALGOS) return "unknown";
+    return algo_names[algo];
+}
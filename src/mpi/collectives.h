@@ -0,0 +1,102 @@
+#ifndef COLLECTIVES_H
+#define COLLECTIVES_H
+
+#include <mpi.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Message sizes are binned by floor(log2(bytes)), capped at the last class.
+#define COLL_SIZE_CLASSES 32
+
+typedef enum {
+    ALLREDUCE_MPI = 0,
+    ALLREDUCE_RING,
+    ALLREDUCE_RECURSIVE_DOUBLING,
+    ALLREDUCE_RABENSEIFNER,
+    ALLREDUCE_HIERARCHICAL,
+    ALLREDUCE_N_ALGOS,
+} AllreduceAlgo;
+
+// Element format on the wire. 16-bit formats are widened back to fp32
+// before every addition and the result is rounded to the wire format, so all
+// ranks end up with the same values.
+typedef enum {
+    WIRE_FP32 = 0,
+    WIRE_FP16,
+    WIRE_BF16,
+} WireFormat;
+
+// Float sum allreduce built on point-to-point messages, with the algorithm
+// picked per message size from `algo_for`.
+//
+// The hierarchical algorithm sums within each node through a shared memory
+// window on node_comm, runs MPI_Allreduce among one leader per node on
+// leader_comm and hands the result back through the window.
+typedef struct {
+    MPI_Comm comm;
+    int rank;
+    int size;
+    float* scratch;
+    size_t scratch_count;
+    AllreduceAlgo algo_for[COLL_SIZE_CLASSES];
+    WireFormat wire;
+    uint16_t* wire_buf;
+    size_t wire_count;
+    MPI_Op half_sum;
+    MPI_Op bf16_sum;
+    MPI_Comm node_comm;
+    MPI_Comm leader_comm;
+    int node_rank;
+    int node_size;
+    int n_nodes;
+    MPI_Win node_win;
+    // Slot of every node rank in node_win, node_count floats each.
+    float** node_slots;
+    size_t node_count;
+} Collectives;
+
+int collectives_init(Collectives* c, MPI_Comm comm);
+
+void collectives_free(Collectives* c);
+
+// Same algorithm for every size.
+void collectives_use(Collectives* c, AllreduceAlgo algo);
+
+// Recursive doubling below small_bytes, Rabenseifner below large_bytes and
+// ring from there on. With several nodes of several ranks each, everything
+// from small_bytes on goes hierarchical.
+void collectives_use_cutoffs(Collectives* c, size_t small_bytes,
+                             size_t large_bytes);
+
+// Times every algorithm on each size class up to max_bytes and keeps the
+// fastest; all ranks agree on the slowest rank's timings.
+int collectives_tune(Collectives* c, size_t max_bytes);
+
+void collectives_print(const Collectives* c);
+
+void collectives_set_wire(Collectives* c, WireFormat wire);
+
+// Sum op over MPI_UINT16_T elements in c's wire format.
+MPI_Op collectives_wire_op(const Collectives* c);
+
+size_t wire_element_bytes(WireFormat wire);
+
+void wire_encode(WireFormat wire, const float* src, uint16_t* dst, size_t n);
+
+void wire_decode(WireFormat wire, const uint16_t* src, float* dst, size_t n);
+
+int wire_format_parse(const char* name, WireFormat* wire);
+
+AllreduceAlgo collectives_select(const Collectives* c, size_t bytes);
+
+// In place sum of data over all ranks.
+int allreduce_sum(Collectives* c, float* data, size_t count);
+
+int allreduce_sum_with(Collectives* c, AllreduceAlgo algo, float* data,
+                       size_t count);
+
+int allreduce_algo_parse(const char* name, AllreduceAlgo* algo);
+
+const char* allreduce_algo_name(AllreduceAlgo algo);
+
+#endif
@@ -0,0 +1,159 @@
+#include "grad_buckets.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "utils.h"
+
+int grad_buckets_init(GradBuckets* b, const Mlp* m, Tensor** grads,
+                      size_t bucket_bytes, MPI_Comm comm, Collectives* coll) {
+    if (b == NULL || m == NULL || grads == NULL) return 1;
+    memset(b, 0, sizeof(*b));
+    b->grads = grads;
+    b->comm = comm;
+    b->coll = coll;
+    b->scale = 1.0f;
+    b->weight = 1.0f;
+
+    // Backward finishes the parameters from the last one down.
+    GradBucket* bucket = NULL;
+    for (size_t p = m->n_params; p-- > 0;) {
+        size_t bytes = grads[p]->size * sizeof(float);
+        if (bucket == NULL ||
+            (bucket->count > 0 &&
+             bucket->count * sizeof(float) + bytes > bucket_bytes)) {
+            bucket = &b->buckets[b->n_buckets++];
+        }
+        b->bucket_of[p] = bucket - b->buckets;
+        b->slot_of[p] = bucket->n_params;
+        bucket->params[bucket->n_params] = p;
+        bucket->offsets[bucket->n_params] = bucket->count;
+        bucket->n_params++;
+        bucket->count += grads[p]->size;
+    }
+    for (size_t i = 0; i < b->n_buckets; ++i) {
+        b->buckets[i].buffer =
+            (float*)malloc(b->buckets[i].count * sizeof(float));
+        if (b->buckets[i].buffer == NULL) return 2;
+        if (coll != NULL && coll->wire != WIRE_FP32) {
+            b->buckets[i].wire =
+                (uint16_t*)malloc(b->buckets[i].count * sizeof(uint16_t));
+            if (b->buckets[i].wire == NULL) return 2;
+        }
+        b->buckets[i].request = MPI_REQUEST_NULL;
+    }
+    return 0;
+}
+
+void grad_buckets_free(GradBuckets* b) {
+    if (b == NULL) return;
+    for (size_t i = 0; i < b->n_buckets; ++i) {
+        if (b->buckets[i].started) {
+            MPI_Wait(&b->buckets[i].request, MPI_STATUS_IGNORE);
+        }
+        free(b->buckets[i].buffer);
+        free(b->buckets[i].wire);
+    }
+    memset(b, 0, sizeof(*b));
+}
+
+void grad_buckets_ready(void* ctx, size_t param) {
+    GradBuckets* b = (GradBuckets*)ctx;
+    GradBucket* bucket = &b->buckets[b->bucket_of[param]];
+    Tensor* g = b->grads[param];
+    float* dst = bucket->buffer + bucket->offsets[b->slot_of[param]];
+    memcpy(dst, g->data, g->size * sizeof(float));
+    float scale = b->scale * b->weight;
+    if (scale != 1.0f) {
+        for (size_t i = 0; i < g->size; ++i) dst[i] *= scale;
+    }
+    if (++bucket->n_ready == bucket->n_params) {
+        WireFormat wire = b->coll != NULL ? b->coll->wire : WIRE_FP32;
+        size_t bytes = bucket->count * sizeof(float);
+        b->wire_bytes += bucket->count * wire_element_bytes(wire);
+        if (b->coll != NULL &&
+            collectives_select(b->coll, bytes) != ALLREDUCE_MPI) {
+            double start = wall_time();
+            allreduce_sum(b->coll, bucket->buffer, bucket->count);
+            b->blocked_seconds += wall_time() - start;
+        } else if (wire != WIRE_FP32) {
+            wire_encode(wire, bucket->buffer, bucket->wire, bucket->count);
+            bucket->posted = trace_now();
+            MPI_Iallreduce(MPI_IN_PLACE, bucket->wire, (int)bucket->count,
+                           MPI_UINT16_T, collectives_wire_op(b->coll), b->comm,
+                           &bucket->request);
+            bucket->started = true;
+        } else {
+            bucket->posted = trace_now();
+            MPI_Iallreduce(MPI_IN_PLACE, bucket->buffer, (int)bucket->count,
+                           MPI_FLOAT, MPI_SUM, b->comm, &bucket->request);
+            bucket->started = true;
+        }
+    }
+    // Lets the library advance buckets already in flight.
+    for (size_t i = 0; i < b->n_buckets; ++i) {
+        if (b->buckets[i].started) {
+            int done = 0;
+            MPI_Test(&b->buckets[i].request, &done, MPI_STATUS_IGNORE);
+            if (done && b->buckets[i].posted != 0.0) {
+                trace_async("bucket allreduce", b->buckets[i].posted);
+                b->buckets[i].posted = 0.0;
+            }
+        }
+    }
+}
+
+int grad_buckets_wait(GradBuckets* b) {
+    if (b == NULL) return 1;
+    b->overflow = false;
+    b->n_steps++;
+    float inv_scale = 1.0f / b->scale;
+    for (size_t i = 0; i < b->n_buckets; ++i) {
+        GradBucket* bucket = &b->buckets[i];
+        if (bucket->n_ready != bucket->n_params) return 2;
+        MPI_Wait(&bucket->request, MPI_STATUS_IGNORE);
+        if (bucket->posted != 0.0) {
+            trace_async("bucket allreduce", bucket->posted);
+            bucket->posted = 0.0;
+        }
+        if (bucket->started && bucket->wire != NULL) {
+            wire_decode(b->coll->wire, bucket->wire, bucket->buffer,
+                        bucket->count);
+        }
+        for (size_t j = 0; j < bucket->n_params; ++j) {
+            Tensor* g = b->grads[bucket->params[j]];
+            const float* src = bucket->buffer + bucket->offsets[j];
+            float* dst = (float*)g->data;
+            for (size_t k = 0; k < g->size; ++k) {
+                dst[k] = src[k] * inv_scale;
+                if (!isfinite(dst[k])) b->overflow = true;
+            }
+        }
+        bucket->n_ready = 0;
+        bucket->started = false;
+    }
+    return 0;
+}
+
+void grad_buckets_set_scale(GradBuckets* b, float scale, bool dynamic) {
+    b->scale = scale;
+    b->dynamic_scale = dynamic;
+    b->good_steps = 0;
+}
+
+void grad_buckets_update_scale(GradBuckets* b) {
+    if (!b->dynamic_scale) return;
+    if (b->overflow) {
+        b->scale *= 0.5f;
+        b->good_steps = 0;
+    } else if (++b->good_steps == GRAD_SCALE_GROWTH_STEPS) {
+        b->scale *= 2.0f;
+        b->good_steps = 0;
+    }
+}
+
+void grad_buckets_set_weight(GradBuckets* b, float weight) {
+    b->weight = weight;
+}
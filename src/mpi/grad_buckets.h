@@ -0,0 +1,79 @@
+#ifndef GRAD_BUCKETS_H
+#define GRAD_BUCKETS_H
+
+#include <mpi.h>
+#include <stddef.h>
+
+#include "collectives.h"
+#include "model.h"
+#include "tensor.h"
+
+#define GRAD_SCALE_GROWTH_STEPS 200
+
+// Gradients packed back to back in the order backward finishes them.
+typedef struct {
+    size_t params[MLP_MAX_PARAMS];
+    size_t offsets[MLP_MAX_PARAMS];
+    size_t n_params;
+    size_t n_ready;
+    size_t count;
+    float* buffer;
+    // 16-bit copy of buffer in flight when coll uses a 16-bit wire format.
+    uint16_t* wire;
+    MPI_Request request;
+    bool started;
+    // trace_now() when the MPI_Iallreduce was posted, 0 once it is traced.
+    double posted;
+} GradBucket;
+
+// Sums grads over comm in buckets of about bucket_bytes. Each bucket starts
+// an MPI_Iallreduce as soon as its last gradient is ready, so the reduction
+// of late layers overlaps backward through the early ones. With coll set, a
+// bucket whose size maps to one of its point-to-point algorithms is instead
+// reduced right away with that algorithm, which blocks.
+//
+// Gradients are multiplied by `scale` before they are sent and divided after,
+// which keeps small values out of the fp16 subnormal range. A non-finite sum
+// sets `overflow`; the caller should then skip the step. This rank's
+// gradients also count `weight` times in the sum, e.g. in proportion to its
+// share of an uneven batch.
+typedef struct {
+    Tensor** grads;
+    MPI_Comm comm;
+    Collectives* coll;
+    GradBucket buckets[MLP_MAX_PARAMS];
+    size_t n_buckets;
+    size_t bucket_of[MLP_MAX_PARAMS];
+    size_t slot_of[MLP_MAX_PARAMS];
+    float scale;
+    float weight;
+    bool dynamic_scale;
+    size_t good_steps;
+    bool overflow;
+    size_t wire_bytes;
+    size_t n_steps;
+    // Total time spent inside blocking reductions started from
+    // grad_buckets_ready, i.e. waiting on peers rather than computing.
+    double blocked_seconds;
+} GradBuckets;
+
+int grad_buckets_init(GradBuckets* b, const Mlp* m, Tensor** grads,
+                      size_t bucket_bytes, MPI_Comm comm, Collectives* coll);
+
+void grad_buckets_free(GradBuckets* b);
+
+// MlpGradHook for MlpWork.grad_ready with ctx = GradBuckets*.
+void grad_buckets_ready(void* ctx, size_t param);
+
+// Waits for every bucket and writes the sums back to the gradients.
+int grad_buckets_wait(GradBuckets* b);
+
+// With dynamic set, the scale halves after every overflow and doubles after
+// GRAD_SCALE_GROWTH_STEPS clean steps in a row.
+void grad_buckets_set_scale(GradBuckets* b, float scale, bool dynamic);
+
+void grad_buckets_update_scale(GradBuckets* b);
+
+void grad_buckets_set_weight(GradBuckets* b, float weight);
+
+#endif
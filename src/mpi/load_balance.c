@@ -0,0 +1,94 @@
+#include "load_balance.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+int load_balancer_init(LoadBalancer* lb, size_t every, size_t max_share,
+                       MPI_Comm comm) {
+    if (lb == NULL || every == 0 || max_share == 0) return 1;
+    memset(lb, 0, sizeof(*lb));
+    lb->comm = comm;
+    MPI_Comm_rank(comm, &lb->rank);
+    MPI_Comm_size(comm, &lb->size);
+    lb->every = every;
+    lb->max_share = max_share;
+    size_t n = (size_t)lb->size;
+    lb->shares = (size_t*)calloc(n, sizeof(size_t));
+    lb->offsets = (size_t*)calloc(n + 1, sizeof(size_t));
+    lb->rates = (double*)calloc(n, sizeof(double));
+    lb->measured = (double*)calloc(n, sizeof(double));
+    if (!lb->shares || !lb->offsets || !lb->rates || !lb->measured) return 2;
+    return 0;
+}
+
+void load_balancer_free(LoadBalancer* lb) {
+    if (lb == NULL) return;
+    free(lb->shares);
+    free(lb->offsets);
+    free(lb->rates);
+    free(lb->measured);
+    memset(lb, 0, sizeof(*lb));
+}
+
+int load_balancer_split(LoadBalancer* lb, size_t total) {
+    if (lb == NULL) return 1;
+    size_t n = (size_t)lb->size;
+    if (total > n * lb->max_share) return 2;
+    // Until every rank has been measured, all count the same.
+    bool known = true;
+    double sum = 0.0;
+    for (size_t r = 0; r < n; ++r) {
+        known = known && lb->rates[r] > 0.0;
+        sum += lb->rates[r];
+    }
+    size_t given = 0;
+    for (size_t r = 0; r < n; ++r) {
+        double rate = known ? lb->rates[r] / sum : 1.0 / (double)n;
+        size_t share = (size_t)floor((double)total * rate);
+        lb->shares[r] = share < lb->max_share ? share : lb->max_share;
+        given += lb->shares[r];
+    }
+    // The rest one sample at a time, each to the rank that would finish it
+    // soonest.
+    while (given < total) {
+        size_t best = n;
+        double best_time = 0.0;
+        for (size_t r = 0; r < n; ++r) {
+            if (lb->shares[r] == lb->max_share) continue;
+            double rate = known ? lb->rates[r] : 1.0;
+            double time = (double)(lb->shares[r] + 1) / rate;
+            if (best == n || time < best_time) {
+                best = r;
+                best_time = time;
+            }
+        }
+        lb->shares[best]++;
+        given++;
+    }
+    for (size_t r = 0; r < n; ++r) {
+        lb->offsets[r + 1] = lb->offsets[r] + lb->shares[r];
+    }
+    return 0;
+}
+
+void load_balancer_record(LoadBalancer* lb, double seconds) {
+    lb->busy += seconds;
+    lb->busy_samples += lb->shares[lb->rank];
+    if (++lb->since < lb->every) return;
+
+    double rate = lb->busy > 0.0 ? (double)lb->busy_samples / lb->busy : 0.0;
+    MPI_Allgather(&rate, 1, MPI_DOUBLE, lb->measured, 1, MPI_DOUBLE,
+                  lb->comm);
+    for (int r = 0; r < lb->size; ++r) {
+        // A rank that had nothing to do keeps its old rate.
+        if (lb->measured[r] <= 0.0) continue;
+        lb->rates[r] = lb->rates[r] > 0.0
+                           ? 0.5 * (lb->rates[r] + lb->measured[r])
+                           : lb->measured[r];
+    }
+    lb->busy = 0.0;
+    lb->busy_samples = 0;
+    lb->since = 0;
+    lb->n_rebalances++;
+}
@@ -0,0 +1,44 @@
+#ifndef LOAD_BALANCE_H
+#define LOAD_BALANCE_H
+
+#include <mpi.h>
+#include <stddef.h>
+
+// Splits each step's samples over the ranks of comm in proportion to how
+// fast each rank has been computing, so fast ranks stop waiting for slow
+// ones at every reduction. Every `every` steps the ranks exchange their
+// measured samples per second; all of them derive the same shares from the
+// same numbers, so the split needs no further communication.
+typedef struct {
+    MPI_Comm comm;
+    int rank;
+    int size;
+    size_t every;
+    size_t max_share;
+    // Shares of the current step: rank r takes samples
+    // [offsets[r], offsets[r] + shares[r]) of it.
+    size_t* shares;
+    size_t* offsets;
+    // Smoothed samples per second of every rank, 0 before any measurement.
+    double* rates;
+    double* measured;
+    double busy;
+    size_t busy_samples;
+    size_t since;
+    size_t n_rebalances;
+} LoadBalancer;
+
+// No rank is ever given more than max_share samples.
+int load_balancer_init(LoadBalancer* lb, size_t every, size_t max_share,
+                       MPI_Comm comm);
+
+void load_balancer_free(LoadBalancer* lb);
+
+// Divides a step of `total` samples, at most size * max_share.
+int load_balancer_split(LoadBalancer* lb, size_t total);
+
+// Call on every rank after every step with the time spent computing its
+// share; collective every `every` calls.
+void load_balancer_record(LoadBalancer* lb, double seconds);
+
+#endif
@@ -0,0 +1,95 @@
+#include "local_sgd.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+int local_sgd_init(LocalSgd* l, const Mlp* m, size_t steps, bool adaptive,
+                   bool moments, MPI_Comm comm) {
+    if (l == NULL || m == NULL || steps == 0) return 1;
+    memset(l, 0, sizeof(*l));
+    l->comm = comm;
+    MPI_Comm_size(comm, &l->size);
+    l->steps = steps;
+    l->initial_steps = steps;
+    l->adaptive = adaptive;
+    l->moments = moments;
+
+    for (size_t p = 0; p < m->n_params; ++p) {
+        l->count += m->params[p]->size * (moments ? 3 : 1);
+    }
+    // The summed loss travels in the last slot.
+    l->buffer = (float*)malloc((l->count + 1) * sizeof(float));
+    if (l->buffer == NULL) return 2;
+    return 0;
+}
+
+void local_sgd_free(LocalSgd* l) {
+    if (l == NULL) return;
+    free(l->buffer);
+    memset(l, 0, sizeof(*l));
+}
+
+static size_t copy_set(float* buffer, Tensor** set, size_t n, bool out) {
+    size_t off = 0;
+    for (size_t p = 0; p < n; ++p) {
+        float* data = (float*)set[p]->data;
+        if (out) {
+            memcpy(buffer + off, data, set[p]->size * sizeof(float));
+        } else {
+            memcpy(data, buffer + off, set[p]->size * sizeof(float));
+        }
+        off += set[p]->size;
+    }
+    return off;
+}
+
+int local_sgd_average(LocalSgd* l, Mlp* m) {
+    if (l == NULL || m == NULL) return 1;
+    size_t off = copy_set(l->buffer, m->params, m->n_params, true);
+    if (l->moments) {
+        off += copy_set(l->buffer + off, m->m, m->n_params, true);
+        off += copy_set(l->buffer + off, m->v, m->n_params, true);
+    }
+    l->buffer[off] = l->loss_sum;
+    double t0 = trace_now();
+    MPI_Allreduce(MPI_IN_PLACE, l->buffer, (int)(l->count + 1), MPI_FLOAT,
+                  MPI_SUM, l->comm);
+    trace_span("model allreduce", t0);
+    l->bytes += (l->count + 1) * sizeof(float);
+
+    float inv_size = 1.0f / (float)l->size;
+    for (size_t i = 0; i < l->count; ++i) l->buffer[i] *= inv_size;
+    off = copy_set(l->buffer, m->params, m->n_params, false);
+    if (l->moments) {
+        off += copy_set(l->buffer + off, m->m, m->n_params, false);
+        off += copy_set(l->buffer + off, m->v, m->n_params, false);
+    }
+
+    // Every rank sees the same summed loss, so all pick the same period.
+    if (l->adaptive && l->since_sync > 0) {
+        float loss =
+            l->buffer[l->count] / (float)(l->since_sync * (size_t)l->size);
+        if (l->n_averages == 0) l->first_loss = loss;
+        if (l->first_loss > 0.0f && loss > 0.0f) {
+            float ratio = sqrtf(loss / l->first_loss);
+            size_t steps = (size_t)ceilf((float)l->initial_steps * ratio);
+            l->steps = steps < 1 ? 1 : steps;
+        }
+    }
+    l->n_averages++;
+    l->since_sync = 0;
+    l->loss_sum = 0.0f;
+    return 0;
+}
+
+int local_sgd_step(LocalSgd* l, Mlp* m, float loss) {
+    if (l == NULL) return 1;
+    l->n_steps++;
+    l->since_sync++;
+    l->loss_sum += loss;
+    if (l->since_sync < l->steps) return 0;
+    return local_sgd_average(l, m);
+}
@@ -0,0 +1,47 @@
+#ifndef LOCAL_SGD_H
+#define LOCAL_SGD_H
+
+#include <mpi.h>
+#include <stddef.h>
+
+#include "model.h"
+
+// Periodic model averaging: every rank takes `steps` optimizer steps on its
+// own batches, then the parameters (and with `moments` the Adam moments) are
+// averaged over comm in one allreduce.
+//
+// With `adaptive` the period follows the training loss as in AdaComm,
+// steps = ceil(initial_steps * sqrt(loss / first_loss)), where loss is the
+// mean loss over all ranks since the last average and first_loss is the one
+// of the first period. Long periods early on save communication while the
+// loss is high; they shrink as the model converges.
+typedef struct {
+    MPI_Comm comm;
+    int size;
+    size_t steps;
+    size_t initial_steps;
+    bool adaptive;
+    bool moments;
+    size_t since_sync;
+    float loss_sum;
+    float first_loss;
+    size_t n_averages;
+    size_t n_steps;
+    size_t bytes;
+    float* buffer;
+    size_t count;
+} LocalSgd;
+
+int local_sgd_init(LocalSgd* l, const Mlp* m, size_t steps, bool adaptive,
+                   bool moments, MPI_Comm comm);
+
+void local_sgd_free(LocalSgd* l);
+
+// Call after every local optimizer step with the loss of its batch; averages
+// the model when the period is over.
+int local_sgd_step(LocalSgd* l, Mlp* m, float loss);
+
+// Averages right away, e.g. to end training with the same model everywhere.
+int local_sgd_average(LocalSgd* l, Mlp* m);
+
+#endif
@@ -0,0 +1,142 @@
+#include "param_server.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+static void copy_params(float* flat, const Mlp* m, bool out) {
+    size_t off = 0;
+    for (size_t p = 0; p < m->n_params; ++p) {
+        float* data = (float*)m->params[p]->data;
+        size_t bytes = m->params[p]->size * sizeof(float);
+        if (out) {
+            memcpy(flat + off, data, bytes);
+        } else {
+            memcpy(data, flat + off, bytes);
+        }
+        off += m->params[p]->size;
+    }
+}
+
+int param_server_init(ParamServer* ps, const Mlp* m, size_t staleness,
+                      MPI_Comm comm) {
+    if (ps == NULL || m == NULL) return 1;
+    memset(ps, 0, sizeof(*ps));
+    ps->comm = comm;
+    MPI_Comm_rank(comm, &ps->rank);
+    MPI_Comm_size(comm, &ps->size);
+    ps->staleness = staleness;
+    for (size_t p = 0; p < m->n_params; ++p) ps->count += m->params[p]->size;
+
+    ps->offsets = (size_t*)malloc(((size_t)ps->size + 1) * sizeof(size_t));
+    ps->fetched = (float*)malloc(ps->count * sizeof(float));
+    ps->delta = (float*)malloc(ps->count * sizeof(float));
+    ps->seen = (int64_t*)malloc((size_t)ps->size * sizeof(int64_t));
+    if (!ps->offsets || !ps->fetched || !ps->delta || !ps->seen) return 2;
+    for (int r = 0; r <= ps->size; ++r) {
+        ps->offsets[r] = ps->count * (size_t)r / (size_t)ps->size;
+    }
+    copy_params(ps->fetched, m, true);
+
+    size_t lo = ps->offsets[ps->rank];
+    size_t n = ps->offsets[ps->rank + 1] - lo;
+    float* block;
+    MPI_Win_allocate((MPI_Aint)(n * sizeof(float)), sizeof(float),
+                     MPI_INFO_NULL, comm, &block, &ps->win);
+    memcpy(block, ps->fetched + lo, n * sizeof(float));
+    size_t n_clocks = ps->rank == 0 ? (size_t)ps->size : 0;
+    MPI_Win_allocate((MPI_Aint)(n_clocks * sizeof(int64_t)), sizeof(int64_t),
+                     MPI_INFO_NULL, comm, &ps->clocks, &ps->clock_win);
+    if (n_clocks > 0) memset(ps->clocks, 0, n_clocks * sizeof(int64_t));
+    // One passive epoch for the whole run.
+    MPI_Win_lock_all(0, ps->win);
+    MPI_Win_lock_all(0, ps->clock_win);
+    MPI_Win_sync(ps->win);
+    MPI_Win_sync(ps->clock_win);
+    MPI_Barrier(comm);
+    return 0;
+}
+
+static void push(ParamServer* ps) {
+    for (int r = 0; r < ps->size; ++r) {
+        size_t lo = ps->offsets[r];
+        int n = (int)(ps->offsets[r + 1] - lo);
+        if (n == 0) continue;
+        MPI_Accumulate(ps->delta + lo, n, MPI_FLOAT, r, 0, n, MPI_FLOAT,
+                       MPI_SUM, ps->win);
+    }
+    MPI_Win_flush_all(ps->win);
+}
+
+static void fetch(ParamServer* ps) {
+    for (int r = 0; r < ps->size; ++r) {
+        size_t lo = ps->offsets[r];
+        int n = (int)(ps->offsets[r + 1] - lo);
+        if (n == 0) continue;
+        MPI_Get_accumulate(NULL, 0, MPI_FLOAT, ps->fetched + lo, n, MPI_FLOAT,
+                           r, 0, n, MPI_FLOAT, MPI_NO_OP, ps->win);
+    }
+    MPI_Win_flush_all(ps->win);
+}
+
+// Smallest clock of any worker.
+static int64_t slowest(ParamServer* ps) {
+    MPI_Get_accumulate(NULL, 0, MPI_INT64_T, ps->seen, ps->size, MPI_INT64_T,
+                       0, 0, ps->size, MPI_INT64_T, MPI_NO_OP, ps->clock_win);
+    MPI_Win_flush(0, ps->clock_win);
+    int64_t min = ps->seen[0];
+    for (int r = 1; r < ps->size; ++r) {
+        if (ps->seen[r] < min) min = ps->seen[r];
+    }
+    return min;
+}
+
+int param_server_step(ParamServer* ps, Mlp* m) {
+    if (ps == NULL || m == NULL) return 1;
+    copy_params(ps->delta, m, true);
+    for (size_t i = 0; i < ps->count; ++i) ps->delta[i] -= ps->fetched[i];
+    push(ps);
+
+    // The update is complete at its servers before the clock says so.
+    int64_t one = 1;
+    MPI_Accumulate(&one, 1, MPI_INT64_T, 0, ps->rank, 1, MPI_INT64_T, MPI_SUM,
+                   ps->clock_win);
+    MPI_Win_flush(0, ps->clock_win);
+    ps->clock++;
+
+    int64_t bound = ps->clock - (int64_t)ps->staleness;
+    int64_t min = slowest(ps);
+    if (min < bound) {
+        double start = wall_time();
+        while (min < bound) min = slowest(ps);
+        ps->wait_seconds += wall_time() - start;
+    }
+    if (ps->clock - min > ps->max_lag) ps->max_lag = ps->clock - min;
+
+    fetch(ps);
+    copy_params(ps->fetched, m, false);
+    return 0;
+}
+
+int param_server_finish(ParamServer* ps, Mlp* m) {
+    if (ps == NULL || m == NULL) return 1;
+    MPI_Win_flush_all(ps->win);
+    MPI_Barrier(ps->comm);
+    fetch(ps);
+    copy_params(ps->fetched, m, false);
+    return 0;
+}
+
+void param_server_free(ParamServer* ps) {
+    if (ps == NULL || ps->offsets == NULL) return;
+    MPI_Win_unlock_all(ps->clock_win);
+    MPI_Win_unlock_all(ps->win);
+    MPI_Win_free(&ps->clock_win);
+    MPI_Win_free(&ps->win);
+    free(ps->offsets);
+    free(ps->fetched);
+    free(ps->delta);
+    free(ps->seen);
+    memset(ps, 0, sizeof(*ps));
+}
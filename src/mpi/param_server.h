@@ -0,0 +1,58 @@
+#ifndef PARAM_SERVER_H
+#define PARAM_SERVER_H
+
+#include <mpi.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "model.h"
+
+// Asynchronous parameter server over one-sided MPI. The parameters, flat and
+// split into one block per rank of comm, live in an MPI_Win; every rank is
+// both a worker and the server of its block. After each local optimizer step
+// a worker adds its change to the parameters into the blocks with
+// MPI_Accumulate and fetches the current values with MPI_Get_accumulate,
+// which unlike MPI_Get is atomic with respect to the other workers' adds.
+// Nobody waits for a global barrier.
+//
+// Staleness is bounded as in stale synchronous parallel: a worker that has
+// pushed `clock` updates does not start another step until every worker has
+// pushed at least clock - staleness, so it never runs on parameters missing
+// more than that many steps of any other worker. The clocks live in a second
+// window on rank 0.
+typedef struct {
+    MPI_Comm comm;
+    int rank;
+    int size;
+    size_t staleness;
+    size_t count;
+    // Rank r serves flat parameters [offsets[r], offsets[r + 1]).
+    size_t* offsets;
+    MPI_Win win;
+    MPI_Win clock_win;
+    int64_t* clocks;
+    int64_t clock;
+    // Rank 0's clocks as last read.
+    int64_t* seen;
+    // Parameters as last fetched, and the change since then.
+    float* fetched;
+    float* delta;
+    double wait_seconds;
+    int64_t max_lag;
+} ParamServer;
+
+// Collective; every rank passes the same initial model.
+int param_server_init(ParamServer* ps, const Mlp* m, size_t staleness,
+                      MPI_Comm comm);
+
+// Call after every local optimizer step on m: pushes the change, waits for
+// the staleness bound and replaces m's parameters by the server's.
+int param_server_step(ParamServer* ps, Mlp* m);
+
+// Collective: waits for every worker's updates and fetches the final
+// parameters, so all ranks end with the same model.
+int param_server_finish(ParamServer* ps, Mlp* m);
+
+void param_server_free(ParamServer* ps);
+
+#endif
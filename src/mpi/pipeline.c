@@ -0,0 +1,271 @@
+#include "pipeline.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "linalg.h"
+#include "utils.h"
+
+#define TAG_ACTIVATION 0
+#define TAG_GRADIENT 1
+
+int pipeline_init(Pipeline* p, MPI_Comm comm, int n_stages) {
+    if (p == NULL || n_stages < 1 || n_stages > PIPELINE_MAX_STAGES) return 1;
+    memset(p, 0, sizeof(*p));
+    int rank;
+    int size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    if (size % n_stages != 0) return 2;
+    MPI_Comm_split(comm, rank / n_stages, rank, &p->stage_comm);
+    MPI_Comm_split(comm, rank % n_stages, rank, &p->dp_comm);
+    MPI_Comm_rank(p->stage_comm, &p->stage);
+    MPI_Comm_size(p->stage_comm, &p->n_stages);
+    MPI_Comm_rank(p->dp_comm, &p->dp_rank);
+    MPI_Comm_size(p->dp_comm, &p->dp_size);
+    for (size_t s = 0; s < PIPELINE_MAX_STAGES; ++s) {
+        p->recv_input[s] = MPI_REQUEST_NULL;
+        p->recv_grad[s] = MPI_REQUEST_NULL;
+        p->send_output[s] = MPI_REQUEST_NULL;
+        p->send_grad[s] = MPI_REQUEST_NULL;
+    }
+    return 0;
+}
+
+int pipeline_shard_mlp(Pipeline* p, Mlp* m) {
+    if (p == NULL || m == NULL) return 1;
+    size_t L = m->n_layers;
+    size_t n_stages = (size_t)p->n_stages;
+    if (L < n_stages) return 2;
+    p->layer_lo = L * (size_t)p->stage / n_stages;
+    p->layer_hi = L * (size_t)(p->stage + 1) / n_stages;
+    size_t lo = p->layer_lo;
+    size_t n = p->layer_hi - lo;
+
+    // The values are copied over from m.
+    Mlp stage;
+    RETURN_IF_ERROR(mlp_alloc(&stage, m->sizes + lo, n + 1));
+    for (size_t i = 0; i < stage.n_params; ++i) {
+        RETURN_IF_ERROR(tensor_copy(stage.params[i], m->params[2 * lo + i]));
+    }
+    stage.activate_last = p->stage + 1 < p->n_stages;
+    mlp_free(m);
+    *m = stage;
+    return 0;
+}
+
+int pipeline_work_init(Pipeline* p, const Mlp* m, size_t batch,
+                       size_t n_micro, size_t checkpoint_every) {
+    if (p == NULL || m == NULL || n_micro == 0) return 1;
+    if (batch % n_micro != 0) return 2;
+    p->n_micro = n_micro;
+    p->micro = batch / n_micro;
+    p->n_slots = (size_t)(p->n_stages - p->stage);
+    if (p->n_slots > n_micro) p->n_slots = n_micro;
+
+    Shape in = shapeN(3, p->micro, 1, m->sizes[0]);
+    Shape out = shapeN(3, p->micro, 1, m->sizes[m->n_layers]);
+    for (size_t s = 0; s < p->n_slots; ++s) {
+        RETURN_IF_ERROR(
+            mlp_work_init(&p->work[s], m, p->micro, checkpoint_every));
+        if (p->stage > 0) {
+            p->input[s] = tensor_alloc(in, DTYPE_FLOAT32);
+            p->input_grad[s] = tensor_alloc(in, DTYPE_FLOAT32);
+            if (!p->input[s] || !p->input_grad[s]) return 3;
+        }
+        p->output_grad[s] = tensor_alloc(out, DTYPE_FLOAT32);
+        if (!p->output_grad[s]) return 3;
+    }
+    return mlp_grads_alloc(m, p->grads);
+}
+
+// Samples in micro-batch i of a pass over y.
+static size_t micro_rows(const Pipeline* p, const Tensor* y, size_t i) {
+    size_t left = y->shape.dims[0] - i * p->micro;
+    return left < p->micro ? left : p->micro;
+}
+
+// Micro-batch i of x and y.
+static int micro_views(const Pipeline* p, const Tensor* x, const Tensor* y,
+                       size_t i, Tensor* x_i, Tensor* y_i) {
+    size_t width = x->shape.dims[2];
+    size_t rows = micro_rows(p, y, i);
+    RETURN_IF_ERROR(tensor_view(x_i,
+                                (float*)x->data + i * p->micro * width,
+                                shapeN(3, rows, 1, width), DTYPE_FLOAT32));
+    return tensor_view(y_i, (uint8_t*)y->data + i * p->micro,
+                       shapeN(1, rows), DTYPE_UINT8);
+}
+
+static void post_input(Pipeline* p, size_t i) {
+    if (p->stage == 0 || i >= p->n_current) return;
+    size_t s = i % p->n_slots;
+    MPI_Irecv(p->input[s]->data, (int)p->input[s]->size, MPI_FLOAT,
+              p->stage - 1, TAG_ACTIVATION, p->stage_comm, &p->recv_input[s]);
+}
+
+static int forward_micro(Pipeline* p, const Mlp* m, const Tensor* x,
+                         const Tensor* y, size_t i, bool train) {
+    size_t s = i % p->n_slots;
+    MlpWork* w = &p->work[s];
+    Tensor x_i;
+    Tensor y_i;
+    RETURN_IF_ERROR(micro_views(p, x, y, i, &x_i, &y_i));
+    const Tensor* in = &x_i;
+    Tensor input;
+    if (p->stage > 0) {
+        MPI_Wait(&p->recv_input[s], MPI_STATUS_IGNORE);
+        Shape shape = p->input[s]->shape;
+        shape.dims[0] = y_i.shape.dims[0];
+        RETURN_IF_ERROR(
+            tensor_view(&input, p->input[s]->data, shape, DTYPE_FLOAT32));
+        in = &input;
+    }
+    // The slot's previous output may still be on its way.
+    MPI_Wait(&p->send_output[s], MPI_STATUS_IGNORE);
+    RETURN_IF_ERROR(mlp_forward(m, w, in));
+    // Without a backward pass the input is free again right away.
+    if (!train) post_input(p, i + p->n_slots);
+
+    if (p->stage + 1 == p->n_stages) {
+        float loss;
+        float acc;
+        RETURN_IF_ERROR(mlp_metrics(w, &y_i, &loss, &acc));
+        if (train) {
+            p->loss += loss / (float)p->n_micro;
+            p->acc += acc / (float)p->n_micro;
+        } else {
+            float rows = (float)y_i.shape.dims[0];
+            p->loss += loss * rows;
+            p->acc += acc * rows;
+        }
+        return 0;
+    }
+    Tensor* out = &w->act[m->n_layers - 1];
+    MPI_Isend(out->data, (int)out->size, MPI_FLOAT, p->stage + 1,
+              TAG_ACTIVATION, p->stage_comm, &p->send_output[s]);
+    if (train) {
+        MPI_Irecv(p->output_grad[s]->data, (int)p->output_grad[s]->size,
+                  MPI_FLOAT, p->stage + 1, TAG_GRADIENT, p->stage_comm,
+                  &p->recv_grad[s]);
+    }
+    return 0;
+}
+
+static int backward_micro(Pipeline* p, const Mlp* m, const Tensor* x,
+                          const Tensor* y, size_t i, Tensor** grads) {
+    size_t s = i % p->n_slots;
+    MlpWork* w = &p->work[s];
+    Tensor x_i;
+    Tensor y_i;
+    RETURN_IF_ERROR(micro_views(p, x, y, i, &x_i, &y_i));
+    const Tensor* in = &x_i;
+    Tensor* in_grad = NULL;
+    if (p->stage > 0) {
+        in = p->input[s];
+        in_grad = p->input_grad[s];
+        MPI_Wait(&p->send_grad[s], MPI_STATUS_IGNORE);
+    }
+    Tensor* out_grad = p->output_grad[s];
+    if (p->stage + 1 == p->n_stages) {
+        size_t classes = out_grad->shape.dims[2];
+        Tensor logits;
+        Tensor loss_grad;
+        RETURN_IF_ERROR(tensor_view(&logits, mlp_logits(w)->data,
+                                    shapeN(2, p->micro, classes),
+                                    DTYPE_FLOAT32));
+        RETURN_IF_ERROR(tensor_view(&loss_grad, out_grad->data,
+                                    shapeN(2, p->micro, classes),
+                                    DTYPE_FLOAT32));
+        RETURN_IF_ERROR(cross_entropy_backward(&logits, &y_i, &loss_grad));
+    } else {
+        MPI_Wait(&p->recv_grad[s], MPI_STATUS_IGNORE);
+    }
+    RETURN_IF_ERROR(mlp_backward_from(m, w, in, out_grad, in_grad, p->grads));
+    if (p->stage > 0) {
+        MPI_Isend(in_grad->data, (int)in_grad->size, MPI_FLOAT, p->stage - 1,
+                  TAG_GRADIENT, p->stage_comm, &p->send_grad[s]);
+        post_input(p, i + p->n_slots);
+    }
+    for (size_t j = 0; j < m->n_params; ++j) {
+        RETURN_IF_ERROR(tensor_scale_and_add(
+            grads[j], 1.0f / (float)p->n_micro, p->grads[j]));
+    }
+    return 0;
+}
+
+// Every stage ends up with the last stage's loss and accuracy.
+static void finish(Pipeline* p) {
+    MPI_Waitall((int)p->n_slots, p->send_output, MPI_STATUSES_IGNORE);
+    MPI_Waitall((int)p->n_slots, p->send_grad, MPI_STATUSES_IGNORE);
+    float metrics[2] = {p->loss, p->acc};
+    MPI_Bcast(metrics, 2, MPI_FLOAT, p->n_stages - 1, p->stage_comm);
+    p->loss = metrics[0];
+    p->acc = metrics[1];
+}
+
+int pipeline_step(Pipeline* p, const Mlp* m, const Tensor* x, const Tensor* y,
+                  Tensor** grads) {
+    if (p == NULL || m == NULL || x == NULL || y == NULL || grads == NULL)
+        return 1;
+    if (x->shape.dims[0] != p->micro * p->n_micro) return 2;
+    p->n_current = p->n_micro;
+    p->loss = 0.0f;
+    p->acc = 0.0f;
+    for (size_t j = 0; j < m->n_params; ++j) {
+        RETURN_IF_ERROR(tensor_fill_float(grads[j], 0.0f));
+    }
+    for (size_t i = 0; i < p->n_slots; ++i) post_input(p, i);
+
+    // Warm up until every slot holds a micro-batch, then one forward per
+    // backward, then drain.
+    size_t f = 0;
+    size_t b = 0;
+    for (; f + 1 < p->n_slots; ++f) {
+        RETURN_IF_ERROR(forward_micro(p, m, x, y, f, true));
+    }
+    for (; f < p->n_micro; ++f, ++b) {
+        RETURN_IF_ERROR(forward_micro(p, m, x, y, f, true));
+        RETURN_IF_ERROR(backward_micro(p, m, x, y, b, grads));
+    }
+    for (; b < p->n_micro; ++b) {
+        RETURN_IF_ERROR(backward_micro(p, m, x, y, b, grads));
+    }
+    finish(p);
+    return 0;
+}
+
+int pipeline_eval(Pipeline* p, const Mlp* m, const Tensor* x,
+                  const Tensor* y) {
+    if (p == NULL || m == NULL || x == NULL || y == NULL) return 1;
+    size_t rows = y->shape.dims[0];
+    if (rows == 0 || rows > p->micro * p->n_micro) return 2;
+    p->n_current = (rows + p->micro - 1) / p->micro;
+    p->loss = 0.0f;
+    p->acc = 0.0f;
+    for (size_t i = 0; i < p->n_slots; ++i) post_input(p, i);
+    for (size_t i = 0; i < p->n_current; ++i) {
+        RETURN_IF_ERROR(forward_micro(p, m, x, y, i, false));
+    }
+    finish(p);
+    return 0;
+}
+
+static void free_tensor(Tensor* t) {
+    tensor_free(t);
+    free(t);
+}
+
+void pipeline_free(Pipeline* p) {
+    if (p == NULL || p->n_stages == 0) return;
+    for (size_t s = 0; s < p->n_slots; ++s) {
+        mlp_work_free(&p->work[s]);
+        free_tensor(p->input[s]);
+        free_tensor(p->input_grad[s]);
+        free_tensor(p->output_grad[s]);
+    }
+    for (size_t j = 0; j < MLP_MAX_PARAMS; ++j) free_tensor(p->grads[j]);
+    MPI_Comm_free(&p->stage_comm);
+    MPI_Comm_free(&p->dp_comm);
+    memset(p, 0, sizeof(*p));
+}
@@ -0,0 +1,78 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <mpi.h>
+#include <stddef.h>
+
+#include "model.h"
+#include "tensor.h"
+
+#define PIPELINE_MAX_STAGES MLP_MAX_LAYERS
+
+// Pipeline parallel training: consecutive layers of the model run on the
+// n_stages ranks of stage_comm, data parallel across groups of n_stages like
+// TpGrid. Each batch is split into n_micro micro-batches run on a one
+// forward, one backward (1F1B) schedule: stage s runs n_stages - s - 1
+// forwards ahead and then alternates, so it holds at most n_slots micro-
+// batches of activations. Activations travel forward and their gradients
+// back with nonblocking point-to-point messages.
+typedef struct {
+    MPI_Comm stage_comm;
+    MPI_Comm dp_comm;
+    int stage;
+    int n_stages;
+    int dp_rank;
+    int dp_size;
+    // Layers [layer_lo, layer_hi) of the full model live on this rank.
+    size_t layer_lo;
+    size_t layer_hi;
+    size_t n_micro;
+    size_t micro;
+    size_t n_slots;
+    // Micro-batches in the pass under way, fewer than n_micro for a short
+    // evaluation batch.
+    size_t n_current;
+    MlpWork work[PIPELINE_MAX_STAGES];
+    // Received activations and the gradients sent back for them, stage > 0.
+    Tensor* input[PIPELINE_MAX_STAGES];
+    Tensor* input_grad[PIPELINE_MAX_STAGES];
+    // Gradients of this stage's output: received, or of the loss on the
+    // last stage.
+    Tensor* output_grad[PIPELINE_MAX_STAGES];
+    MPI_Request recv_input[PIPELINE_MAX_STAGES];
+    MPI_Request recv_grad[PIPELINE_MAX_STAGES];
+    MPI_Request send_output[PIPELINE_MAX_STAGES];
+    MPI_Request send_grad[PIPELINE_MAX_STAGES];
+    // One micro-batch's gradients.
+    Tensor* grads[MLP_MAX_PARAMS];
+    // Mean over the micro-batches of the last step, or sums over the
+    // samples of the last evaluation, on every stage.
+    float loss;
+    float acc;
+} Pipeline;
+
+int pipeline_init(Pipeline* p, MPI_Comm comm, int n_stages);
+
+// Replaces m by this rank's stage, layers split as evenly as they go. Every
+// rank passes the same full model.
+int pipeline_shard_mlp(Pipeline* p, Mlp* m);
+
+// Buffers for batches of `batch` samples in n_micro micro-batches; m is the
+// stage.
+int pipeline_work_init(Pipeline* p, const Mlp* m, size_t batch,
+                       size_t n_micro, size_t checkpoint_every);
+
+// One forward and backward pass over the batch (x is read on the first
+// stage, y on the last). grads receives the stage's gradients of the mean
+// loss over the whole batch.
+int pipeline_step(Pipeline* p, const Mlp* m, const Tensor* x, const Tensor* y,
+                  Tensor** grads);
+
+// Forward only over up to the step's batch size of samples, the last
+// micro-batch possibly short, for the loss and correct count sums.
+int pipeline_eval(Pipeline* p, const Mlp* m, const Tensor* x,
+                  const Tensor* y);
+
+void pipeline_free(Pipeline* p);
+
+#endif
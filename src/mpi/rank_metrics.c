@@ -0,0 +1,71 @@
+#include "rank_metrics.h"
+
+#include <string.h>
+
+#include "utils.h"
+
+int rank_metrics_init(RankMetrics* rm, size_t every, MPI_Comm comm,
+                      MetricsWriter* writer) {
+    if (rm == NULL || every == 0) return 1;
+    memset(rm, 0, sizeof(*rm));
+    rm->comm = comm;
+    rm->every = every;
+    rm->writer = writer;
+    rm->request = MPI_REQUEST_NULL;
+    rm->interval_start = wall_time();
+    rm->epoch_start = rm->interval_start;
+    return 0;
+}
+
+static void complete(RankMetrics* rm, bool wait) {
+    if (rm->request == MPI_REQUEST_NULL) return;
+    int done = 1;
+    if (wait) {
+        MPI_Wait(&rm->request, MPI_STATUS_IGNORE);
+    } else {
+        MPI_Test(&rm->request, &done, MPI_STATUS_IGNORE);
+    }
+    if (!done || rm->writer == NULL) return;
+    rm->pending.sums = rm->total;
+    metrics_writer_push(rm->writer, &rm->pending);
+}
+
+static void post(RankMetrics* rm, const MetricsSums* s, size_t epoch,
+                 size_t step, bool epoch_end, double seconds) {
+    // Long done by now, short of a very small `every`.
+    complete(rm, true);
+    rm->sent = *s;
+    rm->pending =
+        (MetricsRecord){epoch, step, epoch_end, seconds, {0, 0, 0}, -1};
+    MPI_Ireduce(&rm->sent, &rm->total, 3, MPI_DOUBLE, MPI_SUM, 0, rm->comm,
+                &rm->request);
+}
+
+void rank_metrics_step(RankMetrics* rm, float loss, float acc, size_t n,
+                       size_t epoch, size_t step) {
+    complete(rm, false);
+    metrics_add(&rm->interval, loss, acc, n);
+    metrics_add(&rm->epoch, loss, acc, n);
+    if (++rm->since < rm->every) return;
+    double now = wall_time();
+    post(rm, &rm->interval, epoch, step, false, now - rm->interval_start);
+    memset(&rm->interval, 0, sizeof(rm->interval));
+    rm->interval_start = now;
+    rm->since = 0;
+}
+
+void rank_metrics_end_epoch(RankMetrics* rm, size_t epoch, size_t step) {
+    double now = wall_time();
+    post(rm, &rm->epoch, epoch, step, true, now - rm->epoch_start);
+    memset(&rm->interval, 0, sizeof(rm->interval));
+    memset(&rm->epoch, 0, sizeof(rm->epoch));
+    rm->interval_start = now;
+    rm->epoch_start = now;
+    rm->since = 0;
+}
+
+void rank_metrics_free(RankMetrics* rm) {
+    if (rm == NULL || rm->every == 0) return;
+    complete(rm, true);
+    memset(rm, 0, sizeof(*rm));
+}
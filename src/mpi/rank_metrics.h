@@ -0,0 +1,44 @@
+#ifndef RANK_METRICS_H
+#define RANK_METRICS_H
+
+#include <mpi.h>
+#include <stddef.h>
+
+#include "metrics.h"
+
+// Training metrics summed over the ranks of comm. Every `every` steps, and
+// at the end of each epoch, the sums go to rank 0 in one small MPI_Ireduce
+// that nobody waits for: rank 0 passes the result to its writer once a
+// later step finds it complete.
+typedef struct {
+    MPI_Comm comm;
+    size_t every;
+    size_t since;
+    MetricsSums interval;
+    MetricsSums epoch;
+    double interval_start;
+    double epoch_start;
+    // The reduction in flight and the record it completes.
+    MetricsSums sent;
+    MetricsSums total;
+    MPI_Request request;
+    MetricsRecord pending;
+    // Rank 0 only, NULL elsewhere.
+    MetricsWriter* writer;
+} RankMetrics;
+
+int rank_metrics_init(RankMetrics* rm, size_t every, MPI_Comm comm,
+                      MetricsWriter* writer);
+
+// After every step with its mean loss and accuracy over this rank's n
+// samples; collective every `every` calls.
+void rank_metrics_step(RankMetrics* rm, float loss, float acc, size_t n,
+                       size_t epoch, size_t step);
+
+// Collective.
+void rank_metrics_end_epoch(RankMetrics* rm, size_t epoch, size_t step);
+
+// Completes the last reduction.
+void rank_metrics_free(RankMetrics* rm);
+
+#endif
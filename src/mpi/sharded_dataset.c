@@ -0,0 +1,115 @@
+#include "sharded_dataset.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tensor.h"
+
+int shard_layout_parse(const char* name, ShardLayout* layout) {
+    if (name == NULL || layout == NULL) return 1;
+    if (strcmp(name, "block") == 0) {
+        *layout = SHARD_BLOCK;
+    } else if (strcmp(name, "strided") == 0) {
+        *layout = SHARD_STRIDED;
+    } else {
+        return 2;
+    }
+    return 0;
+}
+
+void shard_rows(ShardLayout layout, size_t n, int rank, int size,
+                size_t* first, size_t* count, size_t* stride) {
+    if (layout == SHARD_BLOCK) {
+        *first = n * (size_t)rank / (size_t)size;
+        *count = n * (size_t)(rank + 1) / (size_t)size - *first;
+        *stride = 1;
+    } else {
+        *first = (size_t)rank;
+        *count = (size_t)rank < n ? (n - (size_t)rank + size - 1) / size : 0;
+        *stride = (size_t)size;
+    }
+}
+
+// Collective read of `count` rows of row_bytes each, `stride` rows apart
+// starting at row `first`.
+static int read_rows(const char* path, MPI_Comm comm, size_t row_bytes,
+                     size_t first, size_t count, size_t stride, void* dest) {
+    MPI_File fh;
+    if (MPI_File_open(comm, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) !=
+        MPI_SUCCESS) {
+        return 1;
+    }
+    MPI_Datatype row;
+    MPI_Datatype rows;
+    MPI_Type_contiguous((int)row_bytes, MPI_BYTE, &row);
+    MPI_Type_commit(&row);
+    MPI_Type_vector((int)count, 1, (int)stride, row, &rows);
+    MPI_Type_commit(&rows);
+    int err = MPI_File_set_view(fh, (MPI_Offset)(first * row_bytes), MPI_BYTE,
+                                rows, "native", MPI_INFO_NULL);
+    MPI_Status status;
+    if (err == MPI_SUCCESS) {
+        err = MPI_File_read_at_all(fh, 0, dest, (int)count, row, &status);
+    }
+    int got = 0;
+    if (err == MPI_SUCCESS) MPI_Get_count(&status, row, &got);
+    MPI_Type_free(&rows);
+    MPI_Type_free(&row);
+    MPI_File_close(&fh);
+    if (err != MPI_SUCCESS) return 2;
+    return (size_t)got == count ? 0 : 3;
+}
+
+int dataset_load_shard(const char* labels_path, const char* data_path,
+                       MPI_Comm comm, ShardLayout layout, Dataset* out,
+                       size_t* n_total) {
+    if (out == NULL || n_total == NULL) return 1;
+    int rank;
+    int size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    // One label byte per row.
+    MPI_File fh;
+    if (MPI_File_open(comm, labels_path, MPI_MODE_RDONLY, MPI_INFO_NULL,
+                      &fh) != MPI_SUCCESS) {
+        return 2;
+    }
+    MPI_Offset labels_bytes = 0;
+    MPI_File_get_size(fh, &labels_bytes);
+    MPI_File_close(&fh);
+    size_t n = (size_t)labels_bytes;
+
+    size_t first;
+    size_t count;
+    size_t stride;
+    shard_rows(layout, n, rank, size, &first, &count, &stride);
+
+    Tensor* x = tensor_alloc(shapeN(2, count, IMG_SIZE), DTYPE_FLOAT32);
+    Tensor* y = tensor_alloc(shapeN(1, count), DTYPE_UINT8);
+    if (x == NULL || y == NULL) return 3;
+    int err = read_rows(data_path, comm, IMG_SIZE * sizeof(float), first,
+                        count, stride, x->data);
+    if (err == 0) {
+        err = read_rows(labels_path, comm, 1, first, count, stride, y->data);
+    }
+    // A short data file on any rank fails the load everywhere.
+    MPI_Allreduce(MPI_IN_PLACE, &err, 1, MPI_INT, MPI_MAX, comm);
+    out->n = count;
+    out->x = x;
+    out->y = y;
+    if (err) {
+        dataset_shard_free(out);
+        return 4;
+    }
+    *n_total = n;
+    return 0;
+}
+
+void dataset_shard_free(Dataset* d) {
+    if (d == NULL) return;
+    tensor_free(d->x);
+    tensor_free(d->y);
+    dataset_free(d);
+}
@@ -0,0 +1,33 @@
+#ifndef SHARDED_DATASET_H
+#define SHARDED_DATASET_H
+
+#include <mpi.h>
+#include <stddef.h>
+
+#include "dataset.h"
+
+// Which rows of the files a rank of W owns: block takes the r-th contiguous
+// n / W of them, strided takes rows r, r + W, r + 2W, ...
+typedef enum {
+    SHARD_BLOCK = 0,
+    SHARD_STRIDED,
+} ShardLayout;
+
+int shard_layout_parse(const char* name, ShardLayout* layout);
+
+// Rows a rank owns out of n: `count` of them starting at row `first`,
+// `stride` rows apart.
+void shard_rows(ShardLayout layout, size_t n, int rank, int size,
+                size_t* first, size_t* count, size_t* stride);
+
+// Reads only this rank's rows of the binary files with collective MPI-IO
+// reads over comm. out->n is the local row count and n_total the count over
+// all ranks.
+int dataset_load_shard(const char* labels_path, const char* data_path,
+                       MPI_Comm comm, ShardLayout layout, Dataset* out,
+                       size_t* n_total);
+
+// Frees the rows as well as the tensors.
+void dataset_shard_free(Dataset* d);
+
+#endif
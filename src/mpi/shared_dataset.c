@@ -0,0 +1,78 @@
+#include "shared_dataset.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tensor.h"
+#include "utils.h"
+
+int shared_dataset_load_bin(const char* labels_path, const char* data_path,
+                            MPI_Comm node_comm, SharedDataset* out) {
+    if (out == NULL) return 1;
+    memset(out, 0, sizeof(*out));
+    out->win = MPI_WIN_NULL;
+    int rank;
+    MPI_Comm_rank(node_comm, &rank);
+
+    // n and an error code, decided on node rank 0.
+    unsigned long long header[2] = {0, 0};
+    if (rank == 0) {
+        size_t n = 0;
+        size_t data_bytes = 0;
+        if (file_size(labels_path, &n) || file_size(data_path, &data_bytes)) {
+            header[1] = 2;
+        } else if (data_bytes != n * IMG_SIZE * sizeof(float)) {
+            header[1] = 3;
+        }
+        header[0] = n;
+    }
+    MPI_Bcast(header, 2, MPI_UNSIGNED_LONG_LONG, 0, node_comm);
+    if (header[1] != 0) return (int)header[1];
+
+    size_t n = (size_t)header[0];
+    size_t data_bytes = n * IMG_SIZE * sizeof(float);
+    MPI_Aint bytes = rank == 0 ? (MPI_Aint)(data_bytes + n) : 0;
+    uint8_t* base = NULL;
+    if (MPI_Win_allocate_shared(bytes, 1, MPI_INFO_NULL, node_comm, &base,
+                                &out->win) != MPI_SUCCESS) {
+        return 4;
+    }
+    MPI_Aint shared_bytes;
+    int disp_unit;
+    uint8_t* shared = NULL;
+    MPI_Win_shared_query(out->win, 0, &shared_bytes, &disp_unit, &shared);
+
+    MPI_Win_fence(0, out->win);
+    int err = 0;
+    if (rank == 0) {
+        if (read_into(data_path, shared, data_bytes) ||
+            read_into(labels_path, shared + data_bytes, n)) {
+            err = 5;
+        }
+    }
+    MPI_Win_fence(0, out->win);
+    MPI_Bcast(&err, 1, MPI_INT, 0, node_comm);
+    if (err) return err;
+
+    Tensor* x = (Tensor*)malloc(sizeof(Tensor));
+    Tensor* y = (Tensor*)malloc(sizeof(Tensor));
+    if (x == NULL || y == NULL) {
+        free(x);
+        free(y);
+        return 6;
+    }
+    tensor_view(x, shared, shapeN(2, n, IMG_SIZE), DTYPE_FLOAT32);
+    tensor_view(y, shared + data_bytes, shapeN(1, n), DTYPE_UINT8);
+    out->d.n = n;
+    out->d.x = x;
+    out->d.y = y;
+    return 0;
+}
+
+void shared_dataset_free(SharedDataset* s) {
+    if (s == NULL) return;
+    // Only the tensor headers are ours; the rows go with the window.
+    dataset_free(&s->d);
+    if (s->win != MPI_WIN_NULL) MPI_Win_free(&s->win);
+}
@@ -0,0 +1,24 @@
+#ifndef SHARED_DATASET_H
+#define SHARED_DATASET_H
+
+#include <mpi.h>
+
+#include "dataset.h"
+
+// A dataset held once per node in an MPI shared memory window. d.x and d.y
+// view the window and must not be written, so shuffle with
+// dataset_rand_perm_index and gather batches by row number instead of
+// dataset_rand_perm.
+typedef struct {
+    Dataset d;
+    MPI_Win win;
+} SharedDataset;
+
+// Node rank 0 of node_comm reads the files straight into the window; the
+// other ranks only map it.
+int shared_dataset_load_bin(const char* labels_path, const char* data_path,
+                            MPI_Comm node_comm, SharedDataset* out);
+
+void shared_dataset_free(SharedDataset* s);
+
+#endif
@@ -0,0 +1,147 @@
+#include "sparse_grads.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "topk.h"
+#include "trace.h"
+
+int sparse_grads_init(SparseGrads* s, const Mlp* m, Tensor** grads,
+                      float fraction, float threshold, MPI_Comm comm) {
+    if (s == NULL || m == NULL || grads == NULL) return 1;
+    if (fraction < 0.0f || fraction > 1.0f || threshold < 0.0f) return 1;
+    memset(s, 0, sizeof(*s));
+    s->grads = grads;
+    s->n_params = m->n_params;
+    s->comm = comm;
+    s->fraction = fraction;
+    s->threshold = threshold;
+    s->entry_type = MPI_DATATYPE_NULL;
+    MPI_Comm_rank(comm, &s->rank);
+    MPI_Comm_size(comm, &s->size);
+
+    size_t largest = 0;
+    for (size_t p = 0; p < s->n_params; ++p) {
+        s->offsets[p + 1] = s->offsets[p] + grads[p]->size;
+        if (grads[p]->size > largest) largest = grads[p]->size;
+        s->residual[p] = (float*)calloc(grads[p]->size, sizeof(float));
+        if (s->residual[p] == NULL) return 2;
+    }
+    size_t total = s->offsets[s->n_params];
+    if (total > UINT32_MAX) return 3;
+    s->magnitude = (float*)malloc(largest * sizeof(float));
+    s->picked = (size_t*)malloc(largest * sizeof(size_t));
+    s->send = (SparseEntry*)malloc(total * sizeof(SparseEntry));
+    s->counts = (int*)malloc(s->size * sizeof(int));
+    s->displs = (int*)malloc(s->size * sizeof(int));
+    if (s->magnitude == NULL || s->picked == NULL || s->send == NULL ||
+        s->counts == NULL || s->displs == NULL) {
+        return 2;
+    }
+
+    int lengths[2] = {1, 1};
+    MPI_Aint disps[2] = {offsetof(SparseEntry, index),
+                         offsetof(SparseEntry, value)};
+    MPI_Datatype types[2] = {MPI_UINT32_T, MPI_FLOAT};
+    MPI_Datatype entry;
+    MPI_Type_create_struct(2, lengths, disps, types, &entry);
+    MPI_Type_create_resized(entry, 0, sizeof(SparseEntry), &s->entry_type);
+    MPI_Type_free(&entry);
+    MPI_Type_commit(&s->entry_type);
+    return 0;
+}
+
+void sparse_grads_free(SparseGrads* s) {
+    if (s == NULL) return;
+    if (s->send != NULL && s->entry_type != MPI_DATATYPE_NULL) {
+        MPI_Type_free(&s->entry_type);
+    }
+    for (size_t p = 0; p < s->n_params; ++p) free(s->residual[p]);
+    free(s->magnitude);
+    free(s->picked);
+    free(s->send);
+    free(s->recv);
+    free(s->counts);
+    free(s->displs);
+    memset(s, 0, sizeof(*s));
+}
+
+// Moves the selected entries of residual p to the send list.
+static void select_entries(SparseGrads* s, size_t p) {
+    float* r = s->residual[p];
+    size_t n = s->grads[p]->size;
+    size_t k = n;
+    if (s->fraction > 0.0f) {
+        k = (size_t)ceilf(s->fraction * (float)n);
+        if (k == 0) k = 1;
+        if (k > n) k = n;
+    }
+    size_t n_picked = topk_select(r, n, k, s->threshold, s->magnitude,
+                                  s->picked);
+    for (size_t j = 0; j < n_picked; ++j) {
+        size_t i = s->picked[j];
+        SparseEntry* e = &s->send[s->n_send++];
+        e->index = (uint32_t)(s->offsets[p] + i);
+        e->value = r[i];
+        r[i] = 0.0f;
+    }
+}
+
+int sparse_grads_reduce(SparseGrads* s) {
+    if (s == NULL) return 1;
+    s->n_send = 0;
+    for (size_t p = 0; p < s->n_params; ++p) {
+        const float* g = (const float*)s->grads[p]->data;
+        float* r = s->residual[p];
+        for (size_t i = 0; i < s->grads[p]->size; ++i) r[i] += g[i];
+        select_entries(s, p);
+    }
+
+    int n_send = (int)s->n_send;
+    double t0 = trace_now();
+    MPI_Allgather(&n_send, 1, MPI_INT, s->counts, 1, MPI_INT, s->comm);
+    size_t n_recv = 0;
+    for (int i = 0; i < s->size; ++i) {
+        s->displs[i] = (int)n_recv;
+        n_recv += (size_t)s->counts[i];
+    }
+    if (n_recv > s->recv_capacity) {
+        SparseEntry* recv =
+            (SparseEntry*)realloc(s->recv, n_recv * sizeof(SparseEntry));
+        if (recv == NULL) return 2;
+        s->recv = recv;
+        s->recv_capacity = n_recv;
+    }
+    MPI_Allgatherv(s->send, n_send, s->entry_type, s->recv, s->counts,
+                   s->displs, s->entry_type, s->comm);
+    trace_span("sparse allgather", t0);
+    s->sent_bytes += sizeof(int) + s->n_send * sizeof(SparseEntry);
+    s->n_steps++;
+
+    for (size_t p = 0; p < s->n_params; ++p) {
+        memset(s->grads[p]->data, 0, s->grads[p]->size * sizeof(float));
+    }
+    // Each rank's list is in index order, so the owning parameter only moves
+    // forward within it.
+    for (int i = 0; i < s->size; ++i) {
+        const SparseEntry* e = s->recv + s->displs[i];
+        size_t p = 0;
+        for (int j = 0; j < s->counts[i]; ++j) {
+            while (p < s->n_params && e[j].index >= s->offsets[p + 1]) ++p;
+            if (p >= s->n_params) return 3;
+            float* g = (float*)s->grads[p]->data;
+            g[e[j].index - s->offsets[p]] += e[j].value;
+        }
+    }
+    return 0;
+}
+
+size_t sparse_grads_mean_bytes(const SparseGrads* s) {
+    unsigned long long per_step =
+        s->n_steps > 0 ? s->sent_bytes / s->n_steps : 0;
+    unsigned long long sum = 0;
+    MPI_Allreduce(&per_step, &sum, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM,
+                  s->comm);
+    return (size_t)(sum / (unsigned long long)s->size);
+}
@@ -0,0 +1,57 @@
+#ifndef SPARSE_GRADS_H
+#define SPARSE_GRADS_H
+
+#include <mpi.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "model.h"
+#include "tensor.h"
+
+// Position in the concatenation of all gradients, and the value there.
+typedef struct {
+    uint32_t index;
+    float value;
+} SparseEntry;
+
+// Sums gradients over comm by sending only the largest entries. Each rank
+// adds its gradient into a residual, sends the top `fraction` of every
+// parameter's residual by magnitude (all of them with fraction 0), dropping
+// those below `threshold`, and keeps what it did not send for later steps.
+// The pairs of all ranks are allgathered and summed in rank order, so every
+// rank gets the same gradient.
+typedef struct {
+    Tensor** grads;
+    size_t n_params;
+    MPI_Comm comm;
+    int rank;
+    int size;
+    float fraction;
+    float threshold;
+    float* residual[MLP_MAX_PARAMS];
+    size_t offsets[MLP_MAX_PARAMS + 1];
+    float* magnitude;
+    size_t* picked;
+    SparseEntry* send;
+    size_t n_send;
+    SparseEntry* recv;
+    size_t recv_capacity;
+    int* counts;
+    int* displs;
+    MPI_Datatype entry_type;
+    size_t sent_bytes;
+    size_t n_steps;
+} SparseGrads;
+
+int sparse_grads_init(SparseGrads* s, const Mlp* m, Tensor** grads,
+                      float fraction, float threshold, MPI_Comm comm);
+
+void sparse_grads_free(SparseGrads* s);
+
+// Replaces every gradient with the sparse sum over all ranks.
+int sparse_grads_reduce(SparseGrads* s);
+
+// Mean bytes sent per step and rank, over all ranks. Collective.
+size_t sparse_grads_mean_bytes(const SparseGrads* s);
+
+#endif
@@ -0,0 +1,286 @@
+#include "streamed_dataset.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tensor.h"
+#include "utils.h"
+
+#define X_ROW_BYTES (IMG_SIZE * sizeof(float))
+
+// Rows of chunk k that rank r receives, as [lo, hi) of its local rows.
+static void chunk_rows(const StreamedDataset* s, size_t k, int r, size_t* lo,
+                       size_t* hi) {
+    size_t count = s->n_total;
+    if (s->scatter) {
+        size_t first;
+        size_t stride;
+        shard_rows(s->layout, s->n_total, r, s->size, &first, &count, &stride);
+    }
+    *lo = k * STREAM_CHUNK_ROWS;
+    *hi = *lo + STREAM_CHUNK_ROWS;
+    if (*lo > count) *lo = count;
+    if (*hi > count) *hi = count;
+}
+
+static int read_at(FILE* f, size_t offset, void* dest, size_t bytes) {
+    if (bytes == 0) return 0;
+    if (fseek(f, (long)offset, SEEK_SET)) return 1;
+    return fread(dest, 1, bytes, f) == bytes ? 0 : 2;
+}
+
+// Lays chunk k of every rank's shard out back to back in staging, in rank
+// order, from a file of row_bytes rows.
+static int read_chunk(StreamedDataset* s, FILE* f, size_t row_bytes, size_t k,
+                      uint8_t* staging, const int* displs) {
+    if (s->layout == SHARD_BLOCK) {
+        for (int r = 0; r < s->size; ++r) {
+            size_t first;
+            size_t count;
+            size_t stride;
+            size_t lo;
+            size_t hi;
+            shard_rows(s->layout, s->n_total, r, s->size, &first, &count,
+                       &stride);
+            chunk_rows(s, k, r, &lo, &hi);
+            RETURN_IF_ERROR(read_at(f, (first + lo) * row_bytes,
+                                    staging + (size_t)displs[r] * row_bytes,
+                                    (hi - lo) * row_bytes));
+        }
+        return 0;
+    }
+    // Strided: the chunk is one run of the file, dealt out row by row.
+    size_t size = (size_t)s->size;
+    size_t start = k * STREAM_CHUNK_ROWS * size;
+    size_t end = start + STREAM_CHUNK_ROWS * size;
+    if (end > s->n_total) end = s->n_total;
+    if (start >= end) return 0;
+    RETURN_IF_ERROR(
+        read_at(f, start * row_bytes, s->span, (end - start) * row_bytes));
+    for (size_t g = start; g < end; ++g) {
+        int r = (int)(g % size);
+        size_t j = g / size - k * STREAM_CHUNK_ROWS;
+        memcpy(staging + ((size_t)displs[r] + j) * row_bytes,
+               s->span + (g - start) * row_bytes, row_bytes);
+    }
+    return 0;
+}
+
+// Never fails on its own: a read error on rank 0 goes out as the chunk's
+// status after the rows, which are then garbage.
+static void post_chunk(StreamedDataset* s, size_t k) {
+    MPI_Request* req = s->requests + STREAM_CHUNK_REQUESTS * k;
+    int* status = &s->status[k];
+    size_t lo;
+    size_t hi;
+    chunk_rows(s, k, s->rank, &lo, &hi);
+    uint8_t* x = (uint8_t*)s->d.x->data + lo * X_ROW_BYTES;
+    uint8_t* y = (uint8_t*)s->d.y->data + lo;
+    int n = (int)(hi - lo);
+
+    if (!s->scatter) {
+        if (s->rank == 0) {
+            *status = read_at(s->data_file, lo * X_ROW_BYTES, x,
+                              (hi - lo) * X_ROW_BYTES);
+            if (*status == 0) {
+                *status = read_at(s->labels_file, lo, y, hi - lo);
+            }
+        }
+        MPI_Ibcast(x, n, s->row_type, 0, s->comm, &req[0]);
+        MPI_Ibcast(y, n, MPI_BYTE, 0, s->comm, &req[1]);
+        MPI_Ibcast(status, 1, MPI_INT, 0, s->comm, &req[2]);
+        return;
+    }
+    if (s->rank != 0) {
+        MPI_Iscatterv(NULL, NULL, NULL, s->row_type, x, n, s->row_type, 0,
+                      s->comm, &req[0]);
+        MPI_Iscatterv(NULL, NULL, NULL, MPI_BYTE, y, n, MPI_BYTE, 0, s->comm,
+                      &req[1]);
+        MPI_Ibcast(status, 1, MPI_INT, 0, s->comm, &req[2]);
+        return;
+    }
+
+    // The slot's buffers and counts are in use until its last chunk is sent.
+    size_t slot = k % STREAM_IN_FLIGHT;
+    if (k >= STREAM_IN_FLIGHT) {
+        MPI_Waitall(STREAM_CHUNK_REQUESTS,
+                    s->requests +
+                        STREAM_CHUNK_REQUESTS * (k - STREAM_IN_FLIGHT),
+                    MPI_STATUSES_IGNORE);
+    }
+    int* counts = s->counts + slot * (size_t)s->size;
+    int* displs = s->displs + slot * (size_t)s->size;
+    int total = 0;
+    for (int r = 0; r < s->size; ++r) {
+        size_t r_lo;
+        size_t r_hi;
+        chunk_rows(s, k, r, &r_lo, &r_hi);
+        counts[r] = (int)(r_hi - r_lo);
+        displs[r] = total;
+        total += counts[r];
+    }
+    size_t rows = STREAM_CHUNK_ROWS * (size_t)s->size;
+    uint8_t* staging_x = s->staging_x + slot * rows * X_ROW_BYTES;
+    uint8_t* staging_y = s->staging_y + slot * rows;
+    *status = read_chunk(s, s->data_file, X_ROW_BYTES, k, staging_x, displs);
+    if (*status == 0) {
+        *status = read_chunk(s, s->labels_file, 1, k, staging_y, displs);
+    }
+    MPI_Iscatterv(staging_x, counts, displs, s->row_type, x, n, s->row_type, 0,
+                  s->comm, &req[0]);
+    MPI_Iscatterv(staging_y, counts, displs, MPI_BYTE, y, n, MPI_BYTE, 0,
+                  s->comm, &req[1]);
+    MPI_Ibcast(status, 1, MPI_INT, 0, s->comm, &req[2]);
+}
+
+static int stream_open(const char* labels_path, const char* data_path,
+                       MPI_Comm comm, bool scatter, ShardLayout layout,
+                       StreamedDataset* s) {
+    if (s == NULL) return 1;
+    memset(s, 0, sizeof(*s));
+    s->scatter = scatter;
+    s->layout = layout;
+    MPI_Comm_dup(comm, &s->comm);
+    MPI_Comm_rank(s->comm, &s->rank);
+    MPI_Comm_size(s->comm, &s->size);
+
+    // n and an error code, decided on rank 0.
+    unsigned long long header[2] = {0, 0};
+    if (s->rank == 0) {
+        size_t n = 0;
+        size_t data_bytes = 0;
+        s->labels_file = fopen(labels_path, "rb");
+        s->data_file = fopen(data_path, "rb");
+        if (s->labels_file == NULL || s->data_file == NULL ||
+            file_size(labels_path, &n) || file_size(data_path, &data_bytes)) {
+            header[1] = 2;
+        } else if (data_bytes != n * X_ROW_BYTES) {
+            header[1] = 3;
+        }
+        header[0] = n;
+    }
+    MPI_Bcast(header, 2, MPI_UNSIGNED_LONG_LONG, 0, s->comm);
+    if (header[1] != 0) return (int)header[1];
+    s->n_total = (size_t)header[0];
+
+    size_t count = s->n_total;
+    size_t largest = count;
+    if (scatter) {
+        size_t first;
+        size_t stride;
+        shard_rows(layout, s->n_total, s->rank, s->size, &first, &count,
+                   &stride);
+        largest = 0;
+        for (int r = 0; r < s->size; ++r) {
+            size_t r_count;
+            shard_rows(layout, s->n_total, r, s->size, &first, &r_count,
+                       &stride);
+            if (r_count > largest) largest = r_count;
+        }
+    }
+    s->n_chunks = (largest + STREAM_CHUNK_ROWS - 1) / STREAM_CHUNK_ROWS;
+    s->d.n = count;
+    s->d.x = tensor_alloc(shapeN(2, count, IMG_SIZE), DTYPE_FLOAT32);
+    s->d.y = tensor_alloc(shapeN(1, count), DTYPE_UINT8);
+    s->requests = (MPI_Request*)malloc(
+        STREAM_CHUNK_REQUESTS * (s->n_chunks + 1) * sizeof(MPI_Request));
+    s->status = (int*)calloc(s->n_chunks + 1, sizeof(int));
+    if (s->d.x == NULL || s->d.y == NULL || s->requests == NULL ||
+        s->status == NULL) {
+        return 4;
+    }
+    for (size_t i = 0; i < STREAM_CHUNK_REQUESTS * s->n_chunks; ++i) {
+        s->requests[i] = MPI_REQUEST_NULL;
+    }
+    MPI_Type_contiguous((int)X_ROW_BYTES, MPI_BYTE, &s->row_type);
+    MPI_Type_commit(&s->row_type);
+
+    if (scatter && s->rank == 0) {
+        size_t rows = STREAM_CHUNK_ROWS * (size_t)s->size;
+        s->staging_x = (uint8_t*)malloc(STREAM_IN_FLIGHT * rows * X_ROW_BYTES);
+        s->staging_y = (uint8_t*)malloc(STREAM_IN_FLIGHT * rows);
+        s->span = (uint8_t*)malloc(rows * X_ROW_BYTES);
+        s->counts = (int*)malloc(STREAM_IN_FLIGHT * s->size * sizeof(int));
+        s->displs = (int*)malloc(STREAM_IN_FLIGHT * s->size * sizeof(int));
+        if (s->staging_x == NULL || s->staging_y == NULL || s->span == NULL ||
+            s->counts == NULL || s->displs == NULL) {
+            return 4;
+        }
+    }
+    if (s->rank != 0) {
+        for (; s->n_posted < s->n_chunks; ++s->n_posted) {
+            post_chunk(s, s->n_posted);
+        }
+    }
+    return streamed_dataset_wait(s, 0);
+}
+
+int streamed_dataset_scatter(const char* labels_path, const char* data_path,
+                             MPI_Comm comm, ShardLayout layout,
+                             StreamedDataset* out) {
+    return stream_open(labels_path, data_path, comm, true, layout, out);
+}
+
+int streamed_dataset_bcast(const char* labels_path, const char* data_path,
+                           MPI_Comm comm, StreamedDataset* out) {
+    return stream_open(labels_path, data_path, comm, false, SHARD_BLOCK, out);
+}
+
+int streamed_dataset_wait(StreamedDataset* s, size_t rows) {
+    if (s == NULL) return 1;
+    if (rows > s->d.n) rows = s->d.n;
+    size_t needed = (rows + STREAM_CHUNK_ROWS - 1) / STREAM_CHUNK_ROWS;
+    if (s->rank == 0) {
+        size_t ahead = needed + STREAM_IN_FLIGHT - 1;
+        if (ahead > s->n_chunks) ahead = s->n_chunks;
+        for (; s->n_posted < ahead; ++s->n_posted) {
+            post_chunk(s, s->n_posted);
+        }
+    }
+    if (needed > s->n_done) {
+        MPI_Waitall((int)(STREAM_CHUNK_REQUESTS * (needed - s->n_done)),
+                    s->requests + STREAM_CHUNK_REQUESTS * s->n_done,
+                    MPI_STATUSES_IGNORE);
+        for (; s->n_done < needed; ++s->n_done) {
+            // Every rank sees the same status, so all of them fail.
+            if (s->status[s->n_done] != 0) return 5;
+        }
+    }
+    return 0;
+}
+
+int streamed_dataset_shuffle_chunks(const StreamedDataset* s, size_t* order,
+                                    RNG* r) {
+    if (s == NULL || order == NULL) return 1;
+    for (size_t lo = 0; lo < s->d.n; lo += STREAM_CHUNK_ROWS) {
+        size_t n = s->d.n - lo;
+        if (n > STREAM_CHUNK_ROWS) n = STREAM_CHUNK_ROWS;
+        RETURN_IF_ERROR(dataset_rand_perm_index(order + lo, n, r));
+    }
+    return 0;
+}
+
+void streamed_dataset_free(StreamedDataset* s) {
+    if (s == NULL || s->comm == MPI_COMM_NULL || s->requests == NULL) return;
+    // Rank 0 still has to send whatever nobody waited for.
+    if (s->rank == 0) {
+        for (; s->n_posted < s->n_chunks; ++s->n_posted) {
+            post_chunk(s, s->n_posted);
+        }
+    }
+    MPI_Waitall((int)(STREAM_CHUNK_REQUESTS * s->n_posted), s->requests,
+                MPI_STATUSES_IGNORE);
+    if (s->data_file) fclose(s->data_file);
+    if (s->labels_file) fclose(s->labels_file);
+    free(s->staging_x);
+    free(s->staging_y);
+    free(s->span);
+    free(s->counts);
+    free(s->displs);
+    free(s->requests);
+    free(s->status);
+    MPI_Type_free(&s->row_type);
+    MPI_Comm_free(&s->comm);
+    dataset_shard_free(&s->d);
+    memset(s, 0, sizeof(*s));
+}
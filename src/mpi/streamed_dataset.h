@@ -0,0 +1,72 @@
+#ifndef STREAMED_DATASET_H
+#define STREAMED_DATASET_H
+
+#include <mpi.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "dataset.h"
+#include "rng.h"
+#include "sharded_dataset.h"
+
+// Rows per chunk and rank, and chunks rank 0 keeps in flight.
+#define STREAM_CHUNK_ROWS 1024
+#define STREAM_IN_FLIGHT 4
+#define STREAM_CHUNK_REQUESTS 3
+
+// A dataset only rank 0 can read, streamed to the others in chunks over a
+// private duplicate of comm. Scattered, every rank gets its shard as in
+// dataset_load_shard through one MPI_Iscatterv per chunk; broadcast, every
+// rank gets all rows through MPI_Ibcast. Receivers post every chunk up
+// front; rank 0 reads and sends a chunk whenever a wait needs it, keeping up
+// to STREAM_IN_FLIGHT ahead, so training can start on the first chunk.
+// d.x and d.y are allocated in full but only rows
+// [0, n_done * STREAM_CHUNK_ROWS) are valid until the stream is done. Each
+// chunk carries rank 0's read status, so a failed read fails the wait on
+// every rank instead of leaving the receivers blocked.
+typedef struct {
+    Dataset d;
+    size_t n_total;
+    MPI_Comm comm;
+    int rank;
+    int size;
+    bool scatter;
+    ShardLayout layout;
+    size_t n_chunks;
+    size_t n_posted;
+    size_t n_done;
+    // STREAM_CHUNK_REQUESTS per chunk: rows, labels and status.
+    MPI_Request* requests;
+    int* status;
+    MPI_Datatype row_type;
+    // Rank 0 only.
+    FILE* data_file;
+    FILE* labels_file;
+    uint8_t* staging_x;
+    uint8_t* staging_y;
+    uint8_t* span;
+    int* counts;
+    int* displs;
+} StreamedDataset;
+
+int streamed_dataset_scatter(const char* labels_path, const char* data_path,
+                             MPI_Comm comm, ShardLayout layout,
+                             StreamedDataset* out);
+
+int streamed_dataset_bcast(const char* labels_path, const char* data_path,
+                           MPI_Comm comm, StreamedDataset* out);
+
+// Blocks until local rows [0, rows) are in. Collective in the sense that
+// rank 0 only sends from inside these calls.
+int streamed_dataset_wait(StreamedDataset* s, size_t rows);
+
+// Shuffles order[0..d.n) within each chunk only, so a prefix of it never
+// refers to rows that have not arrived yet.
+int streamed_dataset_shuffle_chunks(const StreamedDataset* s, size_t* order,
+                                    RNG* r);
+
+// Finishes the stream and frees the rows.
+void streamed_dataset_free(StreamedDataset* s);
+
+#endif
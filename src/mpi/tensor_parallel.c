@@ -0,0 +1,71 @@
+#include "tensor_parallel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "utils.h"
+
+int tp_grid_init(TpGrid* g, MPI_Comm comm, int tp_size) {
+    if (g == NULL || tp_size < 1) return 1;
+    memset(g, 0, sizeof(*g));
+    int rank;
+    int size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    if (size % tp_size != 0) return 2;
+    MPI_Comm_split(comm, rank / tp_size, rank, &g->tp_comm);
+    MPI_Comm_split(comm, rank % tp_size, rank, &g->dp_comm);
+    MPI_Comm_rank(g->tp_comm, &g->tp_rank);
+    MPI_Comm_size(g->tp_comm, &g->tp_size);
+    MPI_Comm_rank(g->dp_comm, &g->dp_rank);
+    MPI_Comm_size(g->dp_comm, &g->dp_size);
+    return 0;
+}
+
+void tp_grid_free(TpGrid* g) {
+    if (g == NULL || g->tp_size == 0) return;
+    MPI_Comm_free(&g->tp_comm);
+    MPI_Comm_free(&g->dp_comm);
+    memset(g, 0, sizeof(*g));
+}
+
+int tp_shard_mlp(TpGrid* g, Mlp* m) {
+    if (g == NULL || m == NULL) return 1;
+    if (m->n_layers != 2) return 2;
+    size_t in = m->sizes[0];
+    size_t hidden = m->sizes[1];
+    size_t out = m->sizes[2];
+    if (hidden < (size_t)g->tp_size) return 3;
+    g->hidden_lo = hidden * (size_t)g->tp_rank / (size_t)g->tp_size;
+    g->hidden_hi = hidden * (size_t)(g->tp_rank + 1) / (size_t)g->tp_size;
+    size_t lo = g->hidden_lo;
+    size_t n = g->hidden_hi - lo;
+
+    // The values are copied over from m.
+    Mlp shard;
+    size_t sizes[3] = {in, n, out};
+    RETURN_IF_ERROR(mlp_alloc(&shard, sizes, 3));
+    const float* w0 = (const float*)m->params[0]->data;
+    float* s0 = (float*)shard.params[0]->data;
+    for (size_t i = 0; i < in; ++i) {
+        memcpy(s0 + i * n, w0 + i * hidden + lo, n * sizeof(float));
+    }
+    memcpy(shard.params[1]->data, (const float*)m->params[1]->data + lo,
+           n * sizeof(float));
+    memcpy(shard.params[2]->data, (const float*)m->params[2]->data + lo * out,
+           n * out * sizeof(float));
+    memcpy(shard.params[3]->data, m->params[3]->data, out * sizeof(float));
+    mlp_free(m);
+    *m = shard;
+    return 0;
+}
+
+void tp_reduce_logits(void* ctx, Tensor* logits) {
+    TpGrid* g = (TpGrid*)ctx;
+    if (g->tp_size == 1) return;
+    double t0 = trace_now();
+    MPI_Allreduce(MPI_IN_PLACE, logits->data, (int)logits->size, MPI_FLOAT,
+                  MPI_SUM, g->tp_comm);
+    trace_span("logits allreduce", t0);
+}
@@ -0,0 +1,39 @@
+#ifndef TENSOR_PARALLEL_H
+#define TENSOR_PARALLEL_H
+
+#include <mpi.h>
+#include <stddef.h>
+
+#include "model.h"
+#include "tensor.h"
+
+// 2D grid of data parallel replicas, each split over tp_size ranks. Rank
+// dp_rank * tp_size + tp_rank shares a batch with the ranks of its tp_comm
+// and sums gradients with the ranks of its dp_comm, which hold the same
+// shard.
+typedef struct {
+    MPI_Comm tp_comm;
+    MPI_Comm dp_comm;
+    int tp_rank;
+    int tp_size;
+    int dp_rank;
+    int dp_size;
+    // Hidden units [hidden_lo, hidden_hi) live on this rank.
+    size_t hidden_lo;
+    size_t hidden_hi;
+} TpGrid;
+
+int tp_grid_init(TpGrid* g, MPI_Comm comm, int tp_size);
+
+void tp_grid_free(TpGrid* g);
+
+// Replaces the one hidden layer model m by this rank's shard: the hidden
+// columns of the layer 0 weight and bias and the matching rows of the layer
+// 1 weight. The layer 1 bias stays whole on every rank. mlp_backward then
+// yields the shard's gradients unchanged.
+int tp_shard_mlp(TpGrid* g, Mlp* m);
+
+// MlpLogitsHook with ctx = TpGrid*: sums the partial logits over tp_comm.
+void tp_reduce_logits(void* ctx, Tensor* logits);
+
+#endif
@@ -0,0 +1,77 @@
+#include "trace_gather.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+int trace_gather_write(const char* path, MPI_Comm comm) {
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    size_t len = 0;
+    char* events = trace_events_json(&len);
+    // A rank that ran out of memory sends nothing rather than stall the
+    // others.
+    int count = events != NULL && len <= INT_MAX ? (int)len : 0;
+
+    int* counts = NULL;
+    int* offsets = NULL;
+    char* all = NULL;
+    int status = 0;
+    // Rank 0 tells the others whether it can take the trace before each
+    // step, so a failed allocation ends the gather on every rank at once.
+    int ok = 1;
+    if (rank == 0) {
+        counts = (int*)malloc((size_t)size * sizeof(int));
+        offsets = (int*)malloc((size_t)size * sizeof(int));
+        ok = counts != NULL && offsets != NULL;
+    }
+    MPI_Bcast(&ok, 1, MPI_INT, 0, comm);
+    if (!ok) {
+        status = 4;
+        goto done;
+    }
+    MPI_Gather(&count, 1, MPI_INT, counts, 1, MPI_INT, 0, comm);
+    if (rank == 0) {
+        // Room for a ",\n" after each chunk.
+        size_t total = 0;
+        for (int r = 0; r < size; ++r) total += (size_t)counts[r] + 2;
+        // Gatherv takes int offsets.
+        if (total <= INT_MAX) all = (char*)malloc(total);
+        ok = all != NULL;
+        // Chunks land where the separators will go between them.
+        size_t at = 0;
+        for (int r = 0; ok && r < size; ++r) {
+            offsets[r] = (int)at;
+            at += (size_t)counts[r] + 2;
+        }
+    }
+    MPI_Bcast(&ok, 1, MPI_INT, 0, comm);
+    if (!ok) {
+        status = 4;
+        goto done;
+    }
+    MPI_Gatherv(events, count, MPI_CHAR, all, counts, offsets, MPI_CHAR, 0,
+                comm);
+    if (rank == 0) {
+        size_t len_all = 0;
+        for (int r = 0; r < size; ++r) {
+            if (counts[r] == 0) continue;
+            if (len_all > 0) {
+                memcpy(all + len_all, ",\n", 2);
+                len_all += 2;
+            }
+            memmove(all + len_all, all + offsets[r], (size_t)counts[r]);
+            len_all += (size_t)counts[r];
+        }
+        status = trace_write_file(path, all, len_all);
+    }
+done:
+    free(all);
+    free(offsets);
+    free(counts);
+    free(events);
+    return status;
+}
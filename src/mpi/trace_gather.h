@@ -0,0 +1,11 @@
+#ifndef TRACE_GATHER_H
+#define TRACE_GATHER_H
+
+#include <mpi.h>
+
+// Collective: every rank's trace events go to rank 0 of comm, which writes
+// them to path as one file with a process track per rank. Returns the same
+// nonzero status on every rank if rank 0 cannot hold the trace.
+int trace_gather_write(const char* path, MPI_Comm comm);
+
+#endif
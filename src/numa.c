@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include "numa.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// Appends the allowed CPUs of a list like "0-3,8-11" as node `node`.
+static void add_cpulist(NumaTopology* t, const char* list, int node,
+                        const cpu_set_t* allowed) {
+    const char* s = list;
+    while (*s != '\0' && *s != '\n') {
+        char* end;
+        long lo = strtol(s, &end, 10);
+        if (end == s) return;
+        long hi = lo;
+        s = end;
+        if (*s == '-') {
+            s++;
+            hi = strtol(s, &end, 10);
+            if (end == s) return;
+            s = end;
+        }
+        for (long cpu = lo; cpu <= hi && t->n_cpus < NUMA_MAX_CPUS; ++cpu) {
+            if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, allowed)) continue;
+            t->cpus[t->n_cpus] = (int)cpu;
+            t->nodes[t->n_cpus] = node;
+            t->n_cpus++;
+        }
+        if (*s == ',') s++;
+    }
+}
+
+int numa_discover(NumaTopology* t) {
+    if (t == NULL) return 1;
+    memset(t, 0, sizeof(*t));
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) return 2;
+
+    // Node ids can have gaps, so probe a generous range.
+    char path[64];
+    char list[4096];
+    for (int node = 0; node < 1024; ++node) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(path, "r");
+        if (f == NULL) continue;
+        size_t before = t->n_cpus;
+        if (fgets(list, sizeof(list), f) != NULL) {
+            add_cpulist(t, list, node, &allowed);
+        }
+        fclose(f);
+        if (t->n_cpus > before) t->n_nodes++;
+    }
+    if (t->n_cpus > 0) return 0;
+
+    t->n_nodes = 1;
+    for (int cpu = 0; cpu < CPU_SETSIZE && t->n_cpus < NUMA_MAX_CPUS; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        t->cpus[t->n_cpus++] = cpu;
+    }
+    return t->n_cpus > 0 ? 0 : 3;
+}
+
+void numa_spread(const NumaTopology* t, size_t n, int* cpus, int* nodes) {
+    // used[k] counts the CPUs handed out from the k-th node in list order.
+    size_t used[NUMA_MAX_CPUS] = {0};
+    size_t node_start[NUMA_MAX_CPUS + 1] = {0};
+    size_t k = 0;
+    for (size_t c = 0; c < t->n_cpus; ++c) {
+        if (c > 0 && t->nodes[c] != t->nodes[c - 1]) node_start[++k] = c;
+    }
+    node_start[t->n_nodes] = t->n_cpus;
+    for (size_t i = 0; i < n; ++i) {
+        size_t node = i % t->n_nodes;
+        size_t count = node_start[node + 1] - node_start[node];
+        size_t c = node_start[node] + used[node]++ % count;
+        cpus[i] = t->cpus[c];
+        if (nodes != NULL) nodes[i] = t->nodes[c];
+    }
+}
+
+static int pin(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) ? 1 : 0;
+}
+
+int numa_pin_self(int cpu) { return pin(pthread_self(), cpu); }
+
+int numa_pin_pool(Pool* p, const int* cpus) {
+    if (p == NULL || cpus == NULL) return 1;
+    RETURN_IF_ERROR(numa_pin_self(cpus[0]));
+    for (size_t i = 1; i < p->n_workers; ++i) {
+        RETURN_IF_ERROR(pin(p->threads[i], cpus[i]));
+    }
+    return 0;
+}
+
+typedef struct {
+    char* dst;
+    const char* src;
+    size_t bytes;
+    size_t page;
+    size_t n;
+} PlaceTask;
+
+static void place_block(void* ctx, size_t i) {
+    PlaceTask* pt = (PlaceTask*)ctx;
+    size_t pages = (pt->bytes + pt->page - 1) / pt->page;
+    size_t lo = pages * i / pt->n * pt->page;
+    size_t hi = pages * (i + 1) / pt->n * pt->page;
+    if (hi > pt->bytes) hi = pt->bytes;
+    if (lo < hi) memcpy(pt->dst + lo, pt->src + lo, hi - lo);
+}
+
+int numa_place(Pool* p, void** data, size_t bytes) {
+    if (p == NULL || data == NULL || *data == NULL) return 1;
+    if (bytes == 0) return 0;
+    long page = sysconf(_SC_PAGESIZE);
+    PlaceTask pt = {0};
+    pt.page = page > 0 ? (size_t)page : 4096;
+    void* fresh = NULL;
+    if (posix_memalign(&fresh, pt.page, bytes)) return 2;
+    pt.dst = (char*)fresh;
+    pt.src = (const char*)*data;
+    pt.bytes = bytes;
+    pt.n = p->n_workers;
+    int ret = pool_run_each(p, place_block, &pt);
+    if (ret != 0) {
+        free(fresh);
+        return ret;
+    }
+    free(*data);
+    *data = fresh;
+    return 0;
+}
+
+int numa_bind_pool(Pool* p, const char* who) {
+    if (p == NULL || p->n_workers > NUMA_MAX_CPUS) return 1;
+    NumaTopology t;
+    RETURN_IF_ERROR(numa_discover(&t));
+    int cpus[NUMA_MAX_CPUS];
+    int nodes[NUMA_MAX_CPUS];
+    numa_spread(&t, p->n_workers, cpus, nodes);
+    RETURN_IF_ERROR(numa_pin_pool(p, cpus));
+    printf("%s: %zu nodes, %zu cpus allowed, workers pinned to cpu/node",
+           who, t.n_nodes, t.n_cpus);
+    for (size_t i = 0; i < p->n_workers; ++i) {
+        printf(" %d/%d", cpus[i], nodes[i]);
+    }
+    printf("\n");
+    return 0;
+}
+
+int numa_place_tensor(Pool* p, Tensor* t, size_t* bytes) {
+    if (t == NULL || bytes == NULL) return 1;
+    size_t n = tensor_byte_count(t);
+    RETURN_IF_ERROR(numa_place(p, &t->data, n));
+    *bytes += n;
+    return 0;
+}
+
+int numa_place_mlp(Pool* p, Mlp* m, size_t* bytes) {
+    if (m == NULL) return 1;
+    for (size_t i = 0; i < m->n_params; ++i) {
+        RETURN_IF_ERROR(numa_place_tensor(p, m->params[i], bytes));
+        RETURN_IF_ERROR(numa_place_tensor(p, m->grads[i], bytes));
+        RETURN_IF_ERROR(numa_place_tensor(p, m->m[i], bytes));
+        RETURN_IF_ERROR(numa_place_tensor(p, m->v[i], bytes));
+    }
+    return 0;
+}
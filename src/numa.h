@@ -0,0 +1,48 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stddef.h>
+
+#include "model.h"
+#include "pool.h"
+#include "tensor.h"
+
+#define NUMA_MAX_CPUS 1024
+
+// The CPUs this process may run on, grouped by NUMA node as listed under
+// /sys/devices/system/node. Without that directory everything is node 0.
+typedef struct {
+    size_t n_nodes;
+    size_t n_cpus;
+    int cpus[NUMA_MAX_CPUS];
+    int nodes[NUMA_MAX_CPUS];
+} NumaTopology;
+
+int numa_discover(NumaTopology* t);
+
+// CPUs for n workers, dealt round robin over the nodes so every socket's
+// memory controller gets used; cpus repeat once there are more workers than
+// CPUs.
+void numa_spread(const NumaTopology* t, size_t n, int* cpus, int* nodes);
+
+int numa_pin_self(int cpu);
+
+// Pins worker i of p, the calling thread for i = 0, to cpus[i].
+int numa_pin_pool(Pool* p, const int* cpus);
+
+// Moves *data to fresh pages, each 1/n_workers block copied in, and hence
+// first touched, by a different pool worker. With pinned workers this
+// interleaves the buffer over their nodes block by block.
+int numa_place(Pool* p, void** data, size_t bytes);
+
+// Pins p's workers as numa_spread deals them and prints the result after
+// `who`.
+int numa_bind_pool(Pool* p, const char* who);
+
+// numa_place for a tensor's data, and for every parameter, gradient and Adam
+// moment of m; the bytes moved are added to *bytes.
+int numa_place_tensor(Pool* p, Tensor* t, size_t* bytes);
+
+int numa_place_mlp(Pool* p, Mlp* m, size_t* bytes);
+
+#endif
@@ -2,11 +2,12 @@
 #include <stdio.h>
 
 #include "linalg.h"
+#include "perf.h"
 #include "tensor.h"
 #include "utils.h"
 
-int adam_step(float lr, float beta1, float beta2, float eps, size_t t,
-              const Tensor* grad, Tensor* param, Tensor* m, Tensor* v) {
+int adam_step_check(const Tensor* grad, const Tensor* param, const Tensor* m,
+                    const Tensor* v) {
     if (grad == NULL || param == NULL || m == NULL || v == NULL) {
         return 1;
     }
@@ -21,19 +22,41 @@ int adam_step(float lr, float beta1, float beta2, float eps, size_t t,
         m->dtype != DTYPE_FLOAT32 || v->dtype != DTYPE_FLOAT32) {
         return 3;
     }
-    RETURN_IF_ERROR(tensor_scale_float(m, beta1));
-    RETURN_IF_ERROR(tensor_scale_and_add(m, (1.0f - beta1), grad));
-    RETURN_IF_ERROR(tensor_scale_float(v, beta2));
-    RETURN_IF_ERROR(tensor_square_scale_and_add(v, (1.0f - beta2), grad));
+    return 0;
+}
+
+void adam_step_unchecked(float lr, float beta1, float beta2, float eps,
+                         size_t t, const Tensor* grad, Tensor* param,
+                         Tensor* m, Tensor* v) {
+    const float* grad_data = (const float*)grad->data;
     float* param_data = (float*)param->data;
     float* m_data = (float*)m->data;
     float* v_data = (float*)v->data;
     float beta1_t = powf(beta1, t);
     float beta2_t = powf(beta2, t);
+    PerfSample perf;
+    PERF_BEGIN(&perf);
+    // One pass with the moments held in registers, so a concurrent writer
+    // (hogwild) can at worst drop a whole element update, never pair this
+    // step's m with a v that is missing this step's gradient.
     for (size_t i = 0; i < param->size; ++i) {
-        param_data[i] -= lr * m_data[i] / (1.0f - beta1_t) /
-                         (sqrtf(v_data[i] / (1.0f - beta2_t)) + eps);
+        float g = grad_data[i];
+        float m_i = m_data[i] * beta1;
+        m_i += (1.0f - beta1) * g;
+        float v_i = v_data[i] * beta2;
+        v_i += (1.0f - beta2) * (g * g);
+        m_data[i] = m_i;
+        v_data[i] = v_i;
+        param_data[i] -= lr * m_i / (1.0f - beta1_t) /
+                         (sqrtf(v_i / (1.0f - beta2_t)) + eps);
     }
+    // About a dozen operations per element, the square root counted as one.
+    PERF_END(&perf, "adam_step", param->shape, 12.0 * (double)param->size);
+}
 
+int adam_step(float lr, float beta1, float beta2, float eps, size_t t,
+              const Tensor* grad, Tensor* param, Tensor* m, Tensor* v) {
+    RETURN_IF_ERROR(adam_step_check(grad, param, m, v));
+    adam_step_unchecked(lr, beta1, beta2, eps, t, grad, param, m, v);
     return 0;
 }
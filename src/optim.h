@@ -8,4 +8,11 @@
 int adam_step(float lr, float beta1, float beta2, float eps, size_t t,
               const Tensor *grad, Tensor *param, Tensor *m, Tensor *v);
 
+int adam_step_check(const Tensor *grad, const Tensor *param, const Tensor *m,
+                    const Tensor *v);
+
+void adam_step_unchecked(float lr, float beta1, float beta2, float eps,
+                         size_t t, const Tensor *grad, Tensor *param,
+                         Tensor *m, Tensor *v);
+
 #endif
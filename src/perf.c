@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include "perf.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} counter_events[PERF_N_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+enum { CYCLES, INSTRUCTIONS, LLC_REFERENCES, LLC_MISSES };
+
+// One per thread that ever ran a kernel, written by that thread alone so
+// perf_record takes no lock; they outlive their threads.
+typedef struct ThreadStats {
+    KernelStats stats[PERF_MAX_KERNELS];
+    size_t n_stats;
+    size_t n_dropped;
+    struct ThreadStats* next;
+} ThreadStats;
+
+// A group led by the first counter that opened; which[i] is the counter
+// behind the i-th value a group read returns.
+typedef struct {
+    int fds[PERF_N_COUNTERS];
+    int which[PERF_N_COUNTERS];
+    int n_open;
+    ThreadStats* stats;
+} ThreadCounters;
+
+bool perf_on = false;
+// Guards the list of thread stats and the fields below, not the stats.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadStats* threads;
+// Counters some thread managed to open, and why the others could not.
+static bool counted[PERF_N_COUNTERS];
+static int open_errno;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static _Thread_local ThreadCounters* own;
+
+static void close_counters(void* arg) {
+    ThreadCounters* tc = (ThreadCounters*)arg;
+    for (int i = 0; i < tc->n_open; ++i) close(tc->fds[i]);
+    free(tc);
+}
+
+static void make_key(void) { pthread_key_create(&key, close_counters); }
+
+void perf_enable(void) {
+    pthread_once(&key_once, make_key);
+    perf_on = true;
+}
+
+static int open_counter(int i, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter_events[i].type;
+    attr.config = counter_events[i].config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = group == -1;
+    // User space only, which perf_event_paranoid up to 2 allows.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// This thread's counters, opened on first use; a thread that cannot open
+// any gets an empty group and only times its kernels.
+static ThreadCounters* thread_counters(void) {
+    if (own != NULL) return own;
+    ThreadCounters* tc = (ThreadCounters*)calloc(1, sizeof(ThreadCounters));
+    if (tc == NULL) return NULL;
+    tc->stats = (ThreadStats*)calloc(1, sizeof(ThreadStats));
+    if (tc->stats == NULL) {
+        free(tc);
+        return NULL;
+    }
+    int err = 0;
+    for (int i = 0; i < PERF_N_COUNTERS; ++i) {
+        int fd = open_counter(i, tc->n_open > 0 ? tc->fds[0] : -1);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        tc->fds[tc->n_open] = fd;
+        tc->which[tc->n_open] = i;
+        tc->n_open++;
+    }
+    if (tc->n_open > 0) {
+        ioctl(tc->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(tc->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    pthread_mutex_lock(&stats_lock);
+    for (int i = 0; i < tc->n_open; ++i) counted[tc->which[i]] = true;
+    if (err != 0) open_errno = err;
+    tc->stats->next = threads;
+    threads = tc->stats;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(key, tc);
+    own = tc;
+    return tc;
+}
+
+void perf_sample(PerfSample* s) {
+    memset(s, 0, sizeof(*s));
+    ThreadCounters* tc = thread_counters();
+    if (tc != NULL && tc->n_open > 0) {
+        // nr, time_enabled and time_running, then the values.
+        uint64_t values[3 + PERF_N_COUNTERS];
+        ssize_t n = read(tc->fds[0], values, sizeof(values));
+        if (n >= 3 * (ssize_t)sizeof(uint64_t)) {
+            s->enabled = values[1];
+            s->running = values[2];
+            for (uint64_t i = 0; i < values[0] && i < (uint64_t)tc->n_open;
+                 ++i) {
+                s->counts[tc->which[i]] = values[3 + i];
+            }
+        }
+    }
+    s->start = wall_time();
+}
+
+static KernelStats* find_stats(KernelStats* stats, size_t* n_stats,
+                               const char* kernel, Shape shape) {
+    for (size_t i = 0; i < *n_stats; ++i) {
+        if (strcmp(stats[i].kernel, kernel) == 0 &&
+            shape_is_equal(stats[i].shape, shape))
+            return &stats[i];
+    }
+    if (*n_stats == PERF_MAX_KERNELS) return NULL;
+    KernelStats* k = &stats[(*n_stats)++];
+    memset(k, 0, sizeof(*k));
+    k->kernel = kernel;
+    k->shape = shape;
+    return k;
+}
+
+void perf_record(const PerfSample* begin, const char* kernel, Shape shape,
+                 double flops) {
+    PerfSample end;
+    perf_sample(&end);
+    if (own == NULL) return;
+    ThreadStats* t = own->stats;
+    KernelStats* k = find_stats(t->stats, &t->n_stats, kernel, shape);
+    if (k == NULL) {
+        t->n_dropped++;
+        return;
+    }
+    k->calls++;
+    k->seconds += end.start - begin->start;
+    k->flops += flops;
+    // The group ran for only part of the call; estimate the whole.
+    uint64_t enabled = end.enabled - begin->enabled;
+    uint64_t running = end.running - begin->running;
+    double scale = 1.0;
+    if (running < enabled) {
+        k->multiplexed = true;
+        scale = running > 0 ? (double)enabled / (double)running : 0.0;
+    }
+    for (int i = 0; i < PERF_N_COUNTERS; ++i) {
+        uint64_t count = end.counts[i] - begin->counts[i];
+        k->counts[i] += (uint64_t)((double)count * scale);
+    }
+}
+
+static int by_seconds(const void* a, const void* b) {
+    double sa = ((const KernelStats*)a)->seconds;
+    double sb = ((const KernelStats*)b)->seconds;
+    return (sa < sb) - (sa > sb);
+}
+
+static void print_shape_dims(const Shape s) {
+    char text[64];
+    size_t len = 0;
+    text[0] = '\0';
+    for (size_t i = 0; i < s.rank && len < sizeof(text); ++i) {
+        len += (size_t)snprintf(text + len, sizeof(text) - len, "%s%zu",
+                                i > 0 ? "x" : "", s.dims[i]);
+    }
+    printf(" %-20s", text);
+}
+
+size_t perf_collect(KernelStats* out, size_t* n_dropped) {
+    size_t n = 0;
+    size_t dropped = 0;
+    pthread_mutex_lock(&stats_lock);
+    for (const ThreadStats* t = threads; t != NULL; t = t->next) {
+        dropped += t->n_dropped;
+        for (size_t i = 0; i < t->n_stats; ++i) {
+            const KernelStats* from = &t->stats[i];
+            KernelStats* k = find_stats(out, &n, from->kernel, from->shape);
+            if (k == NULL) {
+                dropped += from->calls;
+                continue;
+            }
+            k->calls += from->calls;
+            k->seconds += from->seconds;
+            k->flops += from->flops;
+            k->multiplexed |= from->multiplexed;
+            for (int c = 0; c < PERF_N_COUNTERS; ++c) {
+                k->counts[c] += from->counts[c];
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    qsort(out, n, sizeof(KernelStats), by_seconds);
+    if (n_dropped != NULL) *n_dropped = dropped;
+    return n;
+}
+
+void perf_report(void) {
+    static KernelStats stats[PERF_MAX_KERNELS];
+    size_t n_dropped = 0;
+    size_t n_stats = perf_collect(stats, &n_dropped);
+    pthread_mutex_lock(&stats_lock);
+    bool ipc = counted[CYCLES] && counted[INSTRUCTIONS];
+    bool misses = counted[LLC_MISSES];
+    bool rate = misses && counted[LLC_REFERENCES];
+    bool none = !counted[CYCLES] && !counted[INSTRUCTIONS] &&
+                !counted[LLC_MISSES];
+    int err = open_errno;
+    pthread_mutex_unlock(&stats_lock);
+    if (none) {
+        printf("perf: hardware counters unavailable (%s), timing only\n",
+               strerror(err));
+    }
+    printf("perf: %-22s %-20s %8s %10s %8s %6s %14s %9s\n", "kernel",
+           "shape", "calls", "ms", "GFLOP/s", "IPC", "LLC miss/FLOP",
+           "LLC miss%");
+    bool multiplexed = false;
+    for (size_t i = 0; i < n_stats; ++i) {
+        const KernelStats* k = &stats[i];
+        multiplexed |= k->multiplexed;
+        printf("perf: %-22s", k->kernel);
+        print_shape_dims(k->shape);
+        printf(" %8zu %10.3f %8.3f", k->calls, k->seconds * 1e3,
+               k->seconds > 0.0 ? k->flops / k->seconds * 1e-9 : 0.0);
+        if (ipc && k->counts[CYCLES] > 0) {
+            printf(" %6.2f", (double)k->counts[INSTRUCTIONS] /
+                                 (double)k->counts[CYCLES]);
+        } else {
+            printf(" %6s", "-");
+        }
+        if (misses && k->flops > 0.0) {
+            printf(" %14.3e", (double)k->counts[LLC_MISSES] / k->flops);
+        } else {
+            printf(" %14s", "-");
+        }
+        if (rate && k->counts[LLC_REFERENCES] > 0) {
+            printf(" %9.2f", 100.0 * (double)k->counts[LLC_MISSES] /
+                                 (double)k->counts[LLC_REFERENCES]);
+        } else {
+            printf(" %9s", "-");
+        }
+        printf("%s\n", k->multiplexed ? " *" : "");
+    }
+    if (multiplexed) {
+        printf("perf: * counters multiplexed, counts scaled by enabled / "
+               "running time\n");
+    }
+    if (n_dropped > 0) {
+        printf("perf: %zu calls past %d kernels not counted\n", n_dropped,
+               PERF_MAX_KERNELS);
+    }
+}
+
+void perf_clear(void) {
+    pthread_mutex_lock(&stats_lock);
+    for (ThreadStats* t = threads; t != NULL; t = t->next) {
+        t->n_stats = 0;
+        t->n_dropped = 0;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
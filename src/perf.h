@@ -0,0 +1,78 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tensor.h"
+#include "utils.h"
+
+// Cycles, instructions, last level cache references and misses.
+#define PERF_N_COUNTERS 4
+#define PERF_MAX_KERNELS 256
+
+// Hardware counters read around each kernel call with perf_event_open and
+// summed per kernel and shape. Each thread opens its own counter group the
+// first time it runs a kernel; where the kernel or a container forbids
+// that, calls are only timed. Kernels bracket their loop with
+//
+//     PerfSample s;
+//     PERF_BEGIN(&s);
+//     ...
+//     PERF_END(&s, "bmm", shapeN(4, b, m, n, k), 2.0 * b * m * n * k);
+//
+// which costs one branch while counting is off; the shape and flops
+// arguments are only evaluated while it is on.
+extern bool perf_on;
+
+// time_enabled and time_running of the group: they differ while the kernel
+// multiplexes the counters with other events.
+typedef struct {
+    uint64_t counts[PERF_N_COUNTERS];
+    uint64_t enabled;
+    uint64_t running;
+    double start;
+} PerfSample;
+
+// Counts of a multiplexed kernel are scaled up by enabled / running time.
+typedef struct {
+    const char* kernel;
+    Shape shape;
+    size_t calls;
+    double seconds;
+    double flops;
+    uint64_t counts[PERF_N_COUNTERS];
+    bool multiplexed;
+} KernelStats;
+
+void perf_enable(void);
+
+void perf_sample(PerfSample* s);
+
+#define PERF_BEGIN(s)                \
+    {                                \
+        if (perf_on) perf_sample(s); \
+    }
+
+// kernel must be a string literal; flops is a rough count of the floating
+// point operations of the call.
+void perf_record(const PerfSample* begin, const char* kernel, Shape shape,
+                 double flops);
+
+#define PERF_END(s, kernel, shape, flops)                          \
+    {                                                              \
+        if (perf_on) perf_record((s), (kernel), (shape), (flops)); \
+    }
+
+// Every thread's stats summed per kernel and shape into out, which holds
+// PERF_MAX_KERNELS, most time first; returns how many there are. Like
+// perf_report and perf_clear, only while no thread is running kernels.
+size_t perf_collect(KernelStats* out, size_t* n_dropped);
+
+// Per kernel and shape, most time first: calls, time, GFLOP/s, and where
+// counted IPC, last level cache misses per FLOP and the LLC miss rate.
+void perf_report(void);
+
+void perf_clear(void);
+
+#endif
@@ -0,0 +1,455 @@
+#include "plan.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linalg.h"
+#include "optim.h"
+#include "trace.h"
+#include "utils.h"
+
+#define PLAN_ALIGN 64
+
+static size_t align_up(size_t n) {
+    return (n + PLAN_ALIGN - 1) / PLAN_ALIGN * PLAN_ALIGN;
+}
+
+static Tensor* new_value(Plan* p, const Shape s, const Dtype dtype) {
+    if (p->n_values == PLAN_MAX_VALUES || p->n_tensors == PLAN_MAX_TENSORS)
+        return NULL;
+    PlanValue* v = &p->values[p->n_values];
+    v->bytes = shape_numel(s) * dtype_byte_count(dtype);
+    v->first = SIZE_MAX;
+    v->last = 0;
+    v->offset = 0;
+
+    Tensor* t = &p->tensors[p->n_tensors];
+    t->data = NULL;
+    t->shape = s;
+    t->size = shape_numel(s);
+    t->dtype = dtype;
+    p->tensor_value[p->n_tensors] = p->n_values;
+    p->n_tensors++;
+    p->n_values++;
+    return t;
+}
+
+// Same storage as base, viewed with another shape.
+static Tensor* new_alias(Plan* p, const Tensor* base, const Shape s) {
+    if (p->n_tensors == PLAN_MAX_TENSORS) return NULL;
+    Tensor* t = &p->tensors[p->n_tensors];
+    *t = *base;
+    t->shape = s;
+    p->tensor_value[p->n_tensors] = p->tensor_value[base - p->tensors];
+    p->n_tensors++;
+    return t;
+}
+
+static PlanValue* value_of(Plan* p, const Tensor* t) {
+    if (t < p->tensors || t >= p->tensors + p->n_tensors) return NULL;
+    return &p->values[p->tensor_value[t - p->tensors]];
+}
+
+static void touch(Plan* p, const Tensor* t, size_t i) {
+    PlanValue* v = value_of(p, t);
+    if (v == NULL) return;
+    if (i < v->first) v->first = i;
+    if (i > v->last) v->last = i;
+}
+
+static int check_op(const Plan* p, const PlanOp* op) {
+    switch (op->kind) {
+        case OP_ZERO:
+        case OP_TANH:
+            if (op->out == NULL || op->out->dtype != DTYPE_FLOAT32) return 1;
+            return 0;
+        case OP_BMM:
+            return bmm_check(op->out, op->a, op->b, op->transpose_a,
+                             op->transpose_b);
+        case OP_ADD:
+            return tensor_add_check(op->out, op->a);
+        case OP_COPY:
+            if (op->out == NULL || op->a == NULL) return 1;
+            if (!shape_is_equal(op->out->shape, op->a->shape)) return 2;
+            if (op->out->dtype != op->a->dtype) return 3;
+            return 0;
+        case OP_TANH_BACKWARD:
+            return tensor_tanh_backward_check(op->a, op->out);
+        case OP_BCAST_GRAD:
+            return tensor_bcast_grad_check(op->a, op->out);
+        case OP_ARGMAX:
+            return tensor_argmax_check(op->a, op->out);
+        case OP_ACCURACY:
+            return accuracy_check(op->a, op->b);
+        case OP_CROSS_ENTROPY:
+            return cross_entropy_check(op->a, op->b);
+        case OP_CROSS_ENTROPY_BACKWARD:
+            return cross_entropy_backward_check(op->a, op->b, op->out);
+        case OP_ADAM:
+            if (op->param >= p->model->n_params) return 1;
+            return adam_step_check(op->a, op->out, p->model->m[op->param],
+                                   p->model->v[op->param]);
+    }
+    return 1;
+}
+
+static int push_op(Plan* p, const PlanOp op) {
+    if (p->n_ops == PLAN_MAX_OPS) return 1;
+    RETURN_IF_ERROR(check_op(p, &op));
+    touch(p, op.out, p->n_ops);
+    touch(p, op.a, p->n_ops);
+    touch(p, op.b, p->n_ops);
+    p->ops[p->n_ops++] = op;
+    return 0;
+}
+
+static int add_op(Plan* p, OpKind kind, Tensor* out, const Tensor* a,
+                  const Tensor* b) {
+    return push_op(p, (PlanOp){.kind = kind, .out = out, .a = a, .b = b});
+}
+
+static int add_bmm(Plan* p, Tensor* out, const Tensor* a, const Tensor* b,
+                   bool transpose_a, bool transpose_b) {
+    return push_op(p, (PlanOp){.kind = OP_BMM,
+                               .out = out,
+                               .a = a,
+                               .b = b,
+                               .transpose_a = transpose_a,
+                               .transpose_b = transpose_b});
+}
+
+static int add_adam(Plan* p, size_t param) {
+    Mlp* m = p->model;
+    return push_op(p, (PlanOp){.kind = OP_ADAM,
+                               .out = m->params[param],
+                               .a = m->grads[param],
+                               .param = param});
+}
+
+static bool lifetimes_overlap(const PlanValue* a, const PlanValue* b) {
+    return a->first <= b->last && b->first <= a->last;
+}
+
+// Greedy placement, largest value first: each value goes to the lowest offset
+// that does not collide with an already placed value live at the same time.
+static int plan_memory(Plan* p) {
+    size_t order[PLAN_MAX_VALUES];
+    for (size_t i = 0; i < p->n_values; ++i) {
+        size_t j = i;
+        while (j > 0 && p->values[order[j - 1]].bytes < p->values[i].bytes) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+
+    p->arena_bytes = 0;
+    p->naive_bytes = 0;
+    for (size_t i = 0; i < p->n_values; ++i) {
+        PlanValue* v = &p->values[order[i]];
+        size_t offset = 0;
+        bool moved = true;
+        while (moved) {
+            moved = false;
+            for (size_t j = 0; j < i; ++j) {
+                const PlanValue* u = &p->values[order[j]];
+                if (!lifetimes_overlap(u, v)) continue;
+                if (offset < u->offset + u->bytes &&
+                    u->offset < offset + v->bytes) {
+                    offset = align_up(u->offset + u->bytes);
+                    moved = true;
+                }
+            }
+        }
+        v->offset = offset;
+        if (offset + v->bytes > p->arena_bytes) {
+            p->arena_bytes = offset + v->bytes;
+        }
+        p->naive_bytes += align_up(v->bytes);
+    }
+
+    p->arena_bytes = align_up(p->arena_bytes);
+    p->arena = aligned_alloc(PLAN_ALIGN, p->arena_bytes);
+    if (p->arena == NULL) return 1;
+    for (size_t i = 0; i < p->n_tensors; ++i) {
+        p->tensors[i].data =
+            (uint8_t*)p->arena + p->values[p->tensor_value[i]].offset;
+    }
+    return 0;
+}
+
+int plan_build(Plan* p, Mlp* m, const Tensor* x, const Tensor* y, bool train,
+               float lr, float beta1, float beta2, float eps) {
+    if (p == NULL || m == NULL || x == NULL || y == NULL) return 1;
+    if (x->shape.rank != 3 || x->shape.dims[2] != m->sizes[0]) return 2;
+    memset(p, 0, sizeof(*p));
+    p->model = m;
+    p->x = x;
+    p->y = y;
+    p->lr = lr;
+    p->beta1 = beta1;
+    p->beta2 = beta2;
+    p->eps = eps;
+
+    size_t b = x->shape.dims[0];
+    size_t L = m->n_layers;
+    size_t classes = m->sizes[L];
+    Tensor* pre[MLP_MAX_LAYERS];
+    Tensor* act[MLP_MAX_LAYERS];
+    for (size_t l = 0; l < L; ++l) {
+        const Tensor* in = l == 0 ? x : act[l - 1];
+        Shape s = shapeN(3, b, 1, m->sizes[l + 1]);
+        pre[l] = new_value(p, s, DTYPE_FLOAT32);
+        if (pre[l] == NULL) return 3;
+        RETURN_IF_ERROR(add_op(p, OP_ZERO, pre[l], NULL, NULL));
+        RETURN_IF_ERROR(
+            add_bmm(p, pre[l], in, m->params[2 * l], false, false));
+        RETURN_IF_ERROR(
+            add_op(p, OP_ADD, pre[l], m->params[2 * l + 1], NULL));
+        if (l + 1 == L) break;
+        act[l] = new_value(p, s, DTYPE_FLOAT32);
+        if (act[l] == NULL) return 3;
+        RETURN_IF_ERROR(add_op(p, OP_COPY, act[l], pre[l], NULL));
+        RETURN_IF_ERROR(add_op(p, OP_TANH, act[l], NULL, NULL));
+    }
+
+    Tensor* logits = pre[L - 1];
+    Tensor* logits_2d = new_alias(p, logits, shapeN(2, b, classes));
+    Tensor* argmax = new_value(p, shapeN(2, b, 1), DTYPE_UINT8);
+    if (logits_2d == NULL || argmax == NULL) return 3;
+    Tensor* argmax_1d = new_alias(p, argmax, shapeN(1, b));
+    if (argmax_1d == NULL) return 3;
+    RETURN_IF_ERROR(add_op(p, OP_ARGMAX, argmax, logits, NULL));
+    RETURN_IF_ERROR(add_op(p, OP_ACCURACY, NULL, argmax_1d, y));
+    RETURN_IF_ERROR(add_op(p, OP_CROSS_ENTROPY, NULL, logits_2d, y));
+
+    if (train) {
+        Tensor* g_2d = new_value(p, shapeN(2, b, classes), DTYPE_FLOAT32);
+        if (g_2d == NULL) return 3;
+        RETURN_IF_ERROR(
+            add_op(p, OP_CROSS_ENTROPY_BACKWARD, g_2d, logits_2d, y));
+        Tensor* g = new_alias(p, g_2d, shapeN(3, b, 1, classes));
+        if (g == NULL) return 3;
+        for (size_t l = L; l-- > 0;) {
+            const Tensor* in = l == 0 ? x : act[l - 1];
+            if (l + 1 < L) {
+                RETURN_IF_ERROR(add_op(p, OP_TANH_BACKWARD, g, pre[l], NULL));
+            }
+            RETURN_IF_ERROR(
+                add_op(p, OP_BCAST_GRAD, m->grads[2 * l + 1], g, NULL));
+            RETURN_IF_ERROR(add_op(p, OP_ZERO, m->grads[2 * l], NULL, NULL));
+            RETURN_IF_ERROR(add_bmm(p, m->grads[2 * l], in, g, true, false));
+            if (l == 0) break;
+            Tensor* g_in =
+                new_value(p, shapeN(3, b, 1, m->sizes[l]), DTYPE_FLOAT32);
+            if (g_in == NULL) return 3;
+            RETURN_IF_ERROR(add_op(p, OP_ZERO, g_in, NULL, NULL));
+            RETURN_IF_ERROR(
+                add_bmm(p, g_in, g, m->params[2 * l], false, true));
+            g = g_in;
+        }
+    }
+    p->n_step_ops = p->n_ops;
+
+    if (train) {
+        for (size_t i = 0; i < m->n_params; ++i) {
+            RETURN_IF_ERROR(add_adam(p, i));
+        }
+    }
+
+    return plan_memory(p);
+}
+
+void plan_free(Plan* p) {
+    if (p == NULL) return;
+    if (p->pool != NULL) {
+        task_graph_free(&p->step_graph);
+        task_graph_free(&p->update_graph);
+        p->pool = NULL;
+    }
+    free(p->arena);
+    p->arena = NULL;
+    p->n_ops = 0;
+}
+
+// The phase an op belongs to in a trace.
+static const char* op_phase(const PlanOp* op) {
+    switch (op->kind) {
+        case OP_BMM:
+            return op->transpose_a || op->transpose_b ? "backward gemm"
+                                                      : "forward gemm";
+        case OP_TANH:
+            return "activation";
+        case OP_ARGMAX:
+        case OP_ACCURACY:
+        case OP_CROSS_ENTROPY:
+            return "loss";
+        case OP_TANH_BACKWARD:
+        case OP_BCAST_GRAD:
+        case OP_CROSS_ENTROPY_BACKWARD:
+            return "backward";
+        case OP_ADAM:
+            return "optimizer";
+        default:
+            return "elementwise";
+    }
+}
+
+void plan_run_op(Plan* p, const PlanOp* op) {
+    double t0 = trace_now();
+    switch (op->kind) {
+        case OP_ZERO:
+            memset(op->out->data, 0, tensor_byte_count(op->out));
+            break;
+        case OP_BMM:
+            bmm_unchecked(op->out, op->a, op->b, op->transpose_a,
+                          op->transpose_b);
+            break;
+        case OP_ADD:
+            tensor_add_unchecked(op->out, op->a);
+            break;
+        case OP_COPY:
+            memcpy(op->out->data, op->a->data, tensor_byte_count(op->out));
+            break;
+        case OP_TANH:
+            tensor_tanh(op->out);
+            break;
+        case OP_TANH_BACKWARD:
+            tensor_tanh_backward_unchecked(op->a, op->out);
+            break;
+        case OP_BCAST_GRAD:
+            tensor_bcast_grad_unchecked(op->a, op->out);
+            break;
+        case OP_ARGMAX:
+            tensor_argmax_unchecked(op->a, op->out);
+            break;
+        case OP_ACCURACY:
+            accuracy_unchecked(op->a, op->b, &p->acc);
+            break;
+        case OP_CROSS_ENTROPY:
+            cross_entropy_unchecked(op->a, op->b, &p->loss);
+            break;
+        case OP_CROSS_ENTROPY_BACKWARD:
+            cross_entropy_backward_unchecked(op->a, op->b, op->out);
+            break;
+        case OP_ADAM:
+            adam_step_unchecked(p->lr, p->beta1, p->beta2, p->eps, p->t, op->a,
+                                op->out, p->model->m[op->param],
+                                p->model->v[op->param]);
+            break;
+    }
+    if (trace_on) trace_span(op_phase(op), t0);
+}
+
+typedef struct {
+    uintptr_t begin;
+    uintptr_t end;
+} Region;
+
+static Region region_of(const Tensor* t) {
+    uintptr_t begin = (uintptr_t)t->data;
+    return (Region){begin, begin + tensor_byte_count(t)};
+}
+
+static Region region_of_float(const float* f) {
+    return (Region){(uintptr_t)f, (uintptr_t)(f + 1)};
+}
+
+static void op_regions(const Plan* p, const PlanOp* op, Region* reads,
+                       size_t* n_reads, Region* writes, size_t* n_writes) {
+    *n_reads = 0;
+    *n_writes = 0;
+    if (op->a != NULL) reads[(*n_reads)++] = region_of(op->a);
+    if (op->b != NULL) reads[(*n_reads)++] = region_of(op->b);
+    if (op->out != NULL) writes[(*n_writes)++] = region_of(op->out);
+    if (op->kind == OP_ACCURACY) {
+        writes[(*n_writes)++] = region_of_float(&p->acc);
+    } else if (op->kind == OP_CROSS_ENTROPY) {
+        writes[(*n_writes)++] = region_of_float(&p->loss);
+    } else if (op->kind == OP_ADAM) {
+        writes[(*n_writes)++] = region_of(p->model->m[op->param]);
+        writes[(*n_writes)++] = region_of(p->model->v[op->param]);
+    }
+}
+
+static bool regions_overlap(const Region* a, size_t n_a, const Region* b,
+                            size_t n_b) {
+    for (size_t i = 0; i < n_a; ++i) {
+        for (size_t j = 0; j < n_b; ++j) {
+            if (a[i].begin < b[j].end && b[j].begin < a[i].end) return true;
+        }
+    }
+    return false;
+}
+
+static void run_step_node(void* ctx, size_t i) {
+    Plan* p = (Plan*)ctx;
+    plan_run_op(p, &p->ops[i]);
+}
+
+static void run_update_node(void* ctx, size_t i) {
+    Plan* p = (Plan*)ctx;
+    plan_run_op(p, &p->ops[p->n_step_ops + i]);
+}
+
+// Op j depends on an earlier op i when one writes bytes the other reads or
+// writes; that also orders ops whose buffers were folded together by the
+// memory planner.
+static int build_graph(Plan* p, size_t begin, size_t end, TaskFn fn,
+                       TaskGraph* g) {
+    RETURN_IF_ERROR(task_graph_init(g, end - begin, fn, p));
+    Region reads_i[4], writes_i[4], reads_j[4], writes_j[4];
+    size_t nr_i, nw_i, nr_j, nw_j;
+    for (size_t j = begin; j < end; ++j) {
+        op_regions(p, &p->ops[j], reads_j, &nr_j, writes_j, &nw_j);
+        for (size_t i = begin; i < j; ++i) {
+            op_regions(p, &p->ops[i], reads_i, &nr_i, writes_i, &nw_i);
+            if (regions_overlap(writes_i, nw_i, reads_j, nr_j) ||
+                regions_overlap(writes_i, nw_i, writes_j, nw_j) ||
+                regions_overlap(reads_i, nr_i, writes_j, nw_j)) {
+                RETURN_IF_ERROR(task_graph_add_edge(g, i - begin, j - begin));
+            }
+        }
+    }
+    return task_graph_finalize(g);
+}
+
+int plan_attach_pool(Plan* p, Pool* pool) {
+    if (p == NULL || pool == NULL || p->arena == NULL) return 1;
+    RETURN_IF_ERROR(
+        build_graph(p, 0, p->n_step_ops, run_step_node, &p->step_graph));
+    RETURN_IF_ERROR(build_graph(p, p->n_step_ops, p->n_ops, run_update_node,
+                                &p->update_graph));
+    p->pool = pool;
+    return 0;
+}
+
+int plan_run_step(Plan* p) {
+    if (p == NULL || p->arena == NULL) return 1;
+    if (p->pool != NULL) return pool_run(p->pool, &p->step_graph);
+    for (size_t i = 0; i < p->n_step_ops; ++i) plan_run_op(p, &p->ops[i]);
+    return 0;
+}
+
+int plan_run_update(Plan* p, size_t t) {
+    if (p == NULL || p->arena == NULL) return 1;
+    p->t = t;
+    if (p->pool != NULL) return pool_run(p->pool, &p->update_graph);
+    for (size_t i = p->n_step_ops; i < p->n_ops; ++i) {
+        plan_run_op(p, &p->ops[i]);
+    }
+    return 0;
+}
+
+void plan_print_summary(const Plan* p) {
+    printf("plan: %zu ops, %zu buffers in %zu bytes (%zu without reuse)\n",
+           p->n_ops, p->n_values, p->arena_bytes, p->naive_bytes);
+    if (p->pool != NULL) {
+        printf("plan: %zu + %zu dependency edges on %zu workers\n",
+               p->step_graph.succ_start[p->step_graph.n_nodes],
+               p->update_graph.succ_start[p->update_graph.n_nodes],
+               p->pool->n_workers);
+    }
+}
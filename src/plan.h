@@ -0,0 +1,104 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stddef.h>
+
+#include "model.h"
+#include "pool.h"
+#include "tensor.h"
+
+#define PLAN_MAX_OPS 512
+#define PLAN_MAX_TENSORS 160
+#define PLAN_MAX_VALUES 96
+
+typedef enum {
+    OP_ZERO = 0,
+    OP_BMM,
+    OP_ADD,
+    OP_COPY,
+    OP_TANH,
+    OP_TANH_BACKWARD,
+    OP_BCAST_GRAD,
+    OP_ARGMAX,
+    OP_ACCURACY,
+    OP_CROSS_ENTROPY,
+    OP_CROSS_ENTROPY_BACKWARD,
+    OP_ADAM,
+} OpKind;
+
+typedef struct {
+    OpKind kind;
+    Tensor* out;
+    const Tensor* a;
+    const Tensor* b;
+    bool transpose_a;
+    bool transpose_b;
+    size_t param;
+} PlanOp;
+
+// A value is one intermediate buffer; several tensors (views with different
+// shapes) may refer to it. [first, last] is the op range it is live over.
+typedef struct {
+    size_t bytes;
+    size_t first;
+    size_t last;
+    size_t offset;
+} PlanValue;
+
+// Forward, backward and optimizer ops of one training step over fixed-shape
+// inputs, validated once when built. Intermediates are placed in a single
+// arena where values whose lifetimes do not overlap share storage.
+typedef struct {
+    Mlp* model;
+    const Tensor* x;
+    const Tensor* y;
+    float lr;
+    float beta1;
+    float beta2;
+    float eps;
+    size_t t;
+
+    PlanOp ops[PLAN_MAX_OPS];
+    size_t n_ops;
+    // ops[0, n_step_ops) compute loss and gradients, the rest are updates.
+    size_t n_step_ops;
+
+    Tensor tensors[PLAN_MAX_TENSORS];
+    size_t tensor_value[PLAN_MAX_TENSORS];
+    size_t n_tensors;
+    PlanValue values[PLAN_MAX_VALUES];
+    size_t n_values;
+
+    void* arena;
+    size_t arena_bytes;
+    size_t naive_bytes;
+
+    // Set by plan_attach_pool; ops then run as a dependency graph.
+    Pool* pool;
+    TaskGraph step_graph;
+    TaskGraph update_graph;
+
+    float loss;
+    float acc;
+} Plan;
+
+// x is [batch, 1, in] and y is [batch]; both stay bound to the plan and are
+// read on every run. Without train only forward and metrics are captured.
+int plan_build(Plan* p, Mlp* m, const Tensor* x, const Tensor* y, bool train,
+               float lr, float beta1, float beta2, float eps);
+
+void plan_free(Plan* p);
+
+// Derives op dependencies from the byte ranges each op reads and writes, so
+// later steps can run independent ops concurrently on the pool.
+int plan_attach_pool(Plan* p, Pool* pool);
+
+int plan_run_step(Plan* p);
+
+int plan_run_update(Plan* p, size_t t);
+
+void plan_run_op(Plan* p, const PlanOp* op);
+
+void plan_print_summary(const Plan* p);
+
+#endif
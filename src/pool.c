@@ -0,0 +1,295 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+int task_graph_init(TaskGraph* g, size_t n_nodes, TaskFn fn, void* ctx) {
+    if (g == NULL || fn == NULL) return 1;
+    memset(g, 0, sizeof(*g));
+    g->fn = fn;
+    g->ctx = ctx;
+    g->n_nodes = n_nodes;
+    g->n_deps = (size_t*)calloc(n_nodes + 1, sizeof(size_t));
+    g->succ_start = (size_t*)calloc(n_nodes + 1, sizeof(size_t));
+    g->pending = (atomic_size_t*)calloc(n_nodes + 1, sizeof(atomic_size_t));
+    if (!g->n_deps || !g->succ_start || !g->pending) return 2;
+    return 0;
+}
+
+int task_graph_add_edge(TaskGraph* g, size_t from, size_t to) {
+    if (g == NULL || from >= g->n_nodes || to >= g->n_nodes) return 1;
+    if (g->n_edges == g->cap_edges) {
+        size_t cap = g->cap_edges ? 2 * g->cap_edges : 64;
+        size_t* edges = (size_t*)realloc(g->edges, 2 * cap * sizeof(size_t));
+        if (edges == NULL) return 2;
+        g->edges = edges;
+        g->cap_edges = cap;
+    }
+    g->edges[2 * g->n_edges] = from;
+    g->edges[2 * g->n_edges + 1] = to;
+    g->n_edges++;
+    return 0;
+}
+
+int task_graph_finalize(TaskGraph* g) {
+    if (g == NULL) return 1;
+    g->succ = (size_t*)malloc((g->n_edges + 1) * sizeof(size_t));
+    if (g->succ == NULL) return 2;
+    memset(g->succ_start, 0, (g->n_nodes + 1) * sizeof(size_t));
+    memset(g->n_deps, 0, g->n_nodes * sizeof(size_t));
+    for (size_t e = 0; e < g->n_edges; ++e) {
+        g->succ_start[g->edges[2 * e] + 1]++;
+        g->n_deps[g->edges[2 * e + 1]]++;
+    }
+    for (size_t i = 0; i < g->n_nodes; ++i) {
+        g->succ_start[i + 1] += g->succ_start[i];
+    }
+    size_t* fill = (size_t*)calloc(g->n_nodes + 1, sizeof(size_t));
+    if (fill == NULL) return 2;
+    for (size_t e = 0; e < g->n_edges; ++e) {
+        size_t from = g->edges[2 * e];
+        g->succ[g->succ_start[from] + fill[from]++] = g->edges[2 * e + 1];
+    }
+    free(fill);
+    free(g->edges);
+    g->edges = NULL;
+    g->cap_edges = 0;
+    return 0;
+}
+
+void task_graph_free(TaskGraph* g) {
+    if (g == NULL) return;
+    free(g->n_deps);
+    free(g->succ_start);
+    free(g->succ);
+    free(g->pending);
+    free(g->edges);
+    memset(g, 0, sizeof(*g));
+}
+
+static int deque_reserve(TaskDeque* d, size_t cap) {
+    int ret = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->cap < cap) {
+        size_t* items = (size_t*)realloc(d->items, cap * sizeof(size_t));
+        if (items != NULL) {
+            d->items = items;
+            d->cap = cap;
+        } else {
+            ret = 1;
+        }
+    }
+    d->head = 0;
+    d->tail = 0;
+    pthread_mutex_unlock(&d->lock);
+    return ret;
+}
+
+static void deque_push(Pool* p, size_t worker, size_t task) {
+    TaskDeque* d = &p->deques[worker];
+    // Counted before it becomes visible so a thief can never take queued
+    // below zero.
+    atomic_fetch_add(&p->queued, 1);
+    pthread_mutex_lock(&d->lock);
+    d->items[d->tail++ % d->cap] = task;
+    pthread_mutex_unlock(&d->lock);
+    if (atomic_load(&p->sleepers) > 0) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->wake);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static bool deque_pop(Pool* p, size_t worker, size_t* task) {
+    TaskDeque* d = &p->deques[worker];
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head) {
+        *task = d->items[--d->tail % d->cap];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (found) atomic_fetch_sub(&p->queued, 1);
+    return found;
+}
+
+static bool deque_steal(Pool* p, size_t victim, size_t* task) {
+    TaskDeque* d = &p->deques[victim];
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head) {
+        *task = d->items[d->head++ % d->cap];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (found) atomic_fetch_sub(&p->queued, 1);
+    return found;
+}
+
+static bool find_task(Pool* p, size_t worker, size_t* task) {
+    if (deque_pop(p, worker, task)) return true;
+    for (size_t k = 1; k < p->n_workers; ++k) {
+        if (deque_steal(p, (worker + k) % p->n_workers, task)) return true;
+    }
+    return false;
+}
+
+static void task_done(Pool* p) {
+    if (atomic_fetch_sub(&p->remaining, 1) == 1) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->wake);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static void run_task(Pool* p, size_t worker, size_t task) {
+    TaskGraph* g = p->graph;
+    g->fn(g->ctx, task);
+    for (size_t e = g->succ_start[task]; e < g->succ_start[task + 1]; ++e) {
+        size_t next = g->succ[e];
+        if (atomic_fetch_sub(&g->pending[next], 1) == 1) {
+            deque_push(p, worker, next);
+        }
+    }
+    task_done(p);
+}
+
+// Sleeps until there is queued work or a task for this worker alone, or for
+// the caller of pool_run until the graph has drained.
+static void wait_for_work(Pool* p, size_t worker, bool until_done) {
+    pthread_mutex_lock(&p->lock);
+    atomic_fetch_add(&p->sleepers, 1);
+    while (atomic_load(&p->queued) == 0 && !atomic_load(&p->stop) &&
+           !atomic_load(&p->workers[worker].own_task) &&
+           (!until_done || atomic_load(&p->remaining) > 0)) {
+        pthread_cond_wait(&p->wake, &p->lock);
+    }
+    atomic_fetch_sub(&p->sleepers, 1);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void* worker_main(void* arg) {
+    PoolWorker* w = (PoolWorker*)arg;
+    Pool* p = w->pool;
+    while (!atomic_load(&p->stop)) {
+        size_t task;
+        if (atomic_exchange(&w->own_task, false)) {
+            p->each_fn(p->each_ctx, w->id);
+            task_done(p);
+        } else if (find_task(p, w->id, &task)) {
+            run_task(p, w->id, task);
+        } else {
+            wait_for_work(p, w->id, false);
+        }
+    }
+    return NULL;
+}
+
+int pool_init(Pool* p, size_t n_workers) {
+    if (p == NULL || n_workers == 0) return 1;
+    memset(p, 0, sizeof(*p));
+    p->n_workers = n_workers;
+    p->threads = (pthread_t*)calloc(n_workers, sizeof(pthread_t));
+    p->workers = (PoolWorker*)calloc(n_workers, sizeof(PoolWorker));
+    p->deques = (TaskDeque*)calloc(n_workers, sizeof(TaskDeque));
+    if (!p->threads || !p->workers || !p->deques) return 2;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    atomic_init(&p->remaining, 0);
+    atomic_init(&p->queued, 0);
+    atomic_init(&p->sleepers, 0);
+    atomic_init(&p->stop, false);
+    for (size_t i = 0; i < n_workers; ++i) {
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+        p->workers[i].pool = p;
+        p->workers[i].id = i;
+        atomic_init(&p->workers[i].own_task, false);
+    }
+    for (size_t i = 1; i < n_workers; ++i) {
+        if (pthread_create(&p->threads[i], NULL, worker_main,
+                           &p->workers[i])) {
+            return 3;
+        }
+    }
+    return 0;
+}
+
+void pool_free(Pool* p) {
+    if (p == NULL || p->threads == NULL) return;
+    pthread_mutex_lock(&p->lock);
+    atomic_store(&p->stop, true);
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    for (size_t i = 1; i < p->n_workers; ++i) {
+        pthread_join(p->threads[i], NULL);
+    }
+    for (size_t i = 0; i < p->n_workers; ++i) {
+        pthread_mutex_destroy(&p->deques[i].lock);
+        free(p->deques[i].items);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    free(p->threads);
+    free(p->workers);
+    free(p->deques);
+    memset(p, 0, sizeof(*p));
+}
+
+int pool_run(Pool* p, TaskGraph* g) {
+    if (p == NULL || g == NULL || g->succ == NULL) return 1;
+    if (g->n_nodes == 0) return 0;
+    for (size_t i = 0; i < p->n_workers; ++i) {
+        RETURN_IF_ERROR(deque_reserve(&p->deques[i], g->n_nodes));
+    }
+    for (size_t i = 0; i < g->n_nodes; ++i) {
+        atomic_store(&g->pending[i], g->n_deps[i]);
+    }
+    p->graph = g;
+    atomic_store(&p->remaining, g->n_nodes);
+
+    size_t next_worker = 0;
+    for (size_t i = 0; i < g->n_nodes; ++i) {
+        if (g->n_deps[i] != 0) continue;
+        deque_push(p, next_worker, i);
+        next_worker = (next_worker + 1) % p->n_workers;
+    }
+
+    while (atomic_load(&p->remaining) > 0) {
+        size_t task;
+        if (find_task(p, 0, &task)) {
+            run_task(p, 0, task);
+        } else {
+            wait_for_work(p, 0, true);
+        }
+    }
+    return 0;
+}
+
+int pool_run_each(Pool* p, TaskFn fn, void* ctx) {
+    if (p == NULL || fn == NULL) return 1;
+    p->each_fn = fn;
+    p->each_ctx = ctx;
+    atomic_store(&p->remaining, p->n_workers);
+    // Under the lock so a worker about to sleep sees its flag.
+    pthread_mutex_lock(&p->lock);
+    for (size_t i = 1; i < p->n_workers; ++i) {
+        atomic_store(&p->workers[i].own_task, true);
+    }
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    fn(ctx, 0);
+    task_done(p);
+    while (atomic_load(&p->remaining) > 0) wait_for_work(p, 0, true);
+    return 0;
+}
+
+int pool_parallel_for(Pool* p, size_t n, TaskFn fn, void* ctx) {
+    TaskGraph g;
+    RETURN_IF_ERROR(task_graph_init(&g, n, fn, ctx));
+    RETURN_IF_ERROR(task_graph_finalize(&g));
+    int ret = pool_run(p, &g);
+    task_graph_free(&g);
+    return ret;
+}
@@ -0,0 +1,83 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef void (*TaskFn)(void* ctx, size_t i);
+
+// DAG of n_nodes tasks; node i runs fn(ctx, i) once all of its predecessors
+// have finished. Edges are collected with task_graph_add_edge and packed by
+// task_graph_finalize.
+typedef struct {
+    TaskFn fn;
+    void* ctx;
+    size_t n_nodes;
+    size_t* n_deps;
+    size_t* succ_start;
+    size_t* succ;
+    atomic_size_t* pending;
+    size_t* edges;
+    size_t n_edges;
+    size_t cap_edges;
+} TaskGraph;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t* items;
+    size_t cap;
+    size_t head;
+    size_t tail;
+} TaskDeque;
+
+typedef struct Pool Pool;
+
+typedef struct {
+    Pool* pool;
+    size_t id;
+    // Set by pool_run_each until this worker has taken its own task.
+    atomic_bool own_task;
+} PoolWorker;
+
+// Fixed set of workers with one deque each. Owners push and pop at the tail,
+// idle workers steal from the head of the others. The thread calling
+// pool_run acts as worker 0.
+struct Pool {
+    size_t n_workers;
+    pthread_t* threads;
+    PoolWorker* workers;
+    TaskDeque* deques;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    TaskGraph* graph;
+    TaskFn each_fn;
+    void* each_ctx;
+    atomic_size_t remaining;
+    atomic_size_t queued;
+    atomic_size_t sleepers;
+    atomic_bool stop;
+};
+
+int task_graph_init(TaskGraph* g, size_t n_nodes, TaskFn fn, void* ctx);
+
+int task_graph_add_edge(TaskGraph* g, size_t from, size_t to);
+
+int task_graph_finalize(TaskGraph* g);
+
+void task_graph_free(TaskGraph* g);
+
+int pool_init(Pool* p, size_t n_workers);
+
+void pool_free(Pool* p);
+
+int pool_run(Pool* p, TaskGraph* g);
+
+int pool_parallel_for(Pool* p, size_t n, TaskFn fn, void* ctx);
+
+// Runs fn(ctx, i) exactly once on worker i for every worker, with no
+// stealing, for work that has to happen on a particular thread such as
+// first touching memory on a pinned worker's node.
+int pool_run_each(Pool* p, TaskFn fn, void* ctx);
+
+#endif
@@ -0,0 +1,364 @@
+#include "sweep.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linalg.h"
+#include "metrics.h"
+#include "optim.h"
+#include "utils.h"
+
+static void free_tensor(Tensor* t) {
+    tensor_free(t);
+    free(t);
+}
+
+int sweep_init(Sweep* s, const size_t* sizes, size_t n_sizes, const float* lr,
+               const uint64_t* seed, size_t n_models) {
+    if (s == NULL || sizes == NULL || lr == NULL || seed == NULL) return 1;
+    if (n_sizes < 2 || n_sizes > MLP_MAX_LAYERS + 1) return 2;
+    if (n_models == 0 || n_models > SWEEP_MAX_MODELS) return 3;
+    memset(s, 0, sizeof(*s));
+    s->n_models = n_models;
+    s->n_layers = n_sizes - 1;
+    s->n_params = 2 * s->n_layers;
+    memcpy(s->sizes, sizes, n_sizes * sizeof(size_t));
+    memcpy(s->lr, lr, n_models * sizeof(float));
+    memcpy(s->seed, seed, n_models * sizeof(uint64_t));
+
+    size_t K = n_models;
+    for (size_t l = 0; l < s->n_layers; ++l) {
+        size_t in = sizes[l];
+        size_t out = sizes[l + 1];
+        s->params[2 * l] = tensor_alloc(shapeN(3, K, in, out), DTYPE_FLOAT32);
+        s->params[2 * l + 1] =
+            tensor_alloc(shapeN(3, K, 1, out), DTYPE_FLOAT32);
+    }
+    for (size_t i = 0; i < s->n_params; ++i) {
+        if (s->params[i] == NULL) return 4;
+        Shape sh = s->params[i]->shape;
+        s->grads[i] = tensor_alloc(sh, DTYPE_FLOAT32);
+        s->m[i] = tensor_alloc(sh, DTYPE_FLOAT32);
+        s->v[i] = tensor_alloc(sh, DTYPE_FLOAT32);
+        if (!s->grads[i] || !s->m[i] || !s->v[i]) return 4;
+        tensor_fill_float(s->grads[i], 0.0f);
+        tensor_fill_float(s->m[i], 0.0f);
+        tensor_fill_float(s->v[i], 0.0f);
+    }
+
+    for (size_t k = 0; k < K; ++k) {
+        RNG r;
+        rng_seed(&r, seed[k]);
+        Mlp init;
+        RETURN_IF_ERROR(mlp_init(&init, sizes, n_sizes, &r));
+        for (size_t i = 0; i < s->n_params; ++i) {
+            size_t n = init.params[i]->size;
+            memcpy((float*)s->params[i]->data + k * n, init.params[i]->data,
+                   n * sizeof(float));
+        }
+        mlp_free(&init);
+    }
+    return 0;
+}
+
+void sweep_free(Sweep* s) {
+    if (s == NULL) return;
+    for (size_t i = 0; i < s->n_params; ++i) {
+        free_tensor(s->params[i]);
+        free_tensor(s->grads[i]);
+        free_tensor(s->m[i]);
+        free_tensor(s->v[i]);
+    }
+    memset(s, 0, sizeof(*s));
+}
+
+static void* work_buffer(SweepWork* w, size_t bytes) {
+    void* p = malloc(bytes);
+    if (p != NULL) w->owned[w->n_owned++] = p;
+    return p;
+}
+
+int sweep_work_init(SweepWork* w, const Sweep* s, size_t capacity) {
+    if (w == NULL || s == NULL) return 1;
+    if (capacity == 0) return 2;
+    memset(w, 0, sizeof(*w));
+    size_t K = s->n_models;
+    size_t L = s->n_layers;
+    w->capacity = capacity;
+    w->batch = capacity;
+
+    size_t max_width = 0;
+    for (size_t l = 0; l < L; ++l) {
+        Shape sh = shapeN(3, K, capacity, s->sizes[l + 1]);
+        size_t bytes = shape_numel(sh) * sizeof(float);
+        if (s->sizes[l + 1] > max_width) max_width = s->sizes[l + 1];
+        void* pre = work_buffer(w, bytes);
+        if (pre == NULL) return 3;
+        RETURN_IF_ERROR(tensor_view(&w->pre[l], pre, sh, DTYPE_FLOAT32));
+        if (l + 1 == L) continue;
+        void* act = work_buffer(w, bytes);
+        if (act == NULL) return 3;
+        RETURN_IF_ERROR(tensor_view(&w->act[l], act, sh, DTYPE_FLOAT32));
+    }
+    for (size_t i = 0; i < 2; ++i) {
+        Shape sh = shapeN(3, K, capacity, max_width);
+        void* g = work_buffer(w, shape_numel(sh) * sizeof(float));
+        if (g == NULL) return 3;
+        RETURN_IF_ERROR(tensor_view(&w->grad[i], g, sh, DTYPE_FLOAT32));
+    }
+    void* argmax = work_buffer(w, K * capacity);
+    if (argmax == NULL) return 3;
+    RETURN_IF_ERROR(
+        tensor_view(&w->argmax, argmax, shapeN(2, K, capacity), DTYPE_UINT8));
+    return 0;
+}
+
+void sweep_work_free(SweepWork* w) {
+    if (w == NULL) return;
+    for (size_t i = 0; i < w->n_owned; ++i) free(w->owned[i]);
+    memset(w, 0, sizeof(*w));
+}
+
+static void set_batch(Tensor* t, size_t batch) {
+    t->shape.dims[1] = batch;
+    t->size = shape_numel(t->shape);
+}
+
+static const Tensor* layer_input(SweepWork* w, size_t l) {
+    return l == 0 ? &w->input : &w->act[l - 1];
+}
+
+int sweep_forward(const Sweep* s, SweepWork* w, const Tensor* x) {
+    if (s == NULL || w == NULL || x == NULL) return 1;
+    if (x->shape.rank != 3 || x->shape.dims[1] != 1 ||
+        x->shape.dims[2] != s->sizes[0])
+        return 2;
+    if (x->shape.dims[0] > w->capacity) return 3;
+
+    // [batch, 1, in] read as [1, batch, in] broadcasts over the models.
+    w->batch = x->shape.dims[0];
+    RETURN_IF_ERROR(tensor_view(&w->input, x->data,
+                                shapeN(3, 1, w->batch, s->sizes[0]),
+                                DTYPE_FLOAT32));
+    size_t L = s->n_layers;
+    for (size_t l = 0; l < L; ++l) {
+        set_batch(&w->pre[l], w->batch);
+        if (l + 1 < L) set_batch(&w->act[l], w->batch);
+    }
+    for (size_t l = 0; l < L; ++l) {
+        Tensor* pre = &w->pre[l];
+        RETURN_IF_ERROR(tensor_fill_float(pre, 0.0f));
+        RETURN_IF_ERROR(
+            bmm(pre, layer_input(w, l), s->params[2 * l], false, false));
+        RETURN_IF_ERROR(tensor_add(pre, s->params[2 * l + 1]));
+        if (l + 1 < L) {
+            RETURN_IF_ERROR(tensor_copy(&w->act[l], pre));
+            RETURN_IF_ERROR(tensor_tanh(&w->act[l]));
+        }
+    }
+    return 0;
+}
+
+// Model k's [batch, classes] block of a [K, batch, classes] tensor.
+static int model_rows(const Tensor* t, size_t k, size_t batch, size_t classes,
+                      Tensor* out) {
+    float* data = (float*)t->data + k * batch * classes;
+    return tensor_view(out, data, shapeN(2, batch, classes), DTYPE_FLOAT32);
+}
+
+int sweep_metrics(const Sweep* s, SweepWork* w, const Tensor* y) {
+    if (s == NULL || w == NULL || y == NULL) return 1;
+    size_t B = w->batch;
+    size_t classes = s->sizes[s->n_layers];
+    const Tensor* logits = &w->pre[s->n_layers - 1];
+    for (size_t k = 0; k < s->n_models; ++k) {
+        Tensor logits_k;
+        Tensor argmax;
+        RETURN_IF_ERROR(model_rows(logits, k, B, classes, &logits_k));
+        RETURN_IF_ERROR(tensor_view(&argmax, (uint8_t*)w->argmax.data + k * B,
+                                    shapeN(1, B), DTYPE_UINT8));
+        RETURN_IF_ERROR(tensor_argmax(&logits_k, &argmax));
+        RETURN_IF_ERROR(accuracy(&argmax, y, &w->acc[k]));
+        RETURN_IF_ERROR(cross_entropy(&logits_k, y, &w->loss[k]));
+    }
+    return 0;
+}
+
+int sweep_backward(Sweep* s, SweepWork* w, const Tensor* y) {
+    if (s == NULL || w == NULL || y == NULL) return 1;
+    size_t K = s->n_models;
+    size_t L = s->n_layers;
+    size_t B = w->batch;
+    size_t classes = s->sizes[L];
+    const Tensor* logits = &w->pre[L - 1];
+    size_t cur = 0;
+    for (size_t k = 0; k < K; ++k) {
+        Tensor logits_k;
+        Tensor grad_k;
+        RETURN_IF_ERROR(model_rows(logits, k, B, classes, &logits_k));
+        RETURN_IF_ERROR(model_rows(&w->grad[cur], k, B, classes, &grad_k));
+        RETURN_IF_ERROR(cross_entropy_backward(&logits_k, y, &grad_k));
+    }
+
+    for (size_t l = L; l-- > 0;) {
+        Tensor* g = &w->grad[cur];
+        RETURN_IF_ERROR(tensor_view(
+            g, g->data, shapeN(3, K, B, s->sizes[l + 1]), DTYPE_FLOAT32));
+        if (l + 1 < L) {
+            RETURN_IF_ERROR(tensor_tanh_backward(&w->pre[l], g));
+        }
+        RETURN_IF_ERROR(tensor_add_backward(g, NULL, s->grads[2 * l + 1]));
+        RETURN_IF_ERROR(tensor_fill_float(s->grads[2 * l], 0.0f));
+
+        Tensor* g_in = NULL;
+        if (l > 0) {
+            g_in = &w->grad[1 - cur];
+            RETURN_IF_ERROR(tensor_view(g_in, g_in->data,
+                                        shapeN(3, K, B, s->sizes[l]),
+                                        DTYPE_FLOAT32));
+            RETURN_IF_ERROR(tensor_fill_float(g_in, 0.0f));
+        }
+        RETURN_IF_ERROR(bmm_backward(layer_input(w, l), s->params[2 * l], g,
+                                     g_in, s->grads[2 * l]));
+        cur = 1 - cur;
+    }
+    return 0;
+}
+
+static int model_slice(const Tensor* t, size_t k, size_t n, Tensor* out) {
+    return tensor_view(out, (float*)t->data + k * n, shapeN(1, n),
+                       DTYPE_FLOAT32);
+}
+
+int sweep_adam_step(Sweep* s, float beta1, float beta2, float eps, size_t t) {
+    if (s == NULL) return 1;
+    for (size_t i = 0; i < s->n_params; ++i) {
+        size_t n = s->params[i]->size / s->n_models;
+        for (size_t k = 0; k < s->n_models; ++k) {
+            Tensor grad, param, m, v;
+            RETURN_IF_ERROR(model_slice(s->grads[i], k, n, &grad));
+            RETURN_IF_ERROR(model_slice(s->params[i], k, n, &param));
+            RETURN_IF_ERROR(model_slice(s->m[i], k, n, &m));
+            RETURN_IF_ERROR(model_slice(s->v[i], k, n, &v));
+            RETURN_IF_ERROR(adam_step(s->lr[k], beta1, beta2, eps, t, &grad,
+                                      &param, &m, &v));
+        }
+    }
+    return 0;
+}
+
+int sweep_run(const Config* c, Dataset* d, Dataset* d_test, RNG* r) {
+    if (c == NULL || d == NULL || d_test == NULL || r == NULL) return 1;
+    size_t n_lr = c->n_sweep_lr ? c->n_sweep_lr : 1;
+    size_t n_seeds = c->n_sweep_seeds ? c->n_sweep_seeds : 1;
+    if (n_lr * n_seeds > SWEEP_MAX_MODELS) {
+        printf("sweep of %zu models exceeds %d\n", n_lr * n_seeds,
+               SWEEP_MAX_MODELS);
+        return 2;
+    }
+    float lr[SWEEP_MAX_MODELS];
+    uint64_t seed[SWEEP_MAX_MODELS];
+    size_t K = 0;
+    for (size_t i = 0; i < n_seeds; ++i) {
+        for (size_t j = 0; j < n_lr; ++j) {
+            lr[K] = c->n_sweep_lr ? c->sweep_lr[j] : c->lr;
+            seed[K] = c->n_sweep_seeds ? c->sweep_seeds[i] : c->seed;
+            K++;
+        }
+    }
+
+    size_t batch_size = c->batch_size;
+    Sweep s;
+    SweepWork w;
+    RETURN_IF_ERROR(sweep_init(&s, c->sizes, c->n_sizes, lr, seed, K));
+    RETURN_IF_ERROR(sweep_work_init(&w, &s, batch_size));
+    Shape x_shape = d->x->shape;
+    x_shape.dims[0] = batch_size;
+    Shape y_shape = d->y->shape;
+    y_shape.dims[0] = batch_size;
+    Tensor* batch_x = tensor_alloc(x_shape, DTYPE_FLOAT32);
+    Tensor* batch_y = tensor_alloc(y_shape, DTYPE_UINT8);
+    if (!batch_x || !batch_y) return 3;
+
+    // Intervals are reported for the model with the lowest loss over them,
+    // epochs for every model.
+    MetricsWriter writer;
+    RETURN_IF_ERROR(metrics_writer_init(&writer, c->metrics_file));
+    MetricsSums interval[SWEEP_MAX_MODELS] = {0};
+    MetricsSums epoch[SWEEP_MAX_MODELS] = {0};
+    size_t t = 0;
+    for (size_t ep = 0; ep < c->epochs; ++ep) {
+        double epoch_start = wall_time();
+        double interval_start = epoch_start;
+        dataset_rand_perm(d->x, d->y, r);
+        for (size_t batch = 0; batch + batch_size <= d->n;
+             batch += batch_size) {
+            RETURN_IF_ERROR(
+                tensor_slice(d->x, batch_x, 0, batch, batch + batch_size));
+            RETURN_IF_ERROR(
+                tensor_slice(d->y, batch_y, 0, batch, batch + batch_size));
+            t++;
+            RETURN_IF_ERROR(sweep_forward(&s, &w, batch_x));
+            RETURN_IF_ERROR(sweep_metrics(&s, &w, batch_y));
+            RETURN_IF_ERROR(sweep_backward(&s, &w, batch_y));
+            for (size_t k = 0; k < K; ++k) {
+                metrics_add(&interval[k], w.loss[k], w.acc[k], batch_size);
+                metrics_add(&epoch[k], w.loss[k], w.acc[k], batch_size);
+            }
+            if (t % c->metrics_every == 0) {
+                double now = wall_time();
+                size_t best = 0;
+                for (size_t k = 1; k < K; ++k) {
+                    if (interval[k].loss < interval[best].loss) best = k;
+                }
+                MetricsRecord rec = {ep, t, false, now - interval_start,
+                                     interval[best], (int)best};
+                metrics_writer_push(&writer, &rec);
+                memset(interval, 0, sizeof(interval));
+                interval_start = now;
+            }
+            RETURN_IF_ERROR(
+                sweep_adam_step(&s, c->beta1, c->beta2, c->eps, t));
+        }
+        double seconds = wall_time() - epoch_start;
+        for (size_t k = 0; k < K; ++k) {
+            MetricsRecord rec = {ep, t, true, seconds, epoch[k], (int)k};
+            metrics_writer_push(&writer, &rec);
+        }
+        memset(epoch, 0, sizeof(epoch));
+        memset(interval, 0, sizeof(interval));
+    }
+    metrics_writer_free(&writer);
+
+    double loss_sum[SWEEP_MAX_MODELS] = {0};
+    double acc_sum[SWEEP_MAX_MODELS] = {0};
+    size_t batches = 0;
+    for (size_t batch = 0; batch + batch_size <= d_test->n;
+         batch += batch_size) {
+        RETURN_IF_ERROR(
+            tensor_slice(d_test->x, batch_x, 0, batch, batch + batch_size));
+        RETURN_IF_ERROR(
+            tensor_slice(d_test->y, batch_y, 0, batch, batch + batch_size));
+        RETURN_IF_ERROR(sweep_forward(&s, &w, batch_x));
+        RETURN_IF_ERROR(sweep_metrics(&s, &w, batch_y));
+        for (size_t k = 0; k < K; ++k) {
+            loss_sum[k] += w.loss[k];
+            acc_sum[k] += w.acc[k];
+        }
+        batches++;
+    }
+    for (size_t k = 0; batches > 0 && k < K; ++k) {
+        printf("model %zu lr = %g seed = %llu test loss = %.5f acc = %.5f\n", k,
+               s.lr[k], (unsigned long long)s.seed[k], loss_sum[k] / batches,
+               acc_sum[k] / batches);
+    }
+
+    tensor_free(batch_x);
+    tensor_free(batch_y);
+    free(batch_x);
+    free(batch_y);
+    sweep_work_free(&w);
+    sweep_free(&s);
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "dataset.h"
+#include "model.h"
+#include "rng.h"
+#include "tensor.h"
+
+// K models of the same shape trained side by side on the same batches.
+// Layer l keeps all K weights as one [K, in, out] tensor and the biases as
+// [K, 1, out], so every layer is a single bmm over the model dimension. Model
+// k starts from the same weights as mlp_init with seed[k] and steps with
+// lr[k].
+typedef struct {
+    size_t n_models;
+    size_t n_layers;
+    size_t sizes[MLP_MAX_LAYERS + 1];
+    size_t n_params;
+    Tensor* params[MLP_MAX_PARAMS];
+    Tensor* grads[MLP_MAX_PARAMS];
+    Tensor* m[MLP_MAX_PARAMS];
+    Tensor* v[MLP_MAX_PARAMS];
+    float lr[SWEEP_MAX_MODELS];
+    uint64_t seed[SWEEP_MAX_MODELS];
+} Sweep;
+
+// Activations of all models for at most `capacity` samples, each [K, batch,
+// width]. loss and acc hold the per-model metrics of the last forward.
+typedef struct {
+    size_t capacity;
+    size_t batch;
+    Tensor input;
+    Tensor pre[MLP_MAX_LAYERS];
+    Tensor act[MLP_MAX_LAYERS];
+    Tensor grad[2];
+    Tensor argmax;
+    void* owned[2 * MLP_MAX_LAYERS + 3];
+    size_t n_owned;
+    float loss[SWEEP_MAX_MODELS];
+    float acc[SWEEP_MAX_MODELS];
+} SweepWork;
+
+int sweep_init(Sweep* s, const size_t* sizes, size_t n_sizes, const float* lr,
+               const uint64_t* seed, size_t n_models);
+
+void sweep_free(Sweep* s);
+
+int sweep_work_init(SweepWork* w, const Sweep* s, size_t capacity);
+
+void sweep_work_free(SweepWork* w);
+
+// x is the shared [batch, 1, in] input, seen by every model.
+int sweep_forward(const Sweep* s, SweepWork* w, const Tensor* x);
+
+int sweep_metrics(const Sweep* s, SweepWork* w, const Tensor* y);
+
+int sweep_backward(Sweep* s, SweepWork* w, const Tensor* y);
+
+int sweep_adam_step(Sweep* s, float beta1, float beta2, float eps, size_t t);
+
+// Trains the cross product of c->sweep_lr and c->sweep_seeds on d, shuffled
+// with r, and prints each model's test metrics on d_test.
+int sweep_run(const Config* c, Dataset* d, Dataset* d_test, RNG* r);
+
+#endif
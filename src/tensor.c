@@ -59,6 +59,18 @@ int tensor_init(Tensor* t, const Shape shape, const Dtype dtype) {
     return 0;
 }
 
+// Points t at memory owned by someone else; t must not be passed to
+// tensor_free.
+int tensor_view(Tensor* t, void* data, const Shape shape, const Dtype dtype) {
+    if (!t || !data) return 1;
+    if (shape.rank > MAX_RANK) return 2;
+    t->data = data;
+    t->shape = shape;
+    t->size = shape_numel(shape);
+    t->dtype = dtype;
+    return 0;
+}
+
 void tensor_free(Tensor* t) {
     if (!t) return;
     free(t->data);
@@ -383,6 +395,29 @@ int tensor_slice(const Tensor* src, Tensor* dest, size_t dim, size_t start,
     return 0;
 }
 
+// Copies rows[i] of src (along dim 0) to row i of dest.
+int tensor_gather(const Tensor* src, Tensor* dest, const size_t* rows,
+                  size_t n) {
+    if (!src || !dest || !rows) return 1;
+    if (src->shape.rank != dest->shape.rank || src->dtype != dest->dtype) {
+        return 2;
+    }
+    if (dest->shape.dims[0] != n) return 3;
+    for (size_t i = 1; i < src->shape.rank; ++i) {
+        if (src->shape.dims[i] != dest->shape.dims[i]) return 4;
+    }
+    size_t src_rows = src->shape.dims[0];
+    size_t row_bytes = tensor_byte_count(src) / src_rows;
+    const uint8_t* src_data = (const uint8_t*)src->data;
+    uint8_t* dest_data = (uint8_t*)dest->data;
+    for (size_t i = 0; i < n; ++i) {
+        if (rows[i] >= src_rows) return 5;
+        memcpy(dest_data + i * row_bytes, src_data + rows[i] * row_bytes,
+               row_bytes);
+    }
+    return 0;
+}
+
 bool shape_is_equal(const Shape a, const Shape b) {
     if (a.rank != b.rank) {
         return false;
@@ -534,16 +569,10 @@ int tensor_scale_and_add_const(Tensor* y, float a, float b) {
     return 0;
 }
 
-int dataset_rand_perm(Tensor* x, Tensor* y, RNG* r) {
-    CHECK(x != NULL);
-    CHECK(y != NULL);
-    CHECK(x->shape.dims[0] == y->shape.dims[0]);
-    CHECK(x->dtype == DTYPE_FLOAT32);
-    CHECK(y->dtype == DTYPE_UINT8);
-
-    size_t n = x->shape.dims[0];
-
+// Fisher-Yates shuffle of 0..n-1 drawn from r.
+static int* rand_perm(size_t n, RNG* r) {
     int* perm = (int*)malloc(sizeof(int) * n);
+    if (perm == NULL) return NULL;
     for (size_t i = 0; i < n; ++i) {
         perm[i] = i;
         size_t target_pos = (size_t)rng_rand(r) % (i + 1);
@@ -552,6 +581,20 @@ int dataset_rand_perm(Tensor* x, Tensor* y, RNG* r) {
         perm[i] = perm[target_pos];
         perm[target_pos] = tmp;
     }
+    return perm;
+}
+
+int dataset_rand_perm(Tensor* x, Tensor* y, RNG* r) {
+    CHECK(x != NULL);
+    CHECK(y != NULL);
+    CHECK(x->shape.dims[0] == y->shape.dims[0]);
+    CHECK(x->dtype == DTYPE_FLOAT32);
+    CHECK(y->dtype == DTYPE_UINT8);
+
+    size_t n = x->shape.dims[0];
+
+    int* perm = rand_perm(n, r);
+    CHECK(perm != NULL);
 
     float* x_data = (float*)x->data;
     uint8_t* y_data = (uint8_t*)y->data;
@@ -587,5 +630,37 @@ int dataset_rand_perm(Tensor* x, Tensor* y, RNG* r) {
         }
     }
 
+    free(perm);
+    free(x_buffer);
+    free(y_buffer);
+    return 0;
+}
+
+int dataset_rand_perm_index(size_t* index, size_t n, RNG* r) {
+    CHECK(index != NULL);
+
+    int* perm = rand_perm(n, r);
+    CHECK(perm != NULL);
+
+    // Same swaps as dataset_rand_perm, applied to row numbers.
+    for (size_t i = 0; i < n; ++i) {
+        if (perm[i] == -1) {
+            continue;
+        }
+        size_t j = i;
+        while (true) {
+            size_t k = perm[j];
+            size_t tmp = index[k];
+            index[k] = index[j];
+            index[j] = tmp;
+            perm[j] = -1;
+            j = k;
+            if (j == i) {
+                break;
+            }
+        }
+    }
+
+    free(perm);
     return 0;
 }
@@ -27,6 +27,8 @@ Tensor* tensor_alloc(const Shape shape, const Dtype dtype);
 
 int tensor_init(Tensor* t, const Shape shape, const Dtype dtype);
 
+int tensor_view(Tensor* t, void* data, const Shape shape, const Dtype dtype);
+
 void tensor_free(Tensor* t);
 
 size_t tensor_size(const Tensor* t);
@@ -84,6 +86,9 @@ int tensor_expand(const Tensor* src, Tensor* dest);
 int tensor_slice(const Tensor* src, Tensor* dest, size_t dim, size_t start,
                  size_t end);
 
+int tensor_gather(const Tensor* src, Tensor* dest, const size_t* rows,
+                  size_t n);
+
 Shape shape1(size_t d0);
 
 Shape shape2(size_t d0, size_t d1);
@@ -108,4 +113,8 @@ int tensor_scale_and_add_const(Tensor* y, float a, float b);
 
 int dataset_rand_perm(Tensor* x, Tensor* y, RNG* r);
 
+// Shuffles the row numbers in index the way dataset_rand_perm shuffles rows,
+// so rows index[0..n) of an untouched dataset match the permuted one.
+int dataset_rand_perm_index(size_t* index, size_t n, RNG* r);
+
 #endif
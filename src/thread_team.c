@@ -0,0 +1,119 @@
+#include "thread_team.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+typedef struct {
+    ThreadTeam* t;
+    size_t slice;
+    size_t checkpoint_every;
+} InitTask;
+
+// Run on worker i, so slice i's buffers are allocated and first touched by
+// the worker that runs that slice every step.
+static void init_task(void* ctx, size_t i) {
+    InitTask* it = (InitTask*)ctx;
+    ThreadTeam* t = it->t;
+    t->ret[i] = mlp_work_init(&t->work[i], t->m, it->slice,
+                              it->checkpoint_every);
+    if (t->ret[i] == 0) t->ret[i] = mlp_grads_alloc(t->m, t->grads[i]);
+}
+
+int thread_team_init(ThreadTeam* t, Pool* pool, const Mlp* m,
+                     size_t capacity, size_t checkpoint_every) {
+    if (t == NULL || pool == NULL || m == NULL || capacity == 0) return 1;
+    if (pool->n_workers > THREAD_TEAM_MAX) return 2;
+    memset(t, 0, sizeof(*t));
+    t->pool = pool;
+    t->n = pool->n_workers;
+    t->m = m;
+    InitTask it = {t, (capacity + t->n - 1) / t->n, checkpoint_every};
+    RETURN_IF_ERROR(pool_run_each(pool, init_task, &it));
+    for (size_t i = 0; i < t->n; ++i) RETURN_IF_ERROR(t->ret[i]);
+    return 0;
+}
+
+void thread_team_free(ThreadTeam* t) {
+    if (t == NULL || t->m == NULL) return;
+    for (size_t i = 0; i < t->n; ++i) {
+        mlp_work_free(&t->work[i]);
+        mlp_grads_free(t->m, t->grads[i]);
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+static int run_slice(ThreadTeam* t, size_t i) {
+    size_t lo = t->lo[i];
+    size_t n = t->lo[i + 1] - lo;
+    if (n == 0) return 0;
+    size_t width = t->x->shape.dims[2];
+    Tensor x;
+    Tensor y;
+    RETURN_IF_ERROR(tensor_view(&x, (float*)t->x->data + lo * width,
+                                shapeN(3, n, 1, width), DTYPE_FLOAT32));
+    RETURN_IF_ERROR(tensor_view(&y, (uint8_t*)t->y->data + lo, shapeN(1, n),
+                                DTYPE_UINT8));
+    RETURN_IF_ERROR(mlp_forward(t->m, &t->work[i], &x));
+    RETURN_IF_ERROR(mlp_metrics(&t->work[i], &y, &t->loss[i], &t->acc[i]));
+    if (!t->train) return 0;
+    return mlp_backward(t->m, &t->work[i], &x, &y, t->grads[i]);
+}
+
+static void slice_task(void* ctx, size_t i) {
+    ThreadTeam* t = (ThreadTeam*)ctx;
+    t->ret[i] = run_slice(t, i);
+}
+
+// Sums parameter p's gradient over the slices.
+static void reduce_task(void* ctx, size_t p) {
+    ThreadTeam* t = (ThreadTeam*)ctx;
+    size_t batch = t->lo[t->n];
+    tensor_fill_float(t->out[p], 0.0f);
+    for (size_t i = 0; i < t->n; ++i) {
+        size_t n = t->lo[i + 1] - t->lo[i];
+        if (n == 0) continue;
+        tensor_scale_and_add(t->out[p], (float)n / (float)batch,
+                             t->grads[i][p]);
+    }
+}
+
+static int run(ThreadTeam* t, const Tensor* x, const Tensor* y, bool train,
+               float* loss, float* acc) {
+    size_t batch = x->shape.dims[0];
+    if (batch == 0 || (batch + t->n - 1) / t->n > t->work[0].capacity) {
+        return 2;
+    }
+    t->x = x;
+    t->y = y;
+    t->train = train;
+    for (size_t i = 0; i <= t->n; ++i) t->lo[i] = batch * i / t->n;
+    RETURN_IF_ERROR(pool_run_each(t->pool, slice_task, t));
+    float loss_sum = 0.0f;
+    float acc_sum = 0.0f;
+    for (size_t i = 0; i < t->n; ++i) {
+        RETURN_IF_ERROR(t->ret[i]);
+        float share = (float)(t->lo[i + 1] - t->lo[i]) / (float)batch;
+        if (share == 0.0f) continue;
+        loss_sum += share * t->loss[i];
+        acc_sum += share * t->acc[i];
+    }
+    if (loss != NULL) *loss = loss_sum;
+    if (acc != NULL) *acc = acc_sum;
+    return 0;
+}
+
+int thread_team_step(ThreadTeam* t, const Tensor* x, const Tensor* y,
+                     Tensor** grads, float* loss, float* acc) {
+    if (t == NULL || x == NULL || y == NULL || grads == NULL) return 1;
+    RETURN_IF_ERROR(run(t, x, y, true, loss, acc));
+    t->out = grads;
+    return pool_parallel_for(t->pool, t->m->n_params, reduce_task, t);
+}
+
+int thread_team_eval(ThreadTeam* t, const Tensor* x, const Tensor* y,
+                     float* loss, float* acc) {
+    if (t == NULL || x == NULL || y == NULL) return 1;
+    return run(t, x, y, false, loss, acc);
+}
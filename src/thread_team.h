@@ -0,0 +1,50 @@
+#ifndef THREAD_TEAM_H
+#define THREAD_TEAM_H
+
+#include <stddef.h>
+
+#include "model.h"
+#include "pool.h"
+#include "tensor.h"
+
+#define THREAD_TEAM_MAX 64
+
+// Data parallelism inside one process: each batch is cut into one slice per
+// pool worker, every slice runs forward and backward with its own
+// activations and gradients against the shared model, and the per-slice
+// gradients are then summed, weighted by slice size, into one set. Nothing
+// here calls back into the caller from the workers, so the caller can be
+// the only thread talking to MPI.
+typedef struct {
+    Pool* pool;
+    size_t n;
+    const Mlp* m;
+    MlpWork work[THREAD_TEAM_MAX];
+    Tensor* grads[THREAD_TEAM_MAX][MLP_MAX_PARAMS];
+    // Current batch, its slices and the gradients they are summed into.
+    const Tensor* x;
+    const Tensor* y;
+    Tensor** out;
+    bool train;
+    size_t lo[THREAD_TEAM_MAX + 1];
+    float loss[THREAD_TEAM_MAX];
+    float acc[THREAD_TEAM_MAX];
+    int ret[THREAD_TEAM_MAX];
+} ThreadTeam;
+
+// One slice per worker of pool, for batches of up to `capacity` samples.
+int thread_team_init(ThreadTeam* t, Pool* pool, const Mlp* m,
+                     size_t capacity, size_t checkpoint_every);
+
+void thread_team_free(ThreadTeam* t);
+
+// Forward and backward over x and y. grads receives the gradients of the
+// mean loss over the whole batch, loss and acc its mean loss and accuracy.
+int thread_team_step(ThreadTeam* t, const Tensor* x, const Tensor* y,
+                     Tensor** grads, float* loss, float* acc);
+
+// Forward only.
+int thread_team_eval(ThreadTeam* t, const Tensor* x, const Tensor* y,
+                     float* loss, float* acc);
+
+#endif
@@ -0,0 +1,64 @@
+#include "topk.h"
+
+#include <math.h>
+
+// k-th largest of a[0..n), 1 <= k <= n. Reorders a.
+static float kth_largest(float* a, size_t n, size_t k) {
+    size_t lo = 0;
+    size_t hi = n - 1;
+    size_t target = k - 1;
+    while (lo < hi) {
+        float pivot = a[lo + (hi - lo) / 2];
+        size_t i = lo;
+        size_t j = hi;
+        while (i <= j) {
+            while (a[i] > pivot) ++i;
+            while (a[j] < pivot) --j;
+            if (i <= j) {
+                float tmp = a[i];
+                a[i] = a[j];
+                a[j] = tmp;
+                ++i;
+                if (j == 0) break;
+                --j;
+            }
+        }
+        if (target <= j) {
+            hi = j;
+        } else if (target >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+    return a[target];
+}
+
+size_t topk_select(const float* r, size_t n, size_t k, float threshold,
+                   float* scratch, size_t* picked) {
+    if (k == 0) return 0;
+    // Entries above the cut always go; ties at the cut fill up to k.
+    float cut = 0.0f;
+    if (k < n) {
+        for (size_t i = 0; i < n; ++i) scratch[i] = fabsf(r[i]);
+        cut = kth_largest(scratch, n, k);
+    }
+    float bound = threshold > cut ? threshold : cut;
+    size_t ties = 0;
+    size_t taken = 0;
+    for (size_t i = 0; i < n; ++i) {
+        float a = fabsf(r[i]);
+        if (a > bound && a > 0.0f) ++taken;
+    }
+    size_t n_picked = 0;
+    for (size_t i = 0; i < n; ++i) {
+        float a = fabsf(r[i]);
+        if (a == 0.0f || a < bound) continue;
+        if (a == bound) {
+            if (taken + ties >= k) continue;
+            ++ties;
+        }
+        picked[n_picked++] = i;
+    }
+    return n_picked;
+}
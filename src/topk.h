@@ -0,0 +1,13 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stddef.h>
+
+// Picks the at most k entries of r[0..n) largest in magnitude, skipping
+// zeros and entries below threshold; ties at the k-th magnitude are taken
+// in index order until there are k. Writes their indices to picked in
+// ascending order and returns how many there are. scratch holds n floats.
+size_t topk_select(const float* r, size_t n, size_t k, float threshold,
+                   float* scratch, size_t* picked);
+
+#endif
@@ -0,0 +1,168 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    const char* name;
+    double start;
+    double end;
+    bool async;
+} TraceEvent;
+
+// One per thread that ever recorded; they live as long as the process, so
+// threads that have exited still show up.
+typedef struct TraceRing {
+    TraceEvent* events;
+    // Events ever recorded; the last TRACE_RING_EVENTS of them are kept.
+    size_t n;
+    int tid;
+    struct TraceRing* next;
+} TraceRing;
+
+bool trace_on = false;
+static int trace_pid;
+static double trace_origin;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing* rings;
+static int n_rings;
+static _Thread_local TraceRing* own;
+
+void trace_enable(int pid) {
+    trace_pid = pid;
+    trace_origin = wall_time();
+    trace_on = true;
+}
+
+static TraceRing* own_ring(void) {
+    if (own != NULL) return own;
+    TraceRing* r = (TraceRing*)calloc(1, sizeof(TraceRing));
+    if (r == NULL) return NULL;
+    r->events = (TraceEvent*)malloc(TRACE_RING_EVENTS * sizeof(TraceEvent));
+    if (r->events == NULL) {
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    r->tid = n_rings++;
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    own = r;
+    return r;
+}
+
+void trace_record(const char* name, double start, double end, bool async) {
+    TraceRing* r = own_ring();
+    if (r == NULL) return;
+    TraceEvent* e = &r->events[r->n++ % TRACE_RING_EVENTS];
+    e->name = name;
+    e->start = start;
+    e->end = end;
+    e->async = async;
+}
+
+void trace_clear(void) {
+    pthread_mutex_lock(&rings_lock);
+    for (TraceRing* r = rings; r != NULL; r = r->next) r->n = 0;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    bool failed;
+} Text;
+
+static void append(Text* t, const char* fmt, ...) {
+    if (t->failed) return;
+    for (;;) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(t->data + t->len, t->cap - t->len, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            t->failed = true;
+            return;
+        }
+        if (t->len + (size_t)n < t->cap) {
+            t->len += (size_t)n;
+            return;
+        }
+        size_t cap = 2 * t->cap + (size_t)n + 1;
+        char* data = (char*)realloc(t->data, cap);
+        if (data == NULL) {
+            t->failed = true;
+            return;
+        }
+        t->data = data;
+        t->cap = cap;
+    }
+}
+
+// Microseconds since trace_enable.
+static double us(double t) { return (t - trace_origin) * 1e6; }
+
+static void append_ring(Text* t, const TraceRing* r) {
+    int pid = trace_pid;
+    append(t,
+           ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+           "\"args\":{\"name\":\"thread %d\"}}",
+           pid, r->tid, r->tid);
+    size_t first = r->n > TRACE_RING_EVENTS ? r->n - TRACE_RING_EVENTS : 0;
+    for (size_t i = first; i < r->n; ++i) {
+        const TraceEvent* e = &r->events[i % TRACE_RING_EVENTS];
+        if (!e->async) {
+            append(t,
+                   ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                   "\"ts\":%.3f,\"dur\":%.3f}",
+                   e->name, pid, r->tid, us(e->start), us(e->end) -
+                   us(e->start));
+            continue;
+        }
+        unsigned long long id = ((unsigned long long)r->tid << 32) | i;
+        for (size_t k = 0; k < 2; ++k) {
+            append(t,
+                   ",\n{\"name\":\"%s\",\"cat\":\"async\",\"ph\":\"%c\","
+                   "\"id\":%llu,\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+                   e->name, k == 0 ? 'b' : 'e', id, pid, r->tid,
+                   us(k == 0 ? e->start : e->end));
+        }
+    }
+}
+
+char* trace_events_json(size_t* len) {
+    Text t = {0};
+    t.cap = 4096;
+    t.data = (char*)malloc(t.cap);
+    if (t.data == NULL) return NULL;
+    append(&t,
+           "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+           "\"args\":{\"name\":\"rank %d\"}}",
+           trace_pid, trace_pid);
+    pthread_mutex_lock(&rings_lock);
+    for (const TraceRing* r = rings; r != NULL; r = r->next) {
+        append_ring(&t, r);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if (t.failed) {
+        free(t.data);
+        return NULL;
+    }
+    if (len != NULL) *len = t.len;
+    return t.data;
+}
+
+int trace_write_file(const char* path, const char* events, size_t len) {
+    if (path == NULL || events == NULL) return 1;
+    FILE* f = fopen(path, "w");
+    if (f == NULL) return 2;
+    fprintf(f, "{\"traceEvents\":[\n");
+    fwrite(events, 1, len, f);
+    fprintf(f, "\n]}\n");
+    return fclose(f) ? 3 : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+#include "utils.h"
+
+// Events kept per thread; older ones are overwritten.
+#define TRACE_RING_EVENTS (1 << 16)
+
+// Timed spans in per-thread ring buffers, exported as Chrome trace JSON
+// (chrome://tracing, ui.perfetto.dev). Callers time a span with
+//
+//     double t0 = trace_now();
+//     ...
+//     trace_span("name", t0);
+//
+// which costs one branch while tracing is off. Names must outlive the
+// trace, i.e. be string literals.
+extern bool trace_on;
+
+// Starts recording; pid names this process in the trace.
+void trace_enable(int pid);
+
+static inline double trace_now(void) { return trace_on ? wall_time() : 0.0; }
+
+void trace_record(const char* name, double start, double end, bool async);
+
+// Drops the events recorded so far; no thread may be recording.
+void trace_clear(void);
+
+// A span on the calling thread's track; spans on one thread must nest.
+static inline void trace_span(const char* name, double start) {
+    if (trace_on) trace_record(name, start, wall_time(), false);
+}
+
+// A span that may overlap others on the thread, such as a nonblocking
+// collective from when it was started to when it was found complete.
+static inline void trace_async(const char* name, double start) {
+    if (trace_on) trace_record(name, start, wall_time(), true);
+}
+
+// The events of every thread so far as comma separated JSON objects,
+// malloc'ed and NUL terminated; *len excludes the NUL.
+char* trace_events_json(size_t* len);
+
+// {"traceEvents": [...]} around the given comma separated events.
+int trace_write_file(const char* path, const char* events, size_t len);
+
+#endif
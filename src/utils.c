@@ -55,3 +55,36 @@ on_error:
   }
   return NULL;
 }
+
+int file_size(const char *path, size_t *n) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return 1;
+  }
+  long size = -1;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    size = ftell(file);
+  }
+  fclose(file);
+  if (size < 0) {
+    return 2;
+  }
+  *n = (size_t)size;
+  return 0;
+}
+
+int read_into(const char *path, void *buffer, size_t n) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return 1;
+  }
+  size_t got = fread(buffer, 1, n, file);
+  fclose(file);
+  return got == n ? 0 : 2;
+}
+
+double wall_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
@@ -25,4 +25,11 @@ void return_if_error_body(int code, char* msg);
 
 void* read_all(const char* path, size_t* n);
 
+int file_size(const char* path, size_t* n);
+
+// Reads the first n bytes of path into buffer.
+int read_into(const char* path, void* buffer, size_t n);
+
+double wall_time(void);
+
 #endif